@@ -1,9 +1,27 @@
 #ifndef NBT_DYNAMICS_ENGINE_HPP
 #define NBT_DYNAMICS_ENGINE_HPP
 
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <utility>
+#include <algorithm>
+#include <functional>
+
 #include <Eigen>
 #include "octree.hpp"
+#include "linear_octree.hpp"
+#include "force_kernel.hpp"
+#include "force_law.hpp"
 #include "units.hpp"
+#include "thread_pool.hpp"
+
+/**
+ * Called by DynamicsEngine::updateAccelerationsPipelined() once the accelerations of a set of bodies are final.
+ * The bodies are indices[begin] to indices[end - 1], or begin to end - 1 if indices is nullptr.
+ * May run on any thread of the engine, concurrently with other calls and with the rest of the force pass.
+ */
+typedef std::function<void(const int* indices, int begin, int end)> AccelerationsReady;
 
 /**
  * Abstract class for Dynamics engines.
@@ -12,6 +30,22 @@
  */
 class DynamicsEngine {
     public:
+        ThreadPool threadPool;  //!< Worker threads shared by every parallel phase of the engine.
+
+        bool computePotentials = false;     //!< Also compute #potentials in updateAccelerations().
+        bool computeTidalTensors = false;   //!< Also compute #tidalTensors in updateAccelerations().
+        Eigen::RowVectorXd potentials;                      //!< Potential at each particle from the last updateAccelerations() with #computePotentials set. Twice the sum of pairPotentialEnergy() for a unit mass at the particle, which is phi for gravitation.
+        Eigen::Matrix<double, 9, Eigen::Dynamic> tidalTensors;  //!< Second derivatives of the potential at each particle from the last updateAccelerations() with #computeTidalTensors set. Column i holds a column-major 3x3 matrix.
+
+        /**
+         * @brief Construct a DynamicsEngine object.
+         * 
+         * @param nThreads Number of threads used by parallel phases. 0 uses every hardware thread.
+         */
+        DynamicsEngine(unsigned nThreads = 0);
+
+        virtual ~DynamicsEngine() = default;
+
         /**
          * @brief Recalculates acceleration matrix using object positions and masses
          * 
@@ -23,6 +57,53 @@ class DynamicsEngine {
                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                          const Eigen::Ref<const Eigen::RowVectorXd>& m) = 0;
         
+        /**
+         * @brief Recalculates acceleration matrix like updateAccelerations(), calling ready for each work unit's bodies as soon as
+         *        their accelerations are final. Lets callers update those bodies while they are still in cache.
+         *        ready must not write to x or m, which the rest of the pass still reads.
+         *        Default implementation calls ready in chunks on #threadPool after the whole pass.
+         * 
+         * @param a Acceleration matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         * @param ready Called with the bodies of each finished work unit. Ignored if empty.
+         */
+        virtual void updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                  const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                  const AccelerationsReady& ready);
+
+        /**
+         * @brief Recalculates the accelerations of the particles listed in active only, from the positions and masses of every particle.
+         *        Other columns of a are left untouched. Used by block timesteps, where only some particles need new forces.
+         *        Default implementation sums pairAcceleration() over every particle for each active one, with active particles spread across #threadPool.
+         * 
+         * @param a Acceleration matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         * @param active Indices of the particles to update
+         */
+        virtual void updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                               const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                               const std::vector<int>& active);
+
+        /**
+         * @brief Recalculates the acceleration and jerk (time derivative of the acceleration) of every particle.
+         *        Default implementation visits every pair with pairAccelerationJerk(), with particles spread across #threadPool. O(n^2)
+         * 
+         * @param a Acceleration matrix
+         * @param jerk Jerk matrix
+         * @param x Position matrix
+         * @param v Velocity matrix
+         * @param m Mass vector
+         */
+        virtual void updateAccelerationsAndJerks(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                 Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                                 const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
         /**
          * @brief Updates the individual acceleration between particles i and j
          * 
@@ -37,9 +118,46 @@ class DynamicsEngine {
                                       const Eigen::Vector3d& x_j,
                                       double m_i,
                                       double m_j) = 0;
+
+        /**
+         * @brief Adds the acceleration of particle i due to a contiguous block of sources.
+         *        Sources at exactly x_i contribute nothing, so a block may contain i itself.
+         *        Engines route their inner loops through this function, so force laws can
+         *        override it with a vectorized kernel. Default implementation calls pairAcceleration() for every source.
+         * 
+         * @param a_i Acceleration of i
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param sources Positions and masses of the sources
+         */
+        virtual void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                                       const Eigen::Vector3d& x_i,
+                                       double m_i,
+                                       const SourceBlock& sources);
+
+        /**
+         * @brief Adds the acceleration of particle i due to a contiguous block of sources like batchAcceleration() and,
+         *        while the block is in cache, the potential of a unit mass at x_i to *phi_i and the tidal tensor to *T_i,
+         *        each only if not nullptr. Default implementation calls batchAcceleration(), batchPotentialEnergy()
+         *        and batchTidalTensor() on the block.
+         * 
+         * @param a_i Acceleration of i
+         * @param phi_i Potential at i, or nullptr
+         * @param T_i Tidal tensor at i, or nullptr
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param sources Positions and masses of the sources
+         */
+        virtual void batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                              double* phi_i,
+                                              Eigen::Matrix3d* T_i,
+                                              const Eigen::Vector3d& x_i,
+                                              double m_i,
+                                              const SourceBlock& sources);
         
         /**
          * @brief Returns the potential energy of a system based on particle positions and masses.
+         *        Sums the per-particle energies of updatePotentialEnergies().
          * 
          * @param x Position matrix
          * @param m Mass vector
@@ -48,6 +166,19 @@ class DynamicsEngine {
          */
         double totalPotentialEnergy(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                     const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Computes the potential energy of each particle, the sum of pairPotentialEnergy() over every other particle.
+         *        The energies of all particles add up to the potential energy of the system.
+         *        Default implementation visits every pair, with particles spread across #threadPool. O(n^2)
+         * 
+         * @param u Potential energy vector
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                             const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                             const Eigen::Ref<const Eigen::RowVectorXd>& m);
         
         /**
          * @brief Returns the potential energy between a pair of particles i and j.
@@ -64,6 +195,94 @@ class DynamicsEngine {
                                            const Eigen::Vector3d& x_j,
                                            double m_i,
                                            double m_j);
+
+        /**
+         * @brief Adds the acceleration of i due to j to a_i, and its time derivative for velocities v_i and v_j to j_i.
+         *        Default implementation applies minus pairTidalTensor() to the relative velocity v_i - v_j.
+         * 
+         * @param a_i Acceleration of i
+         * @param j_i Jerk of i
+         * @param x_i Position of i
+         * @param x_j Position of j
+         * @param v_i Velocity of i
+         * @param v_j Velocity of j
+         * @param m_i Mass of i
+         * @param m_j Mass of j
+         */
+        virtual void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                                          Eigen::Ref<Eigen::Vector3d> j_i,
+                                          const Eigen::Vector3d& x_i,
+                                          const Eigen::Vector3d& x_j,
+                                          const Eigen::Vector3d& v_i,
+                                          const Eigen::Vector3d& v_j,
+                                          double m_i,
+                                          double m_j);
+
+        /**
+         * @brief Adds the second derivatives of the potential at x_i due to particle j to T_i.
+         *        Default implementation differentiates pairAcceleration() numerically.
+         * 
+         * @param T_i Tidal tensor at i
+         * @param x_i Position of i
+         * @param x_j Position of j
+         * @param m_i Mass of i
+         * @param m_j Mass of j
+         */
+        virtual void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                     const Eigen::Vector3d& x_i,
+                                     const Eigen::Vector3d& x_j,
+                                     double m_i,
+                                     double m_j);
+
+        /**
+         * @brief Adds the tidal tensor at x_i due to a contiguous block of sources to T_i.
+         *        Sources at exactly x_i contribute nothing. Default implementation calls pairTidalTensor() for every source.
+         * 
+         * @param T_i Tidal tensor at i
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param sources Positions and masses of the sources
+         */
+        virtual void batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                      const Eigen::Vector3d& x_i,
+                                      double m_i,
+                                      const SourceBlock& sources);
+
+        /**
+         * @brief Sizes #potentials and #tidalTensors for n particles, as requested by #computePotentials and #computeTidalTensors.
+         */
+        void resizeOutputs(int n);
+
+        /**
+         * @brief Zeroes the requested outputs of particles begin to end (end not included), before a sweep adds to them.
+         */
+        void clearOutputs(int begin, int end);
+
+        /**
+         * @brief Computes the requested outputs of particles iBegin to iEnd (iEnd not included) from every other particle.
+         *        Used by engines whose force pass has no cheaper way to produce them. O(n) per particle
+         * 
+         * @param x Position matrix
+         * @param m Mass vector
+         * @param iBegin
+         * @param iEnd
+         */
+        void directOutputs(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                           const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                           int iBegin, int iEnd);
+
+        /**
+         * @brief Returns the potential energy of particle i due to a contiguous block of sources.
+         *        Sources at exactly x_i contribute nothing. Default implementation calls pairPotentialEnergy() for every source.
+         * 
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param sources Positions and masses of the sources
+         * @return double
+         */
+        virtual double batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                            double m_i,
+                                            const SourceBlock& sources);
 };
 
 
@@ -73,9 +292,85 @@ class DynamicsEngine {
 
 /**
  * Computes force directly between every pair of objects. O(n^2)
+ * Bodies are split into tiles that fit in cache, and tiles are spread across threads.
  */
 class Abstract_Direct: public DynamicsEngine {
     public:
+        int tileSize = 256;         //!< Number of bodies per tile. A tile of positions and masses should fit in L1 cache.
+        bool useSymmetry = false;   //!< Compute each pair once and apply equal and opposite accelerations. Assumes pair forces obey Newton's third law. Steps with #computePotentials or #computeTidalTensors set take the non-symmetric sweep, which computes them in the same pass.
+
+        SourceArrays sources;                               //!< Positions and masses in structure-of-arrays layout, refreshed every step.
+        std::vector<Eigen::Matrix3Xd> threadAccelerations;   //!< Per-thread acceleration accumulators for the symmetric mode.
+        std::vector<std::pair<int, int>> tilePairs;         //!< Tile pairs (I, J) with I <= J handed out as work units in the symmetric mode.
+
+        /**
+         * @brief Construct a Abstract_Direct object.
+         * 
+         * @param nThreads Number of threads used for the pair loops. 0 uses every hardware thread.
+         */
+        Abstract_Direct(unsigned nThreads = 0);
+
+        /**
+         * @brief Adds the acceleration of bodies iBegin to iEnd due to bodies jBegin to jEnd (end indices not included),
+         *        skipping self-interaction. Default implementation calls batchAcceleration() once per body of the i tile.
+         * 
+         * @param a Acceleration matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void tileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                      const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                      const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                      int iBegin, int iEnd,
+                                      int jBegin, int jEnd);
+
+        /**
+         * @brief Like tileAcceleration(), and also adds the requested outputs of bodies iBegin to iEnd due to the j tile
+         *        to #potentials and #tidalTensors. Default implementation calls batchAccelerationOutputs() once per body of the i tile.
+         * 
+         * @param a Acceleration matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void tileAccelerationOutputs(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                             const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                             const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                             int iBegin, int iEnd,
+                                             int jBegin, int jEnd);
+
+        /**
+         * @brief Adds the accelerations of every pair between bodies iBegin to iEnd and bodies jBegin to jEnd to both bodies of the pair.
+         *        If the ranges are the same tile, each pair within it is computed once.
+         *        Default implementation calls pairAcceleration() once per pair and scales the result by -m_i/m_j for j.
+         * 
+         * @param a Acceleration accumulator
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                               const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                               int iBegin, int iEnd,
+                                               int jBegin, int jEnd);
+
+        /**
+         * @brief Adds the accelerations and jerks of bodies iBegin to iEnd due to bodies jBegin to jEnd (end indices not included),
+         *        skipping self-interaction. Default implementation calls pairAccelerationJerk() once per pair.
+         * 
+         * @param a Acceleration matrix
+         * @param jerk Jerk matrix
+         * @param x Position matrix
+         * @param v Velocity matrix
+         * @param m Mass vector
+         */
+        virtual void tileAccelerationJerk(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                          Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                          int iBegin, int iEnd,
+                                          int jBegin, int jEnd);
+
         /**
          * @brief Computes force between each pair of particles individually.
          * 
@@ -86,23 +381,162 @@ class Abstract_Direct: public DynamicsEngine {
         void updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Calls ready for each i tile once its sweep is done, or once its accumulators are summed in the symmetric mode.
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param ready
+         */
+        void updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                          const AccelerationsReady& ready) override;
+
+        /**
+         * @brief Computes accelerations and jerks tile by tile with tileAccelerationJerk(), with the same work units as updateAccelerations().
+         *        Always uses the non-symmetric sweep.
+         * 
+         * @param a
+         * @param jerk
+         * @param x
+         * @param v
+         * @param m
+         */
+        void updateAccelerationsAndJerks(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                         Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                         const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                         const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                         const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Computes the force on each active particle from every tile with batchAcceleration().
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param active
+         */
+        void updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                       const std::vector<int>& active) override;
 };
 
 
+/* Tree layout helpers for Abstract_BarnesHut::walkTree() */
+
+template <typename Function>
+inline void forEachChild(const OctreeNode* node, Function&& f) {
+    // Children are stored in a fixed 2x2x2 array, empty ones included
+    for (int z = 0; z < 2; ++z) {
+        for (int y = 0; y < 2; ++y) {
+            for (int x = 0; x < 2; ++x) {
+                const OctreeNode* child = node->children[z][y][x];
+                if (!child->isEmpty) f(child);
+            }
+        }
+    }
+}
+
+inline double nodeSize(const OctreeNode* node) {
+    return node->xMax - node->xMin;
+}
+
+inline int leafSize(const OctreeNode* node) {
+    return node->nBodies;
+}
+
+inline SourceBlock leafSources(const OctreeNode* node, const SourceArrays* bodies, SourceArrays& buffer,
+                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                               const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Bucket bodies are scattered through x, so gather them for the batch kernel.
+    // Only buckets that overflowed at the maximum depth need more room than OCTREE_MAX_LEAF_CAPACITY.
+    if ((int)buffer.m.size() < node->nBodies) buffer.resize(node->nBodies);
+    int k = 0;
+    node->forEachBody([&](int j) {
+        buffer.set(k++, j, x, m);
+    });
+    return buffer.block(0, node->nBodies);
+}
+
+inline double nodeSize(const LinearOctreeNode* node) {
+    // Cell width, or the extent of the bodies if they spread beyond the cell since the last build
+    return node->size;
+}
+
+inline int leafSize(const LinearOctreeNode* node) {
+    return node->nBodies;
+}
+
+inline SourceBlock leafSources(const LinearOctreeNode* node, const SourceArrays* bodies, SourceArrays& buffer,
+                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                               const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Bodies of a leaf are already contiguous in Morton order
+    return bodies->block(node->bodyBegin, node->bodyBegin + node->nBodies);
+}
+
+template <typename Function>
+inline void forEachChild(const LinearOctreeNode* node, Function&& f) {
+    // Only non-empty children are stored, next to each other
+    const LinearOctreeNode* children = node + node->childOffset;
+    for (int k = 0; k < node->nChildren; ++k) {
+        f(children + k);
+    }
+}
+
+
 /**
  * A multithreaded Barnes-Hut force computer. O(nlogn)
  */
 class Abstract_BarnesHut: public DynamicsEngine {
     public:
-        OctreeNode* root;       //!< Root node of the Barnes-Hut tree.
+        OctreeNode* root;       //!< Root node of the Barnes-Hut tree. Owned by #arena.
+        OctreeArena arena;      //!< Allocator for the nodes of the Barnes-Hut tree. Reset before each rebuild.
+        std::vector<std::unique_ptr<OctreeArena>> threadArenas; //!< Per-thread allocators for the subtrees of #root built in parallel.
+        std::vector<int> bodyCells;     //!< Top level cell of each body in the parallel build of #root.
+        std::vector<int> cellBodies;    //!< Bodies grouped by top level cell, in index order within each cell.
         const double theta;     //!< Theta parameter for Barnes-Hut algorithm
+
+        int workUnitsPerThread = 16;                //!< Number of work units the tree walk is split into per thread.
+        std::vector<uint32_t> interactionCounts;    //!< Number of interactions computed for each particle in the last step. Used as a cost estimate.
+        std::vector<int> workUnitBounds;            //!< Particle (or group, in the group walk) index bounds of each work unit. Unit i covers [workUnitBounds[i], workUnitBounds[i + 1]).
+        std::vector<uint32_t> activeCosts;          //!< Interaction counts of the particles of the last updateActiveAccelerations(), in the order of its active list.
+
+        int leafCapacity = 8;           //!< Maximum number of bodies in an external tree node. Capped at OCTREE_MAX_LEAF_CAPACITY.
+        int maxTreeDepth = 32;          //!< Tree nodes at this depth are never split, however many bodies they hold.
+
+        int expansionOrder = 0;         //!< Multipole order of accepted tree nodes. 0 uses mass and center of mass only, 2 adds the quadrupole correction.
+
+        bool useLinearOctree = false;   //!< Build a LinearOctree from Morton-sorted bodies instead of inserting bodies into #root.
+        LinearOctree linearTree;        //!< Barnes-Hut tree used when #useLinearOctree is set.
+
+        int treeDepth = 0;                                                  //!< Depth of the deepest node in the current tree.
+        std::vector<std::vector<const OctreeNode*>> walkStacks;             //!< Per-thread stacks for the depth-first tree walk. Sized from #treeDepth before each walk.
+        std::vector<std::vector<const LinearOctreeNode*>> linearWalkStacks; //!< Per-thread stacks for walking #linearTree.
+        std::vector<SourceArrays> leafBuffers;                              //!< Per-thread buffers OctreeNode buckets are gathered into for batchAcceleration().
+
+        bool useGroupWalk = false;                  //!< Walk #linearTree once per group of nearby bodies instead of once per body. Only used with #useLinearOctree.
+        int groupCapacity = 32;                     //!< Largest number of bodies in a group. External nodes always form a group, however many bodies they hold.
+        std::vector<int> groups;                    //!< Indices into #linearTree.nodes of the nodes whose bodies form each group.
+        std::vector<uint32_t> groupCosts;           //!< Sum of the interaction counts of the bodies of each group.
+        std::vector<InteractionList> interactionLists; //!< Per-thread interaction lists for the group walk.
+        bool useMixedPrecision = false;             //!< Evaluate group walk interactions in single precision, relative to the center of each group, and accumulate them in double precision.
+
+        bool useTreeRefit = false;      //!< Refit #linearTree to the new positions instead of rebuilding it every step. Only used with #useLinearOctree.
+        int maxRefitSteps = 8;          //!< Largest number of consecutive steps #linearTree is refit before it is rebuilt.
+        double refitTolerance = 0.5;    //!< #linearTree is rebuilt once a node grows this fraction beyond the width of its cell.
+        int refitSteps = 0;             //!< Number of steps #linearTree has been refit since it was last built.
         
         /**
-         * @brief Construct a Abstract_Direct object.
+         * @brief Construct a Abstract_BarnesHut object.
          * 
          * @param theta Theta parameter for the Barnes-Hut algorithm
+         * @param nThreads Number of threads used for the tree walk. 0 uses every hardware thread.
          */
-        Abstract_BarnesHut(double theta);
+        Abstract_BarnesHut(double theta, unsigned nThreads = 0);
 
         /**
          * @brief Destroy the Abstract_BarnesHut object
@@ -110,19 +544,269 @@ class Abstract_BarnesHut: public DynamicsEngine {
         ~Abstract_BarnesHut();
         
         /**
-         * @brief Function for threads. Computes the acceleration of bodies from indices startIdx to endIdx (endIdx not included)
+         * @brief Splits particles 0 to n - 1 into #workUnitsPerThread work units per thread of roughly equal cost.
+         *        The cost of a particle is its interaction count from the previous step,
+         *        falling back to equal costs when the particle count changed.
+         * 
+         * @param n Number of particles
+         */
+        void partitionWorkUnits(int n);
+
+        /**
+         * @brief Splits items 0 to costs.size() - 1 into #workUnitsPerThread work units per thread of roughly equal cost.
+         * 
+         * @param costs Cost estimate of each item
+         */
+        void partitionWorkUnits(const std::vector<uint32_t>& costs);
+
+        /**
+         * @brief Builds #root from particle positions and masses. The top levels are split serially
+         *        and the subtrees below them are built on #threadPool. The tree is identical to the one
+         *        inserting every body into #root in index order gives, so results do not depend on the number of threads.
+         * 
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void buildOctree(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                         const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Appends to #groups the groups of the subtree of #linearTree below nodeIdx.
+         *        A node forms a group if it is external or holds at most #groupCapacity bodies.
+         * 
+         * @param nodeIdx Index of the subtree root in #linearTree.nodes
+         */
+        void collectGroups(int nodeIdx);
+
+        /**
+         * @brief Function for threads. Computes the acceleration of bodies from indices startIdx to endIdx (endIdx not included).
+         *        Default implementation calls walkBodies() with virtual force computations.
          * 
          * @param a
          * @param x 
          * @param m 
          * @param startIdx
          * @param endIdx
+         * @param indices Body indices that startIdx and endIdx index into, or nullptr to walk bodies startIdx to endIdx themselves
+         * @param threadIdx Index of the calling thread in #threadPool. Selects the walk stack.
          */
-        void threadUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+        virtual void threadUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
                                       int startIdx,
-                                      int endIdx);
+                                      int endIdx,
+                                      const int* indices,
+                                      unsigned threadIdx);
+
+        /**
+         * @brief Function for threads. Computes the acceleration of the bodies of groups from indices startIdx to endIdx (endIdx not included)
+         *        by building one interaction list per group and evaluating it with listAcceleration().
+         *        A node is accepted for the whole group if s/d < #theta, where d is the distance from its
+         *        center of mass to the bounding box of the group's bodies.
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param startIdx
+         * @param endIdx
+         * @param threadIdx Index of the calling thread in #threadPool. Selects the walk stack and interaction list.
+         */
+        void threadGroupUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                            const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                            const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                            int startIdx,
+                                            int endIdx,
+                                            unsigned threadIdx);
+
+        /**
+         * @brief Adds the acceleration due to an interaction list to each body of a group.
+         *        Default implementation calls batchAcceleration() on the nodes and bodies of the list,
+         *        or multipoleAcceleration() for each node if #expansionOrder >= 2. It ignores #useMixedPrecision.
+         * 
+         * @param a Acceleration matrix
+         * @param bodies Indices of the bodies of the group
+         * @param nBodies Number of bodies in the group
+         * @param list Sources acting on the group
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                      const int* bodies,
+                                      int nBodies,
+                                      const InteractionList& list,
+                                      const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                      const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Adds the acceleration of body i due to the multipole expansion of a tree node.
+         *        Used in place of pairAcceleration() for accepted nodes when #expansionOrder >= 2.
+         *        Default implementation ignores the quadrupole moment.
+         * 
+         * @param a_i Acceleration of i
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param centerOfMass Center of mass of the node
+         * @param totalMass Total mass of the node
+         * @param quadrupole Traceless quadrupole moment of the node about its center of mass
+         */
+        virtual void multipoleAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                                           const Eigen::Vector3d& x_i,
+                                           double m_i,
+                                           const Eigen::Vector3d& centerOfMass,
+                                           double totalMass,
+                                           const Eigen::Matrix3d& quadrupole);
+
+        /**
+         * @brief Returns the potential energy of body i due to the multipole expansion of a tree node.
+         *        Used in place of pairPotentialEnergy() for accepted nodes when #expansionOrder >= 2.
+         *        Default implementation ignores the quadrupole moment.
+         * 
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param centerOfMass Center of mass of the node
+         * @param totalMass Total mass of the node
+         * @param quadrupole Traceless quadrupole moment of the node about its center of mass
+         * @return double
+         */
+        virtual double multipolePotentialEnergy(const Eigen::Vector3d& x_i,
+                                                double m_i,
+                                                const Eigen::Vector3d& centerOfMass,
+                                                double totalMass,
+                                                const Eigen::Matrix3d& quadrupole);
+
+        /**
+         * @brief Adds the tidal tensor at x_i due to the multipole expansion of a tree node to T_i.
+         *        Used in place of pairTidalTensor() for accepted nodes when #expansionOrder >= 2.
+         *        Default implementation ignores the quadrupole moment.
+         * 
+         * @param T_i Tidal tensor at i
+         * @param x_i Position of i
+         * @param m_i Mass of i
+         * @param centerOfMass Center of mass of the node
+         * @param totalMass Total mass of the node
+         * @param quadrupole Traceless quadrupole moment of the node about its center of mass
+         */
+        virtual void multipoleTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                          const Eigen::Vector3d& x_i,
+                                          double m_i,
+                                          const Eigen::Vector3d& centerOfMass,
+                                          double totalMass,
+                                          const Eigen::Matrix3d& quadrupole);
+
+        /**
+         * @brief Function for threads. Computes the potential energy of bodies from indices startIdx to endIdx (endIdx not included).
+         *        Default implementation calls walkPotentials() with virtual energy computations.
+         * 
+         * @param u Potential energy vector
+         * @param x
+         * @param m
+         * @param startIdx
+         * @param endIdx
+         * @param threadIdx Index of the calling thread in #threadPool. Selects the walk stack.
+         */
+        virtual void threadUpdatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                                   const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                   int startIdx,
+                                                   int endIdx,
+                                                   unsigned threadIdx);
+
+        /**
+         * @brief Walks the current tree for each body from indices startIdx to endIdx (endIdx not included).
+         *        Also computes #potentials and #tidalTensors if #computePotentials and #computeTidalTensors are set.
+         *        Force computations are called on Engine, so an engine whose overrides are final gets them inlined.
+         * 
+         * @tparam Engine This class or the subclass calling the walk
+         * @param indices Body indices that startIdx and endIdx index into, or nullptr to walk bodies startIdx to endIdx themselves
+         * @param threadIdx Index of the calling thread in #threadPool. Selects the walk stack.
+         */
+        template <typename Engine>
+        void walkBodies(Eigen::Ref<Eigen::Matrix3Xd> a,
+                        const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                        int startIdx,
+                        int endIdx,
+                        const int* indices,
+                        unsigned threadIdx);
+
+        /**
+         * @brief Walks the current tree for the potential energy of each body from indices startIdx to endIdx (endIdx not included),
+         *        without computing accelerations.
+         * 
+         * @tparam Engine This class or the subclass calling the walk
+         * @param threadIdx Index of the calling thread in #threadPool. Selects the walk stack.
+         */
+        template <typename Engine>
+        void walkPotentials(Eigen::Ref<Eigen::RowVectorXd> u,
+                            const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                            const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                            int startIdx,
+                            int endIdx,
+                            unsigned threadIdx);
+
+        /**
+         * @brief Walks a tree depth-first for each body from indices startIdx to endIdx (endIdx not included).
+         *        Shared by walkBodies() and walkPotentials() for both tree layouts.
+         * 
+         * @tparam Engine This class or the subclass calling the walk
+         * @tparam Accelerations Compute accelerations into a
+         * @tparam Potentials Compute into u the potential of each body if Accelerations is set, as in #potentials, otherwise its potential energy
+         * @tparam TidalTensors Compute tidal tensors into T
+         * @param treeRoot Root of the tree
+         * @param stack Walk stack with room for at least 7*#treeDepth + 8 nodes
+         * @param bodies Bodies referenced by LinearOctreeNode buckets, in Morton order. Unused for OctreeNode.
+         * @param buffer Sources to gather OctreeNode buckets into, grown for buckets that overflowed at the maximum depth. Unused for LinearOctreeNode.
+         * @param indices Body indices that startIdx and endIdx index into, or nullptr to walk bodies startIdx to endIdx themselves
+         */
+        template <typename Engine, typename Node, bool Accelerations, bool Potentials, bool TidalTensors>
+        void walkTree(const Node* treeRoot,
+                      const Node** stack,
+                      const SourceArrays* bodies,
+                      SourceArrays& buffer,
+                      Eigen::Ref<Eigen::Matrix3Xd> a,
+                      Eigen::Ref<Eigen::RowVectorXd> u,
+                      Eigen::Ref<Eigen::Matrix<double, 9, Eigen::Dynamic>> T,
+                      const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                      const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                      int startIdx,
+                      int endIdx,
+                      const int* indices);
+
+        /**
+         * @brief Calls walkTree() on the current tree layout with the walk stack of thread threadIdx.
+         */
+        template <typename Engine, bool Accelerations, bool Potentials, bool TidalTensors>
+        void walkCurrentTree(Eigen::Ref<Eigen::Matrix3Xd> a,
+                             Eigen::Ref<Eigen::RowVectorXd> u,
+                             Eigen::Ref<Eigen::Matrix<double, 9, Eigen::Dynamic>> T,
+                             const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                             const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                             int startIdx,
+                             int endIdx,
+                             const int* indices,
+                             unsigned threadIdx);
+
+        /**
+         * @brief Builds or refits the tree of the current layout and sizes the walk stacks for it.
+         * 
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void buildTree(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                       const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Computes the potential energy of each particle with one walk of the tree per particle,
+         *        accepting nodes with the same opening test as the force walk. O(nlogn)
+         *        Walks the tree of the last force pass if it holds the same positions, and never uses up #maxRefitSteps.
+         * 
+         * @param u Potential energy vector
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                     const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                     const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
 
         /**
          * @brief Computes forces acting on each particle using the Barnes-Hut algorithm
@@ -134,104 +818,763 @@ class Abstract_BarnesHut: public DynamicsEngine {
         void updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                 const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Calls ready for the bodies of each work unit once it is walked. Group walk units cover a contiguous run of #linearTree.order.
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param ready
+         */
+        void updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                          const AccelerationsReady& ready) override;
+
+        /**
+         * @brief Builds or refits the tree from every particle and walks it for the active particles only.
+         *        Active particles are always walked one by one, even with #useGroupWalk set.
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param active
+         */
+        void updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                       const std::vector<int>& active) override;
 };
 
 
-/* SPECIFIC DYNAMICS ENGINES */
-/* Implement DynamicsEngine::pairAccleration() */
+/**
+ * A multithreaded Fast Multipole Method force computer. O(n)
+ * Cells of a LinearOctree interact through multipole-to-local expansions found
+ * by a dual tree walk. Only leaves that are too close interact body by body.
+ */
+class Abstract_FMM: public DynamicsEngine {
+    public:
+        const double theta;     //!< Opening parameter. Cells A and B interact through their expansions if r_A + r_B < theta*|z_A - z_B|.
+
+        int expansionOrder = 2;         //!< Order of the expansions, at most 2. Local expansions hold the potential and derivatives of the acceleration up to this order and multipoles add the quadrupole at order 2.
+        int leafCapacity = 16;          //!< Maximum number of bodies in an external tree node.
+        int maxTreeDepth = LINEAR_OCTREE_MAX_DEPTH; //!< Tree nodes at this depth are never split, however many bodies they hold.
+        int workUnitsPerThread = 16;    //!< Number of target cells the dual tree walk is split into per thread.
+
+        LinearOctree tree;                  //!< Tree of cells. Rebuilt every step.
+        std::vector<double> radii;          //!< Distance from the center of mass of each node to its farthest corner.
+        std::vector<LocalExpansion> locals; //!< Local expansion of each node.
+        std::vector<int> targetCells;       //!< Roots of the disjoint subtrees that threads walk as targets.
+
+        /**
+         * @brief Construct a Abstract_FMM object.
+         * 
+         * @param theta Opening parameter
+         * @param nThreads Number of threads used for the tree passes. 0 uses every hardware thread.
+         */
+        Abstract_FMM(double theta, unsigned nThreads = 0);
+
+        /**
+         * @brief Appends to #targetCells the highest nodes below nodeIdx holding at most maxBodies bodies.
+         * 
+         * @param nodeIdx Index of the subtree root in #tree
+         * @param maxBodies Largest number of bodies in a target cell. External nodes are always target cells.
+         */
+        void collectTargetCells(int nodeIdx, int maxBodies);
+
+        /**
+         * @brief Dual tree walk. Adds the field of source cell sourceIdx to target cell targetIdx and its subtree,
+         *        either as a multipole-to-local interaction or by splitting the larger cell.
+         *        Only writes to the local expansions and bodies of the target subtree.
+         *        Force computations are called on Engine, so an engine whose overrides are final gets them inlined.
+         * 
+         * @tparam Engine This class or the subclass calling the walk
+         * @param targetIdx Index of the target node in #tree
+         * @param sourceIdx Index of the source node in #tree
+         */
+        template <typename Engine>
+        void interact(int targetIdx,
+                      int sourceIdx,
+                      Eigen::Ref<Eigen::Matrix3Xd> a,
+                      const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                      const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Function for threads. Walks target cell nodeIdx against the whole tree.
+         *        Default implementation calls interact() with virtual force computations.
+         * 
+         * @param nodeIdx Index of the target cell in #tree
+         */
+        virtual void walkTargetCell(int nodeIdx,
+                                    Eigen::Ref<Eigen::Matrix3Xd> a,
+                                    const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                    const Eigen::Ref<const Eigen::RowVectorXd>& m);
 
+        /**
+         * @brief Passes the local expansion of nodeIdx down its subtree and adds it to the acceleration of its bodies,
+         *        and to their potentials and tidal tensors as requested by #computePotentials and #computeTidalTensors.
+         * 
+         * @param nodeIdx Index of the subtree root in #tree
+         */
+        void evaluateLocals(int nodeIdx,
+                            Eigen::Ref<Eigen::Matrix3Xd> a,
+                            const Eigen::Ref<const Eigen::Matrix3Xd>& x);
+
+        /**
+         * @brief Adds the field of a source cell to the local expansion of a target cell.
+         *        Default implementation computes the potential and acceleration with pairPotentialEnergy() and pairAcceleration(),
+         *        and at #expansionOrder 1 and above the first order term with pairTidalTensor().
+         * 
+         * @param local Local expansion of the target, centered on its center of mass
+         * @param target Target cell
+         * @param source Source cell
+         */
+        virtual void multipoleToLocal(LocalExpansion& local,
+                                      const LinearOctreeNode& target,
+                                      const LinearOctreeNode& source);
+
+        /**
+         * @brief Computes forces acting on each particle using the Fast Multipole Method
+         * 
+         * @param a 
+         * @param x 
+         * @param m 
+         */
+        void updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                 const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Computes the potential energy of each particle from the potentials of one force pass with
+         *        #computePotentials set. Outputs of the last updateAccelerations() are left as they were. O(n)
+         * 
+         * @param u Potential energy vector
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                     const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                     const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Calls ready for the bodies of each target cell once its local expansions are evaluated.
+         *        Potentials and tidal tensors of those bodies are complete by then too.
+         * 
+         * @param a
+         * @param x
+         * @param m
+         * @param ready
+         */
+        void updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                          const AccelerationsReady& ready) override;
+};
+
+
+/* TREE WALKS */
+/* Templates on the engine type, so force law engines walk without virtual calls */
+
+
+template <typename Engine>
+void Abstract_BarnesHut::walkBodies(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                    const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                    const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                    int startIdx, int endIdx, const int* indices, unsigned threadIdx) {
+    // Each combination of outputs gets its own walk, so the plain force walk does no extra work
+    if (this->computePotentials && this->computeTidalTensors) {
+        this->walkCurrentTree<Engine, true, true, true>(a, this->potentials, this->tidalTensors, x, m, startIdx, endIdx, indices, threadIdx);
+    } else if (this->computePotentials) {
+        this->walkCurrentTree<Engine, true, true, false>(a, this->potentials, this->tidalTensors, x, m, startIdx, endIdx, indices, threadIdx);
+    } else if (this->computeTidalTensors) {
+        this->walkCurrentTree<Engine, true, false, true>(a, this->potentials, this->tidalTensors, x, m, startIdx, endIdx, indices, threadIdx);
+    } else {
+        this->walkCurrentTree<Engine, true, false, false>(a, this->potentials, this->tidalTensors, x, m, startIdx, endIdx, indices, threadIdx);
+    }
+}
+
+
+template <typename Engine>
+void Abstract_BarnesHut::walkPotentials(Eigen::Ref<Eigen::RowVectorXd> u,
+                                        const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                        int startIdx, int endIdx, unsigned threadIdx) {
+    Eigen::Matrix3Xd noAccelerations;
+    Eigen::Matrix<double, 9, Eigen::Dynamic> noTidalTensors;
+    this->walkCurrentTree<Engine, false, true, false>(noAccelerations, u, noTidalTensors, x, m, startIdx, endIdx, nullptr, threadIdx);
+}
+
+
+template <typename Engine, bool Accelerations, bool Potentials, bool TidalTensors>
+void Abstract_BarnesHut::walkCurrentTree(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                         Eigen::Ref<Eigen::RowVectorXd> u,
+                                         Eigen::Ref<Eigen::Matrix<double, 9, Eigen::Dynamic>> T,
+                                         const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                         const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                         int startIdx, int endIdx, const int* indices, unsigned threadIdx) {
+    // Stack capacity was reserved from the tree depth, so the walk never allocates
+    if (this->useLinearOctree) {
+        this->walkTree<Engine, LinearOctreeNode, Accelerations, Potentials, TidalTensors>(this->linearTree.nodes.data(), this->linearWalkStacks[threadIdx].data(), &this->linearTree.bodies,
+                                                                                         this->leafBuffers[threadIdx], a, u, T, x, m, startIdx, endIdx, indices);
+    } else {
+        this->walkTree<Engine, OctreeNode, Accelerations, Potentials, TidalTensors>(this->root, this->walkStacks[threadIdx].data(), nullptr, this->leafBuffers[threadIdx],
+                                                                                   a, u, T, x, m, startIdx, endIdx, indices);
+    }
+}
+
+
+template <typename Engine, typename Node, bool Accelerations, bool Potentials, bool TidalTensors>
+void Abstract_BarnesHut::walkTree(const Node* treeRoot,
+                                  const Node** stack,
+                                  const SourceArrays* bodies,
+                                  SourceArrays& buffer,
+                                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                                  Eigen::Ref<Eigen::RowVectorXd> u,
+                                  Eigen::Ref<Eigen::Matrix<double, 9, Eigen::Dynamic>> T,
+                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                  const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                  int startIdx, int endIdx, const int* indices) {
+    Engine* engine = static_cast<Engine*>(this);
+    for (int k = startIdx; k < endIdx; ++k) {
+        int i = indices != nullptr ? indices[k] : k;
+        // Set acceleration, potential and tidal tensor to zero
+        if constexpr (Accelerations) a.col(i).setZero();
+        if constexpr (Potentials) u(i) = 0;
+        Eigen::Matrix3d T_i = Eigen::Matrix3d::Zero();
+        uint32_t nInteractions = 0;
+
+        // The force walk computes the potential of a unit mass, the energy walk the potential energy of the body
+        double m_u = Accelerations ? 1.0 : m(i);
+
+        // Iterate through tree using depth-first traversal
+        int stackSize = 0;
+        stack[stackSize++] = treeRoot;
+        while (stackSize > 0) {
+            // Get current node
+            const Node* currNode = stack[--stackSize];
+
+            // Compute s/d
+            double s = nodeSize(currNode);
+            double d = (x.col(i) - currNode->centerOfMass).norm();
+            if (currNode->isExternal && !(s/d < theta) && leafSize(currNode) > 0) {
+                // Current node is an external node close to the current object
+                // Interact with each of its bodies directly
+                SourceBlock sources = leafSources(currNode, bodies, buffer, x, m);
+                if constexpr (Accelerations) engine->batchAcceleration(a.col(i), x.col(i), m(i), sources); // Force computation
+                if constexpr (Potentials) u(i) += engine->batchPotentialEnergy(x.col(i), m_u, sources);
+                if constexpr (TidalTensors) engine->batchTidalTensor(T_i, x.col(i), m(i), sources);
+                nInteractions += leafSize(currNode);
+            } else if (s/d < theta || currNode->isExternal) {
+                // Current node is sufficiently far away from the current object
+                if (this->expansionOrder >= 2) {
+                    if constexpr (Accelerations) engine->multipoleAcceleration(a.col(i), x.col(i), m(i), currNode->centerOfMass, currNode->totalMass, currNode->quadrupole); // Force computation
+                    if constexpr (Potentials) u(i) += engine->multipolePotentialEnergy(x.col(i), m_u, currNode->centerOfMass, currNode->totalMass, currNode->quadrupole);
+                    if constexpr (TidalTensors) engine->multipoleTidalTensor(T_i, x.col(i), m(i), currNode->centerOfMass, currNode->totalMass, currNode->quadrupole);
+                } else {
+                    if constexpr (Accelerations) engine->pairAcceleration(a.col(i), x.col(i), currNode->centerOfMass, m(i), currNode->totalMass); // Force computation
+                    if constexpr (Potentials) u(i) += engine->pairPotentialEnergy(x.col(i), currNode->centerOfMass, m_u, currNode->totalMass);
+                    if constexpr (TidalTensors) engine->pairTidalTensor(T_i, x.col(i), currNode->centerOfMass, m(i), currNode->totalMass);
+                }
+                ++nInteractions;
+            } else {
+                // Current node not sufficiently far from the current object
+                // Push currNode's children onto the stack
+                forEachChild(currNode, [&](const Node* child) {
+                    stack[stackSize++] = child;
+                });
+            }
+        }
 
-class Gravitational_Direct: public Abstract_Direct {
+        // Pair energies are halved, so the potential is twice their sum
+        if constexpr (Accelerations && Potentials) u(i) *= 2;
+        if constexpr (TidalTensors) T.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+
+        // Record cost of this particle for next step's load balancing
+        if constexpr (Accelerations) this->interactionCounts[i] = nInteractions;
+    }
+}
+
+
+template <typename Engine>
+void Abstract_FMM::interact(int targetIdx, int sourceIdx,
+                            Eigen::Ref<Eigen::Matrix3Xd> a,
+                            const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                            const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    Engine* engine = static_cast<Engine*>(this);
+    const LinearOctreeNode& target = this->tree.nodes[targetIdx];
+    const LinearOctreeNode& source = this->tree.nodes[sourceIdx];
+
+    // Body ranges of two nodes are either disjoint or nested
+    bool nested = target.bodyBegin < source.bodyBegin + source.nBodies && source.bodyBegin < target.bodyBegin + target.nBodies;
+    double d = (target.centerOfMass - source.centerOfMass).norm();
+    if (!nested && this->radii[targetIdx] + this->radii[sourceIdx] < theta*d) {
+        // Cells are well separated. Massless cells have no field to expand.
+        if (source.totalMass > 0) engine->multipoleToLocal(this->locals[targetIdx], target, source);
+        return;
+    }
+
+    if (target.isExternal && source.isExternal) {
+        // Neighbouring leaves interact body by body
+        SourceBlock sources = this->tree.bodies.block(source.bodyBegin, source.bodyBegin + source.nBodies);
+        bool withOutputs = this->computePotentials || this->computeTidalTensors;
+        for (int k = target.bodyBegin; k < target.bodyBegin + target.nBodies; ++k) {
+            int i = this->tree.order[k];
+            if (!withOutputs) {
+                engine->batchAcceleration(a.col(i), x.col(i), m(i), sources); // Force computation
+                continue;
+            }
+            double* phi_i = this->computePotentials ? &this->potentials(i) : nullptr;
+            Eigen::Matrix3d T_i;
+            if (this->computeTidalTensors) T_i = Eigen::Map<const Eigen::Matrix3d>(this->tidalTensors.col(i).data());
+            engine->batchAccelerationOutputs(a.col(i), phi_i, this->computeTidalTensors ? &T_i : nullptr, x.col(i), m(i), sources); // Force computation
+            if (this->computeTidalTensors) this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+        }
+        return;
+    }
+
+    // Split the larger cell
+    if (source.isExternal || (!target.isExternal && this->radii[targetIdx] >= this->radii[sourceIdx])) {
+        for (int k = 0; k < target.nChildren; ++k) {
+            this->interact<Engine>(targetIdx + target.childOffset + k, sourceIdx, a, x, m);
+        }
+    } else {
+        for (int k = 0; k < source.nChildren; ++k) {
+            this->interact<Engine>(targetIdx, sourceIdx + source.childOffset + k, a, x, m);
+        }
+    }
+}
+
+
+/* FORCE LAW ENGINES */
+/* Implement DynamicsEngine::pairAcceleration() and the kernels built on it with a ForceLaw policy */
+
+
+/**
+ * Direct summation with the pair kernels of a ForceLaw policy, called without virtual dispatch.
+ */
+template <typename Law>
+class Direct: public Abstract_Direct {
     public:
-        const double G;
-        const double softening;
+        Law law;    //!< Force law of every pair
 
         /**
-         * @brief Construct a new Gravitational_Direct object
+         * @brief Construct a Direct object.
          * 
-         * @param softening Softening parameter
-         * @param l Unit of length
-         * @param m Unit of mass
-         * @param t Unit of time
+         * @param law Force law
+         * @param nThreads Number of threads used for the pair loops. 0 uses every hardware thread.
          */
-        Gravitational_Direct(double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second);
+        Direct(const Law& law, unsigned nThreads = 0)
+        : Abstract_Direct(nThreads)
+        , law(law) {}
+
+        void tileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                              const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                              const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                              int iBegin, int iEnd,
+                              int jBegin, int jEnd) final {
+            SourceBlock tile = this->sources.block(jBegin, jEnd);
+            for (int i = iBegin; i < iEnd; ++i) {
+                law.batchAcceleration(a.col(i), x.col(i), m(i), tile); // Force computation
+            }
+        }
+
+        void tileAccelerationOutputs(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                     const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                     const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                     int iBegin, int iEnd,
+                                     int jBegin, int jEnd) final {
+            SourceBlock tile = this->sources.block(jBegin, jEnd);
+            for (int i = iBegin; i < iEnd; ++i) {
+                double* phi_i = this->computePotentials ? &this->potentials(i) : nullptr;
+                Eigen::Matrix3d T_i;
+                if (this->computeTidalTensors) T_i = Eigen::Map<const Eigen::Matrix3d>(this->tidalTensors.col(i).data());
+                law.batchAccelerationOutputs(a.col(i), phi_i, this->computeTidalTensors ? &T_i : nullptr, x.col(i), m(i), tile); // Force computation
+                if (this->computeTidalTensors) this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+            }
+        }
+
+        void symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                       int iBegin, int iEnd,
+                                       int jBegin, int jEnd) final {
+            law.symmetricTileAcceleration(a, x, m, iBegin, iEnd, jBegin, jEnd);
+        }
+
+        void tileAccelerationJerk(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                  Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                  const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                  const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                  int iBegin, int iEnd,
+                                  int jBegin, int jEnd) final {
+            law.tileAccelerationJerk(a, jerk, x, v, m, iBegin, iEnd, jBegin, jEnd);
+        }
+
+        void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                               const Eigen::Vector3d& x_i,
+                               double m_i,
+                               const SourceBlock& sources) final {
+            law.batchAcceleration(a_i, x_i, m_i, sources);
+        }
+
+        void batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                      double* phi_i,
+                                      Eigen::Matrix3d* T_i,
+                                      const Eigen::Vector3d& x_i,
+                                      double m_i,
+                                      const SourceBlock& sources) final {
+            law.batchAccelerationOutputs(a_i, phi_i, T_i, x_i, m_i, sources);
+        }
+
+        void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                              const Eigen::Vector3d& x_i,
+                              const Eigen::Vector3d& x_j,
+                              double m_i,
+                              double m_j) final {
+            law.pairAcceleration(a_i, x_i, x_j, m_i, m_j);
+        }
+
+        void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                                  Eigen::Ref<Eigen::Vector3d> j_i,
+                                  const Eigen::Vector3d& x_i,
+                                  const Eigen::Vector3d& x_j,
+                                  const Eigen::Vector3d& v_i,
+                                  const Eigen::Vector3d& v_j,
+                                  double m_i,
+                                  double m_j) final {
+            law.pairAccelerationJerk(a_i, j_i, x_i, x_j, v_i, v_j, m_i, m_j);
+        }
+
+        double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                                   const Eigen::Vector3d& x_j,
+                                   double m_i,
+                                   double m_j) final {
+            return law.pairPotentialEnergy(x_i, x_j, m_i, m_j);
+        }
+
+        double batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                    double m_i,
+                                    const SourceBlock& sources) final {
+            return law.batchPotentialEnergy(x_i, m_i, sources);
+        }
+
+        void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                             const Eigen::Vector3d& x_i,
+                             const Eigen::Vector3d& x_j,
+                             double m_i,
+                             double m_j) final {
+            law.pairTidalTensor(T_i, x_i, x_j, m_i, m_j);
+        }
+
+        void batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                              const Eigen::Vector3d& x_i,
+                              double m_i,
+                              const SourceBlock& sources) final {
+            law.batchTidalTensor(T_i, x_i, m_i, sources);
+        }
+};
+
+
+/**
+ * Barnes-Hut with the kernels of a ForceLaw policy. The tree walks are instantiated
+ * for this class, so every interaction is inlined instead of going through a virtual call.
+ */
+template <typename Law>
+class BarnesHut: public Abstract_BarnesHut {
+    public:
+        Law law;    //!< Force law of every interaction
 
         /**
-         * @brief Computes acceleration from Newtonian gravitation between two particles i and j
+         * @brief Construct a BarnesHut object.
          * 
-         * @param a_i 
-         * @param x_i 
-         * @param x_j 
-         * @param m_i 
-         * @param m_j 
+         * @param theta Theta parameter for the Barnes-Hut algorithm
+         * @param law Force law
+         * @param nThreads Number of threads used for the tree walk. 0 uses every hardware thread.
          */
+        BarnesHut(double theta, const Law& law, unsigned nThreads = 0)
+        : Abstract_BarnesHut(theta, nThreads)
+        , law(law) {}
+
+        void threadUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                       int startIdx,
+                                       int endIdx,
+                                       const int* indices,
+                                       unsigned threadIdx) final {
+            this->template walkBodies<BarnesHut>(a, x, m, startIdx, endIdx, indices, threadIdx);
+        }
+
+        void threadUpdatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                           const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                           const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                           int startIdx,
+                                           int endIdx,
+                                           unsigned threadIdx) final {
+            this->template walkPotentials<BarnesHut>(u, x, m, startIdx, endIdx, threadIdx);
+        }
+
+        void listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                              const int* bodies,
+                              int nBodies,
+                              const InteractionList& list,
+                              const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                              const Eigen::Ref<const Eigen::RowVectorXd>& m) final {
+            law.listAcceleration(a, bodies, nBodies, list, x, m, this->expansionOrder, this->useMixedPrecision);
+        }
+
+        void multipoleAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                                   const Eigen::Vector3d& x_i,
+                                   double m_i,
+                                   const Eigen::Vector3d& centerOfMass,
+                                   double totalMass,
+                                   const Eigen::Matrix3d& quadrupole) final {
+            law.multipoleAcceleration(a_i, x_i, m_i, centerOfMass, totalMass, quadrupole);
+        }
+
+        double multipolePotentialEnergy(const Eigen::Vector3d& x_i,
+                                        double m_i,
+                                        const Eigen::Vector3d& centerOfMass,
+                                        double totalMass,
+                                        const Eigen::Matrix3d& quadrupole) final {
+            return law.multipolePotentialEnergy(x_i, m_i, centerOfMass, totalMass, quadrupole);
+        }
+
+        void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                               const Eigen::Vector3d& x_i,
+                               double m_i,
+                               const SourceBlock& sources) final {
+            law.batchAcceleration(a_i, x_i, m_i, sources);
+        }
+
         void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
                               const Eigen::Vector3d& x_i,
                               const Eigen::Vector3d& x_j,
                               double m_i,
-                              double m_j) override;
-        
-         /**
-         * @brief Returns the gravitational potential energy between a pair of particles i and j.
+                              double m_j) final {
+            law.pairAcceleration(a_i, x_i, x_j, m_i, m_j);
+        }
+
+        void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                                  Eigen::Ref<Eigen::Vector3d> j_i,
+                                  const Eigen::Vector3d& x_i,
+                                  const Eigen::Vector3d& x_j,
+                                  const Eigen::Vector3d& v_i,
+                                  const Eigen::Vector3d& v_j,
+                                  double m_i,
+                                  double m_j) final {
+            law.pairAccelerationJerk(a_i, j_i, x_i, x_j, v_i, v_j, m_i, m_j);
+        }
+
+        double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                                   const Eigen::Vector3d& x_j,
+                                   double m_i,
+                                   double m_j) final {
+            return law.pairPotentialEnergy(x_i, x_j, m_i, m_j);
+        }
+
+        double batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                    double m_i,
+                                    const SourceBlock& sources) final {
+            return law.batchPotentialEnergy(x_i, m_i, sources);
+        }
+
+        void multipoleTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                  const Eigen::Vector3d& x_i,
+                                  double m_i,
+                                  const Eigen::Vector3d& centerOfMass,
+                                  double totalMass,
+                                  const Eigen::Matrix3d& quadrupole) final {
+            law.multipoleTidalTensor(T_i, x_i, m_i, centerOfMass, totalMass, quadrupole);
+        }
+
+        void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                             const Eigen::Vector3d& x_i,
+                             const Eigen::Vector3d& x_j,
+                             double m_i,
+                             double m_j) final {
+            law.pairTidalTensor(T_i, x_i, x_j, m_i, m_j);
+        }
+
+        void batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                              const Eigen::Vector3d& x_i,
+                              double m_i,
+                              const SourceBlock& sources) final {
+            law.batchTidalTensor(T_i, x_i, m_i, sources);
+        }
+};
+
+
+/**
+ * Fast Multipole Method with the kernels of a ForceLaw policy. The dual tree walk is
+ * instantiated for this class, so every interaction is inlined instead of going through a virtual call.
+ */
+template <typename Law>
+class FMM: public Abstract_FMM {
+    public:
+        Law law;    //!< Force law of every interaction
+
+        /**
+         * @brief Construct a FMM object.
          * 
-         * @param x_i Position of i
-         * @param x_j Position of j
-         * @param m_i Mass of i
-         * @param m_j Mass of j
-         * @return double 
+         * @param theta Opening parameter
+         * @param law Force law
+         * @param nThreads Number of threads used for the tree passes. 0 uses every hardware thread.
          */
+        FMM(double theta, const Law& law, unsigned nThreads = 0)
+        : Abstract_FMM(theta, nThreads)
+        , law(law) {}
+
+        void walkTargetCell(int nodeIdx,
+                            Eigen::Ref<Eigen::Matrix3Xd> a,
+                            const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                            const Eigen::Ref<const Eigen::RowVectorXd>& m) final {
+            this->template interact<FMM>(nodeIdx, 0, a, x, m);
+        }
+
+        void multipoleToLocal(LocalExpansion& local,
+                              const LinearOctreeNode& target,
+                              const LinearOctreeNode& source) final {
+            law.multipoleToLocal(local, target, source, std::min(this->expansionOrder, 2));
+        }
+
+        void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                               const Eigen::Vector3d& x_i,
+                               double m_i,
+                               const SourceBlock& sources) final {
+            law.batchAcceleration(a_i, x_i, m_i, sources);
+        }
+
+        void batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                      double* phi_i,
+                                      Eigen::Matrix3d* T_i,
+                                      const Eigen::Vector3d& x_i,
+                                      double m_i,
+                                      const SourceBlock& sources) final {
+            law.batchAccelerationOutputs(a_i, phi_i, T_i, x_i, m_i, sources);
+        }
+
+        void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                              const Eigen::Vector3d& x_i,
+                              const Eigen::Vector3d& x_j,
+                              double m_i,
+                              double m_j) final {
+            law.pairAcceleration(a_i, x_i, x_j, m_i, m_j);
+        }
+
+        void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                                  Eigen::Ref<Eigen::Vector3d> j_i,
+                                  const Eigen::Vector3d& x_i,
+                                  const Eigen::Vector3d& x_j,
+                                  const Eigen::Vector3d& v_i,
+                                  const Eigen::Vector3d& v_j,
+                                  double m_i,
+                                  double m_j) final {
+            law.pairAccelerationJerk(a_i, j_i, x_i, x_j, v_i, v_j, m_i, m_j);
+        }
+
         double pairPotentialEnergy(const Eigen::Vector3d& x_i,
                                    const Eigen::Vector3d& x_j,
                                    double m_i,
-                                   double m_j) override;
+                                   double m_j) final {
+            return law.pairPotentialEnergy(x_i, x_j, m_i, m_j);
+        }
+
+        void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                             const Eigen::Vector3d& x_i,
+                             const Eigen::Vector3d& x_j,
+                             double m_i,
+                             double m_j) final {
+            law.pairTidalTensor(T_i, x_i, x_j, m_i, m_j);
+        }
+
+        void batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                              const Eigen::Vector3d& x_i,
+                              double m_i,
+                              const SourceBlock& sources) final {
+            law.batchTidalTensor(T_i, x_i, m_i, sources);
+        }
+
+        double batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                    double m_i,
+                                    const SourceBlock& sources) final {
+            return law.batchPotentialEnergy(x_i, m_i, sources);
+        }
 };
 
 
-class Gravitational_BarnesHut: public Abstract_BarnesHut {
+/* SPECIFIC DYNAMICS ENGINES */
+/* Newtonian gravitation, kept as named classes with unit-based constructors */
+
+
+class Gravitational_Direct: public Direct<NewtonianGravity> {
     public:
-        const double G;
-        const double softening;
+        const double& G;            //!< Gravitational constant in the chosen units. Refers to law.G.
+        const double& softening;    //!< Softening parameter. Refers to law.softening.
 
         /**
          * @brief Construct a new Gravitational_Direct object
          * 
-         * @param theta Theta parameter for the Barnes-Hut algorithm
          * @param softening Softening parameter
          * @param l Unit of length
          * @param m Unit of mass
          * @param t Unit of time
+         * @param nThreads Number of threads used for the pair loops. 0 uses every hardware thread.
          */
-        Gravitational_BarnesHut(double theta, double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second);
+        Gravitational_Direct(double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second,
+                             unsigned nThreads = 0)
+        : Direct<NewtonianGravity>(NewtonianGravity(softening, l, m, t), nThreads)
+        , G(law.G)
+        , softening(law.softening) {}
+};
+
+
+class Gravitational_BarnesHut: public BarnesHut<NewtonianGravity> {
+    public:
+        const double& G;            //!< Gravitational constant in the chosen units. Refers to law.G.
+        const double& softening;    //!< Softening parameter. Refers to law.softening.
 
         /**
-         * @brief Computes acceleration from Newtonian gravitation between two particles i and j
+         * @brief Construct a new Gravitational_BarnesHut object
          * 
-         * @param a_i 
-         * @param x_i 
-         * @param x_j 
-         * @param m_i 
-         * @param m_j 
+         * @param theta Theta parameter for the Barnes-Hut algorithm
+         * @param softening Softening parameter
+         * @param l Unit of length
+         * @param m Unit of mass
+         * @param t Unit of time
+         * @param nThreads Number of threads used for the tree walk. 0 uses every hardware thread.
          */
-        void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
-                              const Eigen::Vector3d& x_i,
-                              const Eigen::Vector3d& x_j,
-                              double m_i,
-                              double m_j) override;
-        
-         /**
-         * @brief Returns the gravitational potential energy between a pair of particles i and j.
+        Gravitational_BarnesHut(double theta, double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second,
+                                unsigned nThreads = 0)
+        : BarnesHut<NewtonianGravity>(theta, NewtonianGravity(softening, l, m, t), nThreads)
+        , G(law.G)
+        , softening(law.softening) {}
+};
+
+
+class Gravitational_FMM: public FMM<NewtonianGravity> {
+    public:
+        const double& G;            //!< Gravitational constant in the chosen units. Refers to law.G.
+        const double& softening;    //!< Softening parameter. Refers to law.softening.
+
+        /**
+         * @brief Construct a new Gravitational_FMM object
          * 
-         * @param x_i Position of i
-         * @param x_j Position of j
-         * @param m_i Mass of i
-         * @param m_j Mass of j
-         * @return double 
+         * @param theta Opening parameter for the Fast Multipole Method
+         * @param softening Softening parameter
+         * @param l Unit of length
+         * @param m Unit of mass
+         * @param t Unit of time
+         * @param nThreads Number of threads used for the tree passes. 0 uses every hardware thread.
          */
-        double pairPotentialEnergy(const Eigen::Vector3d& x_i,
-                                   const Eigen::Vector3d& x_j,
-                                   double m_i,
-                                   double m_j) override;
+        Gravitational_FMM(double theta, double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second,
+                          unsigned nThreads = 0)
+        : FMM<NewtonianGravity>(theta, NewtonianGravity(softening, l, m, t), nThreads)
+        , G(law.G)
+        , softening(law.softening) {}
 };
 
 
-#endif
\ No newline at end of file
+#endif
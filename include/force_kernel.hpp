@@ -0,0 +1,137 @@
+#ifndef NBT_FORCE_KERNEL_HPP
+#define NBT_FORCE_KERNEL_HPP
+
+#include <vector>
+
+#include <Eigen>
+
+/**
+ * @brief Contiguous block of sources in structure-of-arrays layout.
+ *        Force kernels stream through it one SIMD lane per source.
+ */
+struct SourceBlock {
+    const double* x;    //!< x coordinate of each source
+    const double* y;    //!< y coordinate of each source
+    const double* z;    //!< z coordinate of each source
+    const double* m;    //!< Mass of each source
+    int n;              //!< Number of sources
+};
+
+
+/**
+ * @brief Owning structure-of-arrays copy of a set of positions and masses.
+ *        Capacity is kept between calls to assign(), so refilling it every step does not allocate.
+ */
+struct SourceArrays {
+    std::vector<double> x, y, z;    //!< Positions
+    std::vector<double> m;          //!< Masses
+
+    //!< Resizes the arrays to hold n sources.
+    void resize(int n);
+
+    //!< Copies source k from column j of x and m.
+    void set(int k, int j,
+             const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+             const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+        this->x[k] = x(0, j);
+        this->y[k] = x(1, j);
+        this->z[k] = x(2, j);
+        this->m[k] = m(j);
+    }
+
+    //!< Returns the sources from index begin to end (end not included).
+    SourceBlock block(int begin, int end) const;
+};
+
+
+/**
+ * @brief Single precision counterpart of SourceBlock, for the mixed precision kernels.
+ *        Positions are usually stored relative to a nearby center, so they keep their precision far from the origin.
+ */
+struct FloatSourceBlock {
+    const float* x;     //!< x coordinate of each source
+    const float* y;     //!< y coordinate of each source
+    const float* z;     //!< z coordinate of each source
+    const float* m;     //!< Mass of each source
+    int n;              //!< Number of sources
+};
+
+
+/**
+ * @brief Owning single precision counterpart of SourceArrays.
+ */
+struct FloatSourceArrays {
+    std::vector<float> x, y, z;     //!< Positions
+    std::vector<float> m;           //!< Masses
+
+    //!< Resizes the arrays to hold n sources.
+    void resize(int n);
+
+    //!< Returns the sources from index begin to end (end not included).
+    FloatSourceBlock block(int begin, int end) const;
+};
+
+
+/**
+ * @brief Instruction set levels the force kernels are compiled for. On x86 every level is built
+ *        into the library and the best one the CPU supports is selected at runtime.
+ */
+enum class SimdLevel {
+    Scalar,     //!< Portable C++, one source at a time
+    SSE2,       //!< 2 sources per instruction
+    AVX2,       //!< 4 sources per instruction, with FMA
+    AVX512      //!< 8 sources per instruction
+};
+
+//!< Returns the best level supported by both the CPU and the build.
+SimdLevel detectSimdLevel();
+
+//!< Returns the level the force kernels run at. Defaults to detectSimdLevel(), lowered to the level
+//!< named by the NBT_SIMD environment variable (scalar, sse2, avx2 or avx512) if it is set.
+SimdLevel getSimdLevel();
+
+//!< Forces the level the force kernels run at, e.g. for benchmarking.
+//!< Throws std::invalid_argument if the CPU or the build does not support it.
+void setSimdLevel(SimdLevel level);
+
+//!< Returns the name of a level, as accepted by NBT_SIMD.
+const char* simdLevelName(SimdLevel level);
+
+
+/**
+ * @brief Adds G*sum_j m_j*(x_j - x_i)/(|x_j - x_i|^2 + softening2)^(3/2) over a block of sources to a_i.
+ *        Sources at exactly x_i contribute nothing, so a block may contain body i itself.
+ *        Runs at the instruction set level returned by getSimdLevel().
+ *
+ * @param a_i Acceleration of i
+ * @param x_i Position of i
+ * @param sources Sources acting on i
+ * @param G Gravitational constant
+ * @param softening2 Square of the softening parameter
+ */
+void gravitationalBatch(Eigen::Ref<Eigen::Vector3d> a_i,
+                        const Eigen::Vector3d& x_i,
+                        const SourceBlock& sources,
+                        double G,
+                        double softening2);
+
+
+/**
+ * @brief Mixed precision version of gravitationalBatch(). Each interaction is evaluated in single precision,
+ *        with twice the SIMD lanes of the double kernel, and the results are accumulated in double precision.
+ *        x_i must be given in the same frame as the sources, e.g. relative to the same center.
+ *        Positions, masses and m/r^3 must stay within single precision range.
+ *
+ * @param a_i Acceleration of i
+ * @param x_i Position of i, in the frame of the sources
+ * @param sources Sources acting on i
+ * @param G Gravitational constant
+ * @param softening2 Square of the softening parameter
+ */
+void gravitationalBatchMixed(Eigen::Ref<Eigen::Vector3d> a_i,
+                             const Eigen::Vector3d& x_i,
+                             const FloatSourceBlock& sources,
+                             double G,
+                             double softening2);
+
+#endif
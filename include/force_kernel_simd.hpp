@@ -0,0 +1,52 @@
+#ifndef NBT_FORCE_KERNEL_SIMD_HPP
+#define NBT_FORCE_KERNEL_SIMD_HPP
+
+/*
+ * Instruction set specific parts of the force kernels, used by the dispatch in force_kernel.cpp.
+ * Each level lives in its own translation unit compiled with the flags of its instruction set,
+ * and is only called once detectSimdLevel() has checked that the CPU supports it. Those units must not
+ * use inline functions shared with the rest of the library (e.g. Eigen), since the linker may keep their
+ * copy for the whole program, so they take plain arrays and include nothing from the library.
+ * Only built on x86, where the build defines NBT_X86_KERNELS.
+ */
+
+#if defined(NBT_X86_KERNELS)
+
+/**
+ * @brief Sums m_j*(x_j - x_i)/(|x_j - x_i|^2 + softening2)^(3/2) into sum for the leading sources of a block,
+ *        as many as fill whole vectors. Sources at exactly x_i contribute nothing.
+ *
+ * @param x_i Position of i
+ * @param x x coordinate of each source
+ * @param y y coordinate of each source
+ * @param z z coordinate of each source
+ * @param m Mass of each source
+ * @param n Number of sources
+ * @param softening2 Square of the softening parameter
+ * @param sum x, y and z sums, added to
+ * @return int Number of sources summed. The caller handles the rest.
+ */
+int gravitationalBatchSSE2(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                           double softening2, double* sum);
+int gravitationalBatchAVX2(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                           double softening2, double* sum);   //!< See gravitationalBatchSSE2()
+int gravitationalBatchAVX512(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                             double softening2, double* sum);   //!< See gravitationalBatchSSE2()
+
+//!< Number of vectors the mixed precision kernels sum in single precision before adding the partial sums to the double precision sums.
+const int MIXED_CHUNK = 64;
+
+/**
+ * @brief Single precision version of gravitationalBatchSSE2(). Interactions are evaluated in single precision,
+ *        summed per lane over at most #MIXED_CHUNK vectors and then accumulated into sum in double precision.
+ */
+int gravitationalBatchMixedSSE2(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                float softening2, double* sum);
+int gravitationalBatchMixedAVX2(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                float softening2, double* sum);   //!< See gravitationalBatchMixedSSE2()
+int gravitationalBatchMixedAVX512(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                  float softening2, double* sum);   //!< See gravitationalBatchMixedSSE2()
+
+#endif
+
+#endif
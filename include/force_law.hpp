@@ -0,0 +1,568 @@
+#ifndef NBT_FORCE_LAW_HPP
+#define NBT_FORCE_LAW_HPP
+
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include <Eigen>
+#include "linear_octree.hpp"
+#include "force_kernel.hpp"
+#include "units.hpp"
+
+/**
+ * @brief Taylor expansion of the potential and acceleration field about the center of mass of a tree node.
+ *        Terms above the expansion order they are used with are left at zero.
+ */
+struct LocalExpansion {
+    double phi;             //!< Potential of a unit mass at the expansion center.
+    Eigen::Vector3d g;      //!< Acceleration at the expansion center.
+    Eigen::Matrix3d T;      //!< First derivatives of the acceleration. T(i, l) = dg_i/dx_l.
+    Eigen::Matrix3d S[3];   //!< Second derivatives of the acceleration. S[i](l, k) = d^2g_i/dx_l dx_k.
+
+    //!< Sets every term to zero.
+    void setZero();
+
+    //!< Returns the acceleration at offset d from the expansion center, using terms up to the given order.
+    Eigen::Vector3d evaluate(const Eigen::Vector3d& d, int order) const;
+
+    //!< Returns the potential at offset d from the expansion center. The acceleration is minus its gradient,
+    //!< so the acceleration terms up to the given order give the potential to one order higher.
+    double evaluatePotential(const Eigen::Vector3d& d, int order) const;
+
+    //!< Returns the tidal tensor, minus the gradient of the acceleration, at offset d from the expansion center.
+    //!< Terms of the acceleration up to the given order give it to one order lower.
+    Eigen::Matrix3d evaluateTidalTensor(const Eigen::Vector3d& d, int order) const;
+
+    //!< Adds this expansion, re-centered at offset d from the expansion center, to other.
+    void shiftTo(LocalExpansion& other, const Eigen::Vector3d& d, int order) const;
+};
+
+
+/**
+ * @brief Sources acting on a group of bodies in the Barnes-Hut group walk.
+ *        Stored as a structure of arrays so the list can be streamed through a vectorized kernel.
+ *        Capacity is kept between groups, so refilling the list does not allocate once it has grown.
+ */
+struct InteractionList {
+    std::vector<double> nodeX, nodeY, nodeZ;    //!< Center of mass of each accepted node.
+    std::vector<double> nodeM;                  //!< Total mass of each accepted node.
+    std::vector<double> qxx, qxy, qxz;          //!< Upper triangle of the quadrupole moment of each accepted node.
+    std::vector<double> qyy, qyz, qzz;          //!< Only filled if the list was built with quadrupoles.
+
+    std::vector<double> bodyX, bodyY, bodyZ;    //!< Position of each body interacting directly with the group.
+    std::vector<double> bodyM;                  //!< Mass of each body interacting directly with the group.
+
+    Eigen::Vector3d floatCenter;                //!< Origin of #floatSources.
+    FloatSourceArrays floatSources;             //!< Single precision copy of the nodes followed by the bodies, relative to #floatCenter. Filled by convertToFloat().
+
+    //!< Removes every entry, keeping capacity.
+    void clear();
+
+    //!< Appends an accepted node. Its quadrupole moment is only stored if withQuadrupole is set.
+    void addNode(const LinearOctreeNode& node, bool withQuadrupole);
+
+    //!< Appends the bodies of an external node, stored contiguously in Morton order.
+    void addBodies(const SourceBlock& bodies);
+
+    //!< Returns the accepted nodes as sources.
+    SourceBlock nodeSources() const;
+
+    //!< Returns the bodies as sources.
+    SourceBlock bodySources() const;
+
+    //!< Returns the quadrupole moment of node k as a matrix.
+    Eigen::Matrix3d quadrupole(int k) const;
+
+    //!< Fills #floatSources with the nodes and bodies relative to center, for the mixed precision kernels.
+    void convertToFloat(const Eigen::Vector3d& center);
+
+    int nNodes() const { return nodeM.size(); }     //!< Number of accepted nodes.
+    int nBodies() const { return bodyM.size(); }    //!< Number of bodies.
+};
+
+
+/**
+ * Base of force-law policies for the Direct, BarnesHut and FMM engine templates.
+ * A policy derives from ForceLaw<itself> and defines
+ *
+ *     void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i, const Eigen::Vector3d& x_i, const Eigen::Vector3d& x_j, double m_i, double m_j) const;
+ *     double pairPotentialEnergy(const Eigen::Vector3d& x_i, const Eigen::Vector3d& x_j, double m_i, double m_j) const;
+ *
+ * with the same meaning as the DynamicsEngine methods of the same name. The kernels below
+ * are built from pairAcceleration() and pairPotentialEnergy(). A policy can hide any of them with a faster or more
+ * accurate version; engines call them on the policy type, so they are resolved at compile time.
+ */
+template <typename Law>
+struct ForceLaw {
+    //!< Adds the acceleration of i due to a block of sources, skipping sources at x_i.
+    void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                           const Eigen::Vector3d& x_i,
+                           double m_i,
+                           const SourceBlock& sources) const {
+        for (int j = 0; j < sources.n; ++j) {
+            Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+            if (x_j == x_i) continue;
+            this->law().pairAcceleration(a_i, x_i, x_j, m_i, sources.m[j]);
+        }
+    }
+
+    //!< Adds the acceleration of i due to a block of sources and, in the same pass, the potential of a unit mass at x_i
+    //!< to *phi_i and the tidal tensor to *T_i, each only if not nullptr. Skips sources at x_i.
+    void batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                  double* phi_i,
+                                  Eigen::Matrix3d* T_i,
+                                  const Eigen::Vector3d& x_i,
+                                  double m_i,
+                                  const SourceBlock& sources) const {
+        for (int j = 0; j < sources.n; ++j) {
+            Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+            if (x_j == x_i) continue;
+            this->law().pairAcceleration(a_i, x_i, x_j, m_i, sources.m[j]);
+            // Pair energies are halved, so the potential of a unit mass is twice the pair energy
+            if (phi_i) *phi_i += 2*this->law().pairPotentialEnergy(x_i, x_j, 1.0, sources.m[j]);
+            if (T_i) this->law().pairTidalTensor(*T_i, x_i, x_j, m_i, sources.m[j]);
+        }
+    }
+
+    //!< Adds the acceleration of i due to a tree node. Ignores the quadrupole moment.
+    void multipoleAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                               const Eigen::Vector3d& x_i,
+                               double m_i,
+                               const Eigen::Vector3d& centerOfMass,
+                               double totalMass,
+                               const Eigen::Matrix3d& quadrupole) const {
+        this->law().pairAcceleration(a_i, x_i, centerOfMass, m_i, totalMass);
+    }
+
+    //!< Returns the sum of pairPotentialEnergy() of i with a block of sources, skipping sources at x_i.
+    double batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                double m_i,
+                                const SourceBlock& sources) const {
+        double u = 0;
+        for (int j = 0; j < sources.n; ++j) {
+            Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+            if (x_j == x_i) continue;
+            u += this->law().pairPotentialEnergy(x_i, x_j, m_i, sources.m[j]);
+        }
+        return u;
+    }
+
+    //!< Returns the potential energy of i due to a tree node. Ignores the quadrupole moment.
+    double multipolePotentialEnergy(const Eigen::Vector3d& x_i,
+                                    double m_i,
+                                    const Eigen::Vector3d& centerOfMass,
+                                    double totalMass,
+                                    const Eigen::Matrix3d& quadrupole) const {
+        return this->law().pairPotentialEnergy(x_i, centerOfMass, m_i, totalMass);
+    }
+
+    //!< Adds the second derivatives of the potential at x_i due to j, -d(a_i)/d(x_i),
+    //!< by central differences of pairAcceleration(). Laws with a closed form should hide it.
+    void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                         const Eigen::Vector3d& x_i,
+                         const Eigen::Vector3d& x_j,
+                         double m_i,
+                         double m_j) const {
+        double h = 1e-5*(x_i - x_j).norm();
+        if (h == 0) return;
+        for (int dim = 0; dim < 3; ++dim) {
+            Eigen::Vector3d xPlus = x_i, xMinus = x_i;
+            xPlus(dim) += h;
+            xMinus(dim) -= h;
+            Eigen::Vector3d aPlus = Eigen::Vector3d::Zero(), aMinus = Eigen::Vector3d::Zero();
+            this->law().pairAcceleration(aPlus, xPlus, x_j, m_i, m_j);
+            this->law().pairAcceleration(aMinus, xMinus, x_j, m_i, m_j);
+            T_i.col(dim) -= (aPlus - aMinus)/(2*h);
+        }
+    }
+
+    //!< Adds the acceleration of i due to j, and its time derivative for velocities v_i and v_j to j_i.
+    //!< The jerk is minus pairTidalTensor() applied to the relative velocity v_i - v_j.
+    void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                              Eigen::Ref<Eigen::Vector3d> j_i,
+                              const Eigen::Vector3d& x_i,
+                              const Eigen::Vector3d& x_j,
+                              const Eigen::Vector3d& v_i,
+                              const Eigen::Vector3d& v_j,
+                              double m_i,
+                              double m_j) const {
+        this->law().pairAcceleration(a_i, x_i, x_j, m_i, m_j);
+        Eigen::Matrix3d T = Eigen::Matrix3d::Zero();
+        this->law().pairTidalTensor(T, x_i, x_j, m_i, m_j);
+        j_i -= T*(v_i - v_j);
+    }
+
+    //!< Adds the accelerations and jerks of bodies iBegin to iEnd due to bodies jBegin to jEnd, skipping self-interaction.
+    void tileAccelerationJerk(Eigen::Ref<Eigen::Matrix3Xd> a,
+                              Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                              const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                              const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                              const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                              int iBegin, int iEnd, int jBegin, int jEnd) const {
+        for (int i = iBegin; i < iEnd; ++i) {
+            for (int j = jBegin; j < jEnd; ++j) {
+                if (i == j) continue;
+                this->law().pairAccelerationJerk(a.col(i), jerk.col(i), x.col(i), x.col(j), v.col(i), v.col(j), m(i), m(j));
+            }
+        }
+    }
+
+    //!< Adds the tidal tensor at x_i due to a block of sources, skipping sources at x_i.
+    void batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                          const Eigen::Vector3d& x_i,
+                          double m_i,
+                          const SourceBlock& sources) const {
+        for (int j = 0; j < sources.n; ++j) {
+            Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+            if (x_j == x_i) continue;
+            this->law().pairTidalTensor(T_i, x_i, x_j, m_i, sources.m[j]);
+        }
+    }
+
+    //!< Adds the tidal tensor at x_i due to a tree node. Ignores the quadrupole moment.
+    void multipoleTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                              const Eigen::Vector3d& x_i,
+                              double m_i,
+                              const Eigen::Vector3d& centerOfMass,
+                              double totalMass,
+                              const Eigen::Matrix3d& quadrupole) const {
+        this->law().pairTidalTensor(T_i, x_i, centerOfMass, m_i, totalMass);
+    }
+
+    //!< Adds the field of a source cell to the local expansion of a target cell. Computes the potential, the acceleration
+    //!< and, at order 1 and above, the first order term from pairTidalTensor(). Ignores the quadrupole moment.
+    void multipoleToLocal(LocalExpansion& local,
+                          const LinearOctreeNode& target,
+                          const LinearOctreeNode& source,
+                          int order) const {
+        // Mean body mass of the target stands in for m_i
+        double m_i = target.totalMass/target.nBodies;
+        Eigen::Vector3d g = Eigen::Vector3d::Zero();
+        this->law().pairAcceleration(g, target.centerOfMass, source.centerOfMass, m_i, source.totalMass);
+        local.g += g;
+        local.phi += 2*this->law().pairPotentialEnergy(target.centerOfMass, source.centerOfMass, 1.0, source.totalMass);
+        if (order < 1) return;
+        Eigen::Matrix3d tidal = Eigen::Matrix3d::Zero();
+        this->law().pairTidalTensor(tidal, target.centerOfMass, source.centerOfMass, m_i, source.totalMass);
+        local.T -= tidal;
+    }
+
+    //!< Adds the acceleration due to an interaction list to each body of a group.
+    //!< Nodes go through multipoleAcceleration() at expansion order 2 and through batchAcceleration() otherwise.
+    //!< Ignores mixedPrecision, which laws with a single precision kernel can use to read list.floatSources instead.
+    void listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                          const int* bodies,
+                          int nBodies,
+                          const InteractionList& list,
+                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                          int expansionOrder,
+                          bool mixedPrecision) const {
+        for (int k = 0; k < nBodies; ++k) {
+            int i = bodies[k];
+            if (expansionOrder >= 2) {
+                for (int l = 0; l < list.nNodes(); ++l) {
+                    Eigen::Vector3d centerOfMass(list.nodeX[l], list.nodeY[l], list.nodeZ[l]);
+                    this->law().multipoleAcceleration(a.col(i), x.col(i), m(i), centerOfMass, list.nodeM[l], list.quadrupole(l));
+                }
+            } else {
+                this->law().batchAcceleration(a.col(i), x.col(i), m(i), list.nodeSources());
+            }
+            this->law().batchAcceleration(a.col(i), x.col(i), m(i), list.bodySources());
+        }
+    }
+
+    //!< Adds the accelerations of every pair between bodies iBegin to iEnd and jBegin to jEnd to both bodies of the pair,
+    //!< computing each pair once. Within one tile only pairs with j > i are visited. Assumes Newton's third law.
+    void symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                   const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                   int iBegin, int iEnd, int jBegin, int jEnd) const {
+        for (int i = iBegin; i < iEnd; ++i) {
+            for (int j = std::max(jBegin, i + 1); j < jEnd; ++j) {
+                Eigen::Vector3d a_ij = Eigen::Vector3d::Zero();
+                this->law().pairAcceleration(a_ij, x.col(i), x.col(j), m(i), m(j));
+                a.col(i) += a_ij;
+                if (m(j) != 0) {
+                    a.col(j) -= a_ij*m(i)/m(j);
+                } else {
+                    // A massless body feels the pair force but cannot take the reaction, so evaluate its side on its own
+                    this->law().pairAcceleration(a.col(j), x.col(j), x.col(i), m(j), m(i));
+                }
+            }
+        }
+    }
+
+    const Law& law() const { return static_cast<const Law&>(*this); }
+};
+
+
+/**
+ * Newtonian gravitation with Plummer softening.
+ */
+struct NewtonianGravity: ForceLaw<NewtonianGravity> {
+    double G;           //!< Gravitational constant in the chosen units
+    double softening;   //!< Plummer softening length
+
+    /**
+     * @brief Construct a NewtonianGravity object
+     *
+     * @param softening Softening parameter
+     * @param l Unit of length
+     * @param m Unit of mass
+     * @param t Unit of time
+     */
+    NewtonianGravity(double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second);
+
+    void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                          const Eigen::Vector3d& x_i,
+                          const Eigen::Vector3d& x_j,
+                          double m_i,
+                          double m_j) const {
+        Eigen::Vector3d dx = x_i - x_j;
+        double r2 = dx.squaredNorm() + softening*softening;
+        a_i += -G*m_j*dx/(r2*std::sqrt(r2));
+    }
+
+    void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                           const Eigen::Vector3d& x_i,
+                           double m_i,
+                           const SourceBlock& sources) const {
+        gravitationalBatch(a_i, x_i, sources, G, softening*softening);
+    }
+
+    //!< Shares the distance of each pair between the acceleration, potential and tidal tensor.
+    void batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                  double* phi_i,
+                                  Eigen::Matrix3d* T_i,
+                                  const Eigen::Vector3d& x_i,
+                                  double m_i,
+                                  const SourceBlock& sources) const;
+
+    //!< Adds the acceleration of i due to a node's monopole and quadrupole moments.
+    void multipoleAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                               const Eigen::Vector3d& x_i,
+                               double m_i,
+                               const Eigen::Vector3d& centerOfMass,
+                               double totalMass,
+                               const Eigen::Matrix3d& quadrupole) const {
+        // Potential of the node is -G*(M/r + r^T*Q*r/(2*r^5)) with r pointing from the center of mass to i
+        Eigen::Vector3d r = x_i - centerOfMass;
+        double invR2 = 1.0/(r.squaredNorm() + softening*softening);
+        double invR = std::sqrt(invR2);
+        double invR5 = invR2*invR2*invR;
+
+        Eigen::Vector3d Qr = quadrupole*r;
+        double rQr = r.dot(Qr);
+        a_i += G*(-totalMass*invR2*invR*r + invR5*Qr - 2.5*rQr*invR5*invR2*r);
+    }
+
+    //!< Monopoles and bodies go through the batch kernel, or the mixed precision kernel if mixedPrecision is set.
+    //!< Only the quadrupole correction needs its own loop, which always runs in double precision.
+    void listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                          const int* bodies,
+                          int nBodies,
+                          const InteractionList& list,
+                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                          int expansionOrder,
+                          bool mixedPrecision) const;
+
+    //!< Adds the local expansion of a cell's monopole and (at order 2) quadrupole moments, up to the given order.
+    void multipoleToLocal(LocalExpansion& local,
+                          const LinearOctreeNode& target,
+                          const LinearOctreeNode& source,
+                          int order) const;
+
+    //!< One inverse cube per pair, scaled by the mass of the other body for each side.
+    void symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                   const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                   int iBegin, int iEnd, int jBegin, int jEnd) const;
+
+    double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                               const Eigen::Vector3d& x_j,
+                               double m_i,
+                               double m_j) const {
+        return -G*m_j*m_i/2.0/(x_j - x_i).norm();
+    }
+
+    //!< Shares the inverse cube between the acceleration and the jerk.
+    void pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                              Eigen::Ref<Eigen::Vector3d> j_i,
+                              const Eigen::Vector3d& x_i,
+                              const Eigen::Vector3d& x_j,
+                              const Eigen::Vector3d& v_i,
+                              const Eigen::Vector3d& v_j,
+                              double m_i,
+                              double m_j) const {
+        Eigen::Vector3d dx = x_j - x_i;
+        Eigen::Vector3d dv = v_j - v_i;
+        double invR2 = 1.0/(dx.squaredNorm() + softening*softening);
+        double Gm_invR3 = G*m_j*invR2*std::sqrt(invR2);
+        double rv = 3.0*dx.dot(dv)*invR2;
+        a_i += Gm_invR3*dx;
+        j_i += Gm_invR3*(dv - rv*dx);
+    }
+
+    //!< Adds the second derivatives of the softened potential of j at x_i.
+    void pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                         const Eigen::Vector3d& x_i,
+                         const Eigen::Vector3d& x_j,
+                         double m_i,
+                         double m_j) const {
+        Eigen::Vector3d dx = x_i - x_j;
+        double invR2 = 1.0/(dx.squaredNorm() + softening*softening);
+        double invR3 = invR2*std::sqrt(invR2);
+        T_i += G*m_j*invR3*(Eigen::Matrix3d::Identity() - 3.0*invR2*dx*dx.transpose());
+    }
+
+    //!< Returns the potential energy of i due to a node's monopole and quadrupole moments, halved like pairPotentialEnergy().
+    double multipolePotentialEnergy(const Eigen::Vector3d& x_i,
+                                    double m_i,
+                                    const Eigen::Vector3d& centerOfMass,
+                                    double totalMass,
+                                    const Eigen::Matrix3d& quadrupole) const {
+        Eigen::Vector3d r = x_i - centerOfMass;
+        double invR2 = 1.0/r.squaredNorm();
+        double invR = std::sqrt(invR2);
+        return -G*m_i/2.0*(totalMass*invR + 0.5*r.dot(quadrupole*r)*invR2*invR2*invR);
+    }
+};
+
+
+/**
+ * Newtonian gravitation softened with a cubic spline kernel.
+ * Exactly Newtonian beyond the kernel support h. A Plummer softening of about h/2.8 gives the same potential at r = 0.
+ */
+struct SplineGravity: ForceLaw<SplineGravity> {
+    double G;   //!< Gravitational constant in the chosen units
+    double h;   //!< Support radius of the spline kernel
+
+    /**
+     * @brief Construct a SplineGravity object
+     *
+     * @param h Support radius of the spline kernel
+     * @param l Unit of length
+     * @param m Unit of mass
+     * @param t Unit of time
+     */
+    SplineGravity(double h, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second);
+
+    void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                          const Eigen::Vector3d& x_i,
+                          const Eigen::Vector3d& x_j,
+                          double m_i,
+                          double m_j) const {
+        Eigen::Vector3d dx = x_i - x_j;
+        double r = dx.norm();
+        double factor;
+        if (r >= h) {
+            factor = 1.0/(r*r*r);
+        } else {
+            double u = r/h;
+            double invH3 = 1.0/(h*h*h);
+            if (u < 0.5) {
+                factor = invH3*(32.0/3.0 + u*u*(32.0*u - 38.4));
+            } else {
+                factor = invH3*(64.0/3.0 - 48.0*u + 38.4*u*u - 32.0/3.0*u*u*u - 1.0/15.0/(u*u*u));
+            }
+        }
+        a_i += -G*m_j*factor*dx;
+    }
+
+    double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                               const Eigen::Vector3d& x_j,
+                               double m_i,
+                               double m_j) const;
+};
+
+
+/**
+ * Lennard-Jones 12-6 interaction, cut off at a given distance.
+ * Does not depend on the source's mass, so multipole approximations
+ * are only meaningful in the Direct engine or with a very small theta.
+ */
+struct LennardJones: ForceLaw<LennardJones> {
+    double epsilon; //!< Depth of the potential well
+    double sigma;   //!< Distance at which the potential is zero
+    double cutoff;  //!< Pairs further apart than this do not interact
+
+    /**
+     * @brief Construct a LennardJones object
+     *
+     * @param epsilon Depth of the potential well
+     * @param sigma Distance at which the potential is zero
+     * @param cutoff Pairs further apart than this do not interact
+     */
+    LennardJones(double epsilon, double sigma, double cutoff = std::numeric_limits<double>::infinity());
+
+    void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                          const Eigen::Vector3d& x_i,
+                          const Eigen::Vector3d& x_j,
+                          double m_i,
+                          double m_j) const {
+        Eigen::Vector3d dx = x_i - x_j;
+        double r2 = dx.squaredNorm();
+        if (r2 > cutoff*cutoff) return;
+        double s6 = sigma*sigma/r2;
+        s6 = s6*s6*s6;
+        a_i += 24.0*epsilon*(2.0*s6*s6 - s6)/(r2*m_i)*dx;
+    }
+
+    double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                               const Eigen::Vector3d& x_j,
+                               double m_i,
+                               double m_j) const;
+};
+
+
+/**
+ * Softened Coulomb interaction between bodies that share one charge-to-mass ratio,
+ * so that the charge of each body is chargeToMass times its mass. Like charges repel.
+ */
+struct Coulomb: ForceLaw<Coulomb> {
+    double k;               //!< Coulomb constant in the chosen units
+    double chargeToMass;    //!< Charge per unit mass of every body, in coulombs per unit mass
+    double softening;       //!< Plummer softening length
+
+    /**
+     * @brief Construct a Coulomb object
+     *
+     * @param chargeToMass Charge per unit mass of every body, in coulombs per unit mass
+     * @param softening Softening parameter
+     * @param l Unit of length
+     * @param m Unit of mass
+     * @param t Unit of time
+     */
+    Coulomb(double chargeToMass, double softening, unit_t l = Unit::Meter, unit_t m = Unit::Kilogram, unit_t t = Unit::Second);
+
+    void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                          const Eigen::Vector3d& x_i,
+                          const Eigen::Vector3d& x_j,
+                          double m_i,
+                          double m_j) const {
+        Eigen::Vector3d dx = x_i - x_j;
+        double r2 = dx.squaredNorm() + softening*softening;
+        a_i += k*chargeToMass*chargeToMass*m_j*dx/(r2*std::sqrt(r2));
+    }
+
+    void batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                           const Eigen::Vector3d& x_i,
+                           double m_i,
+                           const SourceBlock& sources) const {
+        // Same kernel as gravitation with a negative coupling
+        gravitationalBatch(a_i, x_i, sources, -k*chargeToMass*chargeToMass, softening*softening);
+    }
+
+    double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                               const Eigen::Vector3d& x_j,
+                               double m_i,
+                               double m_j) const {
+        return k*chargeToMass*chargeToMass*m_j*m_i/2.0/(x_j - x_i).norm();
+    }
+};
+
+#endif
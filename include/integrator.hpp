@@ -1,8 +1,12 @@
 #ifndef NBT_INTEGRATOR_HPP
 #define NBT_INTEGRATOR_HPP
 
+#include <vector>
+
 #include <Eigen>
 
+class DynamicsEngine;
+
 /**
  * Abstract function object for integrators. Integrators
  * are functional interfaces that update the position and
@@ -10,8 +14,53 @@
  */
 class Integrator {
     public:
+        bool accelerationsValid = false;    //!< True if the accelerations passed to step() are at the current positions, as the last step left them. Cleared by addBody() and removeBody().
+
+        virtual ~Integrator() = default;
+
+        /**
+         * @brief Advances the system by one time step, computing accelerations with engine.
+         *        Called by Simulator::step(). Default implementation computes accelerations at the current
+         *        positions once and passes them to integrate(). Integrators that need more than that override it.
+         *        Overrides may evaluate engine at any number of trial positions. Engines keep their trees and
+         *        buffers between calls, so repeated evaluations on the same number of bodies do not reallocate.
+         * 
+         * @param dt Time step
+         * @param engine Engine accelerations are computed with
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        virtual void step(double dt,
+                          DynamicsEngine& engine,
+                          Eigen::Ref<Eigen::Matrix3Xd> a,
+                          Eigen::Ref<Eigen::Matrix3Xd> v,
+                          Eigen::Ref<Eigen::Matrix3Xd> x,
+                          const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+        /**
+         * @brief Called by Simulator::delObject() when body idx is removed and the last body, lastIdx, takes its column.
+         *        Integrators that keep per-body state move it the same way. Default implementation clears
+         *        #accelerationsValid, since the removed body no longer pulls on the others.
+         * 
+         * @param idx Column of the removed body
+         * @param lastIdx Column of the last body, moved to idx
+         */
+        virtual void removeBody(int idx, int lastIdx) { this->accelerationsValid = false; }
+
+        /**
+         * @brief Called by Simulator::addObject() when a body with zero acceleration is appended at column idx.
+         *        Default implementation clears #accelerationsValid, so integrators that carry accelerations
+         *        over from the last step recompute them at the start of the next one.
+         * 
+         * @param idx Column of the new body
+         */
+        virtual void addBody(int idx) { this->accelerationsValid = false; }
+
         /**
          * @brief Computes velocities and positions from accelerations and time step.
+         *        Matrices without padding between columns, like the Simulator's, take a path vectorized across columns.
          * 
          * @param dt Time step
          * @param a Acceleration matrix
@@ -19,9 +68,9 @@ class Integrator {
          * @param x Position matrix
          */
         virtual void integrate(double dt,
-                               const Eigen::Ref<const Eigen::MatrixXd>& a,
-                               Eigen::Ref<Eigen::MatrixXd> v,
-                               Eigen::Ref<Eigen::MatrixXd> x) = 0;
+                               const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                               Eigen::Ref<Eigen::Matrix3Xd> v,
+                               Eigen::Ref<Eigen::Matrix3Xd> x) = 0;
 };
 
 
@@ -39,9 +88,9 @@ class EulerIntegrator: public Integrator {
          * @param x Position matrix
          */
         void integrate(double dt,
-                       const Eigen::Ref<const Eigen::MatrixXd>& a,
-                       Eigen::Ref<Eigen::MatrixXd> v,
-                       Eigen::Ref<Eigen::MatrixXd> x);
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
 };
 
 
@@ -51,7 +100,7 @@ class EulerIntegrator: public Integrator {
 class VerletIntegrator: public Integrator {
     public:
         bool isFirstIteration = true;
-        Eigen::MatrixXd aPrev;
+        Eigen::Matrix3Xd aPrev;
 
         /**
          * @brief Computes velocities and positions from accelerations and time step.
@@ -62,19 +111,273 @@ class VerletIntegrator: public Integrator {
          * @param x Position matrix
          */
         void integrate(double dt,
-                       const Eigen::Ref<const Eigen::MatrixXd>& a,
-                       Eigen::Ref<Eigen::MatrixXd> v,
-                       Eigen::Ref<Eigen::MatrixXd> x);
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
+};
+
+
+/**
+ * Performs kick-drift-kick leapfrog integration. Same accuracy as VerletIntegrator, but keeps
+ * no copy of the accelerations and updates x and v in one multithreaded pass per step.
+ */
+class LeapfrogIntegrator: public Integrator {
+    public:
+        bool synchronizeVelocities = true;  //!< Apply the closing half kick at the end of each step, so velocities match positions. Otherwise it is merged into the next opening kick and velocities lag half a step behind positions between steps.
+        bool velocitiesLag = false;         //!< True if velocities are half a step behind positions.
+
+        /**
+         * @brief Kicks velocities and drifts positions in one pass, computes accelerations at the new positions
+         *        and, if #synchronizeVelocities is set, applies the closing half kick. Loops run on the engine's threads.
+         *        Accelerations are computed at the start of the step as well unless #accelerationsValid is set.
+         * 
+         * @param dt Time step
+         * @param engine Engine accelerations are computed with
+         * @param a Acceleration matrix, at the current positions on entry and at the new ones on return
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void step(double dt,
+                  DynamicsEngine& engine,
+                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                  Eigen::Ref<Eigen::Matrix3Xd> v,
+                  Eigen::Ref<Eigen::Matrix3Xd> x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Kicks velocities with accelerations at the current positions and drifts positions in one pass.
+         *        The closing half kick is left to the next call, so velocities lag half a step behind positions.
+         * 
+         * @param dt Time step
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         */
+        void integrate(double dt,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
 };
 
 
 /**
- * Performs Runge-Kutta 4th order integration method. More accurate than EulerIntegrator but slower.
+ * Performs classical Runge-Kutta 4th order integration. Evaluates forces at three trial states
+ * and at the end of each step. More accurate than EulerIntegrator but slower, and not symplectic,
+ * so energy drifts over long runs.
  */
 class RungeKuttaIntegrator: public Integrator {
     public:
+        Eigen::Matrix3Xd xStage;  //!< Position of the current stage.
+        Eigen::Matrix3Xd kx;      //!< Velocity of the current stage, the slope of the positions.
+        Eigen::Matrix3Xd kv;      //!< Acceleration of the current stage, the slope of the velocities.
+        Eigen::Matrix3Xd xSlope;  //!< Weighted sum of the position slopes of the stages so far.
+        Eigen::Matrix3Xd vSlope;  //!< Weighted sum of the velocity slopes of the stages so far.
+
         /**
-         * @brief Computes velocities and positions from accelerations and time step.
+         * @brief Evaluates accelerations at the midpoint and end trial states and combines the four stages.
+         *        Accelerations at the new positions are computed on return and serve as the first stage of the next step.
+         * 
+         * @param dt Time step
+         * @param engine Engine accelerations are computed with
+         * @param a Acceleration matrix, at the current positions on entry and at the new ones on return
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void step(double dt,
+                  DynamicsEngine& engine,
+                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                  Eigen::Ref<Eigen::Matrix3Xd> v,
+                  Eigen::Ref<Eigen::Matrix3Xd> x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Not usable on its own, since a Runge-Kutta step needs forces at trial states. Throws std::logic_error.
+         * 
+         * @param dt Time step
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         */
+        void integrate(double dt,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
+};
+
+
+/**
+ * Performs Yoshida's symplectic integration of order 4 or 6, a symmetric composition of
+ * kick-drift-kick leapfrog substeps, some of them backwards in time. Takes 3 force evaluations
+ * per step at order 4 and 7 at order 6, with bounded energy error like LeapfrogIntegrator.
+ */
+class YoshidaIntegrator: public Integrator {
+    public:
+        const int order;                //!< Order of the method, 4 or 6.
+        std::vector<double> weights;    //!< Fraction of the time step taken by each leapfrog substep.
+
+        /**
+         * @brief Construct a YoshidaIntegrator object. Throws std::invalid_argument for orders other than 4 and 6.
+         * 
+         * @param order Order of the method
+         */
+        YoshidaIntegrator(int order = 4);
+
+        /**
+         * @brief Runs the leapfrog substeps, merging the closing half kick of each with the opening half kick of the next.
+         *        Loops run on the engine's threads.
+         * 
+         * @param dt Time step
+         * @param engine Engine accelerations are computed with
+         * @param a Acceleration matrix, at the current positions on entry and at the new ones on return
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void step(double dt,
+                  DynamicsEngine& engine,
+                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                  Eigen::Ref<Eigen::Matrix3Xd> v,
+                  Eigen::Ref<Eigen::Matrix3Xd> x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Not usable on its own, since every substep needs forces at its new positions. Throws std::logic_error.
+         * 
+         * @param dt Time step
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         */
+        void integrate(double dt,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
+};
+
+
+/**
+ * Performs 4th order Hermite predictor-corrector integration. Needs the jerk of every body,
+ * which the engine computes in the same pair loop as the acceleration. Much more accurate than
+ * VerletIntegrator at the same time step, at one force evaluation per step.
+ * Engines other than Abstract_Direct compute jerks with an O(n^2) pair loop.
+ */
+class HermiteIntegrator: public Integrator {
+    public:
+        Eigen::Matrix3Xd jerk;  //!< Jerk of each body at the start of the next step.
+        Eigen::Matrix3Xd a0;    //!< Acceleration at the start of the step.
+        Eigen::Matrix3Xd j0;    //!< Jerk at the start of the step.
+        Eigen::Matrix3Xd x0;    //!< Position at the start of the step.
+        Eigen::Matrix3Xd v0;    //!< Velocity at the start of the step.
+
+        /**
+         * @brief Predicts positions and velocities from the accelerations and jerks of the last step,
+         *        evaluates accelerations and jerks there and corrects with them.
+         *        The corrected state's forces are taken from the predicted one, so each step evaluates forces once.
+         *        Forces are evaluated at the start of the step as well unless #accelerationsValid is set and #jerk covers every body.
+         * 
+         * @param dt Time step
+         * @param engine Engine accelerations and jerks are computed with
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void step(double dt,
+                  DynamicsEngine& engine,
+                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                  Eigen::Ref<Eigen::Matrix3Xd> v,
+                  Eigen::Ref<Eigen::Matrix3Xd> x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Moves the jerk of the last body to idx and drops its last column, so #jerk stays aligned with the bodies.
+         *        Forces are still evaluated afresh at the start of the next step.
+         * 
+         * @param idx Column of the removed body
+         * @param lastIdx Column of the last body, moved to idx
+         */
+        void removeBody(int idx, int lastIdx) override;
+
+        /**
+         * @brief Not usable on its own, since a Hermite step needs forces at the predicted state. Throws std::logic_error.
+         * 
+         * @param dt Time step
+         * @param a Acceleration matrix
+         * @param v Velocity matrix
+         * @param x Position matrix
+         */
+        void integrate(double dt,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
+};
+
+
+/**
+ * Performs Adams-Bashforth-Moulton integration in predict-evaluate-correct mode. Velocities and
+ * positions are advanced with weights on the accelerations of the last order steps, kept in a ring
+ * buffer, so each step evaluates forces once at any order. The first order - 1 steps after the number
+ * of bodies changes are taken with YoshidaIntegrator(6) substeps to fill the buffer.
+ * Not symplectic, so energy drifts over long runs.
+ */
+class AdamsBashforthMoultonIntegrator: public Integrator {
+    public:
+        const int order;                        //!< Order of the method, from 2 to 8. Also the number of accelerations kept.
+        int startupSubsteps = 4;                //!< Number of YoshidaIntegrator(6) substeps each startup step is split into.
+        std::vector<Eigen::Matrix3Xd> history;  //!< Ring buffer of the accelerations of the last #order steps.
+        int newest = 0;                         //!< Index of the latest accelerations in #history.
+        int nHistory = 0;                       //!< Number of valid entries in #history.
+        int nBodies = -1;                       //!< Number of bodies #history holds, or -1 if bodies were added since the last step. The history is restarted if it changes other than through removeBody().
+        Eigen::Matrix3Xd x0;                    //!< Position at the start of the step.
+        Eigen::Matrix3Xd v0;                    //!< Velocity at the start of the step.
+
+        /**
+         * @brief Construct a AdamsBashforthMoultonIntegrator object. Throws std::invalid_argument for orders outside 2 to 8.
+         * 
+         * @param order Order of the method
+         */
+        AdamsBashforthMoultonIntegrator(int order = 4);
+
+        /**
+         * @brief Predicts positions and velocities from the history, evaluates accelerations there and corrects with them.
+         *        Forces of the corrected state are taken from the predicted one, so each step evaluates forces once.
+         * 
+         *        The history is restarted when bodies were added or #accelerationsValid was cleared by steps taken without it.
+         * 
+         * @param dt Time step. Must stay the same between steps, since the weights assume equally spaced history.
+         * @param engine Engine accelerations are computed with
+         * @param a Acceleration matrix, at the predicted positions on return
+         * @param v Velocity matrix
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        void step(double dt,
+                  DynamicsEngine& engine,
+                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                  Eigen::Ref<Eigen::Matrix3Xd> v,
+                  Eigen::Ref<Eigen::Matrix3Xd> x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m) override;
+
+        /**
+         * @brief Moves the history of the last body to idx and drops its last column. The history is kept,
+         *        so #accelerationsValid is left as it is. Bodies added since the last step are left to the restart in step().
+         * 
+         * @param idx Column of the removed body
+         * @param lastIdx Column of the last body, moved to idx
+         */
+        void removeBody(int idx, int lastIdx) override;
+
+        /**
+         * @brief Makes the next step restart the history, since it has no accelerations for the new body.
+         * 
+         * @param idx Column of the new body
+         */
+        void addBody(int idx) override;
+
+        /**
+         * @brief Not usable on its own, since the corrector needs forces at the predicted state. Throws std::logic_error.
          * 
          * @param dt Time step
          * @param a Acceleration matrix
@@ -82,9 +385,19 @@ class RungeKuttaIntegrator: public Integrator {
          * @param x Position matrix
          */
         void integrate(double dt,
-                       const Eigen::Ref<const Eigen::MatrixXd>& a,
-                       Eigen::Ref<Eigen::MatrixXd> v,
-                       Eigen::Ref<Eigen::MatrixXd> x); // TODO runge kutta
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                       Eigen::Ref<Eigen::Matrix3Xd> v,
+                       Eigen::Ref<Eigen::Matrix3Xd> x);
+
+    private:
+        YoshidaIntegrator starter{6};       //!< Integrator of the startup steps.
+        std::vector<double> predictV;       //!< Velocity weights of a_n, a_(n-1), ... in the predictor.
+        std::vector<double> predictX;       //!< Position weights of a_n, a_(n-1), ... in the predictor.
+        std::vector<double> correctV;       //!< Velocity weights of a_(n+1), a_n, ... in the corrector.
+        std::vector<double> correctX;       //!< Position weights of a_(n+1), a_n, ... in the corrector.
+
+        /*! Returns the accelerations of back steps before the latest ones. */
+        const Eigen::Matrix3Xd& past(int back) const;
 };
 
-#endif
\ No newline at end of file
+#endif
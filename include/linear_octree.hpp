@@ -0,0 +1,113 @@
+#ifndef NBT_LINEAR_OCTREE_HPP
+#define NBT_LINEAR_OCTREE_HPP
+
+#include <vector>
+#include <cstdint>
+#include <utility>
+
+#include <Eigen>
+#include "thread_pool.hpp"
+#include "force_kernel.hpp"
+
+#define LINEAR_OCTREE_MAX_DEPTH 21  //!< Deepest level of a LinearOctree. Morton keys use 21 bits per axis.
+
+/**
+ * @brief Node struct for LinearOctree.
+ *        Nodes live in one contiguous array. Only non-empty octants are stored,
+ *        and the children of a node are stored next to each other.
+ */
+struct LinearOctreeNode {
+    bool isExternal = false;    //<! True if this node is external (has no children).
+
+    double xMin, xMax;  //!< Bounds in x dimension
+    double yMin, yMax;  //!< Bounds in y dimension
+    double zMin, zMax;  //!< Bounds in z dimension. The octree cell after LinearOctree::build(), the bounding box of the node's bodies after LinearOctree::refit().
+    double cellWidth;   //!< Width of the octree cell the node was built from.
+    double size;        //!< Size used by the Barnes-Hut opening test. #cellWidth, grown by LinearOctree::refit() when the node's bodies spread beyond it.
+
+    double totalMass = 0;                                   //!< Total mass in the region bounded by the node.
+    Eigen::Vector3d centerOfMass = Eigen::Vector3d::Zero(); //!< Center of mass of the objects within this node.
+    Eigen::Matrix3d quadrupole = Eigen::Matrix3d::Zero();   //!< Traceless quadrupole moment about #centerOfMass. Only valid if LinearOctree::expansionOrder >= 2.
+
+    int childOffset = 0;    //!< Index of the first child relative to the index of this node. 0 if external.
+    int nChildren = 0;      //!< Number of non-empty children.
+
+    int bodyBegin;      //!< Index of the first body of this node in LinearOctree::order.
+    int nBodies;        //!< Number of bodies within this node. They occupy order[bodyBegin, bodyBegin + nBodies).
+};
+
+
+/**
+ * Pointer-free octree built from particles sorted by Morton key.
+ * The tree is rebuilt from scratch by build(), or kept and refit to moved bodies by refit().
+ * Key generation, sorting and the construction of subtrees below the top levels run on a ThreadPool.
+ */
+class LinearOctree {
+    private:
+        std::vector<std::pair<uint64_t, int>> sortBuffer;   //!< Scratch space for merging sorted runs.
+        std::vector<std::vector<LinearOctreeNode>> subtrees; //!< Scratch space for subtrees built in parallel.
+        std::vector<int> subtreeRoots;                      //!< Index of the root of each subtree built in parallel. Empty if the tree was built serially.
+        std::vector<int> subtreeBegins;                     //!< Index of the first descendant of each subtree root. Descendants of subtree i are nodes [subtreeBegins[i], subtreeBegins[i + 1]).
+        int nTopNodes = 0;                                  //!< Number of nodes built serially. They come first in #nodes.
+
+        /*! Sorts #keys in parallel: each thread sorts a run, then runs are merged pairwise. */
+        void sortKeys(ThreadPool& pool);
+
+        /**
+         * @brief Builds the subtree below out[nodeIdx], appending its descendants to out.
+         *        Nodes reaching stopLevel are not split; their indices are added to frontier instead.
+         * 
+         * @return Depth of the subtree relative to out[nodeIdx]
+         */
+        int buildSubtree(std::vector<LinearOctreeNode>& out, int nodeIdx, int level, int stopLevel,
+                         std::vector<int>* frontier,
+                         const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                         const Eigen::Ref<const Eigen::RowVectorXd>& m);
+    public:
+        std::vector<LinearOctreeNode> nodes;        //!< Nodes of the tree. nodes[0] is the root.
+        std::vector<std::pair<uint64_t, int>> keys; //!< Morton key and particle index of each body, sorted by key.
+        std::vector<int> order;                     //!< Particle indices in Morton order.
+        SourceArrays bodies;                        //!< Positions and masses of the bodies in Morton order. Body k is particle order[k].
+        int depth = 0;                              //!< Depth of the deepest node.
+
+        int leafCapacity = 1;                       //!< External nodes hold up to this many bodies.
+        int maxDepth = LINEAR_OCTREE_MAX_DEPTH;     //!< Nodes at this depth are external regardless of their number of bodies. Capped at LINEAR_OCTREE_MAX_DEPTH.
+        int expansionOrder = 0;                     //!< Highest multipole moment accumulated by build(). 0 for mass and center of mass only, 2 to add quadrupoles.
+
+        /**
+         * @brief Rebuilds the tree from particle positions and masses.
+         *
+         * @param x Position matrix
+         * @param m Mass vector
+         * @param pool Threads used to build the tree
+         */
+        void build(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                   ThreadPool& pool);
+
+        /**
+         * @brief Recomputes node moments and bounds bottom-up from new particle positions and masses,
+         *        keeping the topology and body order of the last build().
+         *        Each node's bounds become the bounding box of its bodies and its #LinearOctreeNode::size grows to cover them.
+         *
+         * @param x Position matrix. Must have as many particles as the last build().
+         * @param m Mass vector
+         * @param pool Threads used to refit the tree
+         * @return double Largest ratio of #LinearOctreeNode::size to #LinearOctreeNode::cellWidth, 1 if no node outgrew its cell.
+         */
+        double refit(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                     const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                     ThreadPool& pool);
+
+        /**
+         * @brief Returns true if the last build() or refit() was from exactly these particle positions and masses,
+         *        so the tree can be walked again as it is.
+         *
+         * @param x Position matrix
+         * @param m Mass vector
+         */
+        bool holds(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                   const Eigen::Ref<const Eigen::RowVectorXd>& m) const;
+};
+
+#endif
\ No newline at end of file
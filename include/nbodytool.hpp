@@ -1,6 +1,11 @@
 #include "units.hpp"
+#include "thread_pool.hpp"
 #include "rigidbody.hpp"
 #include "octree.hpp"
+#include "linear_octree.hpp"
+#include "force_kernel.hpp"
+#include "force_law.hpp"
 #include "dynamics_engine.hpp"
 #include "integrator.hpp"
+#include "timestep.hpp"
 #include "simulator.hpp"
\ No newline at end of file
@@ -1,9 +1,20 @@
 #ifndef NBT_OCTREE_HPP
 #define NBT_OCTREE_HPP
 
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
 #include <Eigen>
 #include "rigidbody.hpp"
 
+#define OCTREE_MAX_LEAF_CAPACITY 32 //!< Largest number of body indices an external OctreeNode can hold.
+
+class OctreeArena;
+
+//!< Returns the traceless quadrupole moment m*(3*d*d^T - |d|^2*I) of a point mass m at offset d from the expansion center.
+Eigen::Matrix3d pointQuadrupole(double m, const Eigen::Vector3d& d);
+
 /**
  * @brief Node struct for Octree.
  */
@@ -19,18 +30,106 @@ struct OctreeNode {
 
     double totalMass;               //!< Total mass in the region bounded by the node.
     Eigen::Vector3d centerOfMass;   //!< Center of mass of the objects within this node.
+    Eigen::Matrix3d quadrupole;     //!< Traceless quadrupole moment about #centerOfMass. Only valid after computeQuadrupole() or computeMoments().
 
-    //!< Constructs an OctreeNode object from x, y, z bounds
-    OctreeNode(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax);
+    OctreeArena* arena; //!< Arena children are allocated from. nullptr if children are allocated with new.
+    int depth;          //!< Depth of this node below the root it was created from.
 
-    //!< Destroys OctreeNode object by destroying children
+    int nBodies;                            //!< Number of bodies added by index to this external node. Exceeds OCTREE_MAX_LEAF_CAPACITY if the bucket overflowed at the maximum depth.
+    int bodies[OCTREE_MAX_LEAF_CAPACITY];   //!< Indices of the first OCTREE_MAX_LEAF_CAPACITY bodies in this external node.
+    OctreeNode* overflow;                   //!< Bucket holding the indices past #bodies of a node that overflowed at the maximum depth, itself chained the same way. nullptr if the bucket did not overflow.
+
+    //!< Constructs an OctreeNode object from x, y, z bounds. Children are allocated from arena if it is not nullptr.
+    OctreeNode(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax, OctreeArena* arena = nullptr);
+
+    //!< Destroys OctreeNode object by destroying children. Children owned by an arena are left to the arena.
     ~OctreeNode();
 
     //!< Recursively adds an object into the subtree that has this node as root.
-    void addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos);
+    //!< Returns the depth, relative to this node, of the deepest node touched by the insertion.
+    int addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos);
+
+    //!< Recursively adds object idx into the subtree that has this node as root.
+    //!< External nodes keep up to leafCapacity body indices before splitting and never split below maxDepth.
+    //!< Returns the depth, relative to this node, of the deepest node touched by the insertion.
+    int addObject(int idx,
+                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                  const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                  int leafCapacity,
+                  int maxDepth);
+
+    //!< Adds a point mass to #totalMass and #centerOfMass. The node must not be empty.
+    void addMass(double m, const Eigen::Ref<const Eigen::Vector3d>& pos);
+
+    //!< Sets #quadrupole from the quadrupoles of the non-empty children, shifted to #centerOfMass.
+    //!< The children's quadrupoles must already be computed.
+    void combineChildQuadrupoles();
+
+    //!< Recursively computes #quadrupole for this node and every node below it, children first.
+    //!< Buckets are read from x and m, so the tree must have been built with the indexed addObject().
+    void computeQuadrupole(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                           const Eigen::Ref<const Eigen::RowVectorXd>& m);
+
+    //!< Sets #totalMass and #centerOfMass from the non-empty children, summed in (z y x) order, and #quadrupole as well if withQuadrupole is set.
+    //!< The children's moments must already be computed.
+    void combineChildMoments(bool withQuadrupole);
+
+    //!< Recursively recomputes the moments of every internal node below this one from its children, children first,
+    //!< and the quadrupoles of the buckets if withQuadrupole is set. Internal moments then do not depend on the order
+    //!< bodies were inserted in, so subtrees built on different threads combine into the same tree.
+    void computeMoments(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                        bool withQuadrupole);
+
+    //!< Constructs the 8 children of this node, splitting its bounds at their midpoints.
+    void createChildren();
 
-    //<! Deletes all children below this node.
+    //!< Calls f(idx) for the index of each body in the bucket of this external node, following #overflow.
+    template <typename Function>
+    void forEachBody(Function f) const {
+        for (const OctreeNode* bucket = this; bucket != nullptr; bucket = bucket->overflow) {
+            int nStored = std::min(bucket->nBodies, OCTREE_MAX_LEAF_CAPACITY);
+            for (int k = 0; k < nStored; ++k) {
+                f(bucket->bodies[k]);
+            }
+        }
+    }
+
+    //<! Deletes all children below this node. Children owned by an arena are only detached.
     void prune();
 };
 
+
+/**
+ * @brief Block allocator for OctreeNode.
+ *        Nodes are carved out of large blocks that are kept between uses,
+ *        so rebuilding a tree every step does no general-purpose heap allocation
+ *        once the arena has grown to the size of the tree.
+ */
+class OctreeArena {
+    private:
+        static const size_t blockSize = 4096;   //!< Number of nodes per block.
+
+        std::vector<OctreeNode*> blocks;        //!< Storage blocks, each with room for #blockSize nodes.
+        size_t blockIdx = 0;                    //!< Block the next node is taken from.
+        size_t blockUsed = 0;                   //!< Number of nodes taken from the current block.
+    public:
+        OctreeArena() = default;
+
+        //!< Frees every block. Nodes taken from the arena must not be used afterwards.
+        ~OctreeArena();
+
+        OctreeArena(const OctreeArena&) = delete;
+        OctreeArena& operator=(const OctreeArena&) = delete;
+
+        //!< Constructs a node from x, y, z bounds in arena memory. Its children are also allocated from this arena.
+        OctreeNode* allocate(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax);
+
+        //!< Releases every node at once in O(1). Blocks are kept for reuse.
+        void reset();
+
+        //!< Returns the number of nodes currently allocated.
+        size_t size() const;
+};
+
 #endif
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 #include <Eigen>
 #include "integrator.hpp"
+#include "timestep.hpp"
 #include "dynamics_engine.hpp"
 #include "rigidbody.hpp"
 #include "octree.hpp"
@@ -29,8 +30,21 @@ class Simulator {
         Eigen::Matrix<double, 3, Eigen::Dynamic> pos;   //!< 3D position of each object packed into a 3 x N matrix.
         Eigen::Matrix<double, 3, Eigen::Dynamic> v;     //!< 3D velocity of each object packed into a 3 x N matrix.
         Eigen::Matrix<double, 3, Eigen::Dynamic> a;     //!< 3D acceleration of each object packed into a 3 x N matrix.
+        Eigen::Matrix<double, 3, Eigen::Dynamic> posNext; //!< Positions at the end of a pipelined step, swapped with #pos once the force pass is done.
     
         uint64_t iteration = 0;                 //!< Current iteration of the simulation.
+        uint64_t forceEvaluations = 0;          //!< Number of particle accelerations computed by block timesteps so far.
+
+        // Block timesteps
+        TimestepCriterion* timestepCriterion = nullptr;     //!< Per-particle timestep criterion. Block timesteps are used if it is not nullptr.
+        int maxTimestepBin = 0;                             //!< Particles in bin k take steps of timeStep/2^k, for k up to maxTimestepBin.
+        Eigen::Matrix<int, 1, Eigen::Dynamic> timestepBin;  //!< Timestep bin of each object packed into a 1 x N vector.
+        bool blockAccelerationsValid = false;               //!< True if #a holds the accelerations at the current positions, as at the end of a block step.
+        std::vector<int> activeIdx;                         //!< Indices of the objects whose step ends at the current substep.
+
+        // Pipelined steps
+        bool pipelined = false;                 //!< Kick and drift each object as soon as the engine finishes its acceleration.
+        bool velocitiesLag = false;             //!< True if #v is half a step behind #pos, as between pipelined steps.
         
         RigidbodyIdx nextIdx = 0;               //!< Index of next available column in the structure of arrays. Also serves as a counter of active objects.
         Rigidbody    nextID = 0;                //!< Next available ID to be assigned to a newly created Rigidbody.
@@ -38,11 +52,26 @@ class Simulator {
         std::vector<RigidbodyIdx> id2idx;       //!< Maps ID to associated index
         std::queue<Rigidbody> availableUsedIDs; //!< Stores IDs of destroyed objects for reallocation
        
-        /*! Returns slice of array structure component with only active objects. */
-        Eigen::Ref<Eigen::MatrixXd> active(Eigen::Ref<Eigen::MatrixXd> mat);
+        /*! Returns slice of a 3 x N array structure component with only active objects. Keeps the row count fixed for the integrator and engine. */
+        Eigen::Ref<Eigen::Matrix3Xd> active(Eigen::Matrix3Xd& mat);
+
+        /*! Returns slice of a 1 x N array structure component with only active objects. */
+        Eigen::Ref<Eigen::RowVectorXd> active(Eigen::RowVectorXd& mat);
 
         /*! Computes force between each object using #forceComputer. #a is updated. */
         void updateAccelerations();
+
+        /*! Advances every object by #timeStep in substeps, kicking each object with its own power of two timestep. */
+        void blockStep();
+
+        /*! Returns the timestep bin object idx moves to when its step ends at substep tick. */
+        int nextTimestepBin(RigidbodyIdx idx, int64_t tick);
+
+        /*! Advances every object by #timeStep with a leapfrog whose kick and drift run inside the engine's force pass. */
+        void pipelinedStep();
+
+        /*! Applies the closing half kick deferred by pipelined steps, if any, with accelerations at the current positions. Clears #velocitiesLag. */
+        void synchronizeVelocities();
     public:
         const Rigidbody maxObjects;         //!< Maximum number of objects in the simulation. Sets the dimensions of the sstructure of arrays.
 
@@ -109,6 +138,34 @@ class Simulator {
         /*! Returns Eigen::Matrix ref of object radii */
         Eigen::Ref<const Eigen::RowVectorXd> activeR();
 
+        /*! Switches to block timesteps. #timeStep becomes the largest timestep, and each object steps with
+            timeStep/2^k for the smallest k up to maxBin that satisfies criterion. Forces are only computed for
+            objects whose step ends at a substep. The integrator is not used, steps are kick-drift-kick leapfrog.
+            Takes ownership of criterion. nullptr switches back to one global timestep. */
+        void setBlockTimesteps(TimestepCriterion* criterion, int maxBin);
+
+        /*! Returns Eigen::Matrix ref of object timestep bins */
+        Eigen::Ref<const Eigen::RowVectorXi> activeTimestepBins();
+
+        /*! Returns number of particle accelerations computed by block timesteps so far. */
+        uint64_t nForceEvaluations();
+
+        /*! Makes the force pass of each step also compute the potential, and optionally the tidal tensor, of every object. */
+        void setOutputs(bool potentials, bool tidalTensors = false);
+
+        /*! Returns Eigen::Matrix ref of object potentials from the last step. Requires setOutputs() with potentials enabled. */
+        Eigen::Ref<const Eigen::RowVectorXd> activePotentials();
+
+        /*! Returns Eigen::Matrix ref of object tidal tensors from the last step, one column-major 3x3 matrix per column. Requires setOutputs() with tidalTensors enabled. */
+        Eigen::Ref<const Eigen::Matrix<double, 9, Eigen::Dynamic>> activeTidalTensors();
+
+        /*! Switches to pipelined steps. Each object is kicked and drifted by the engine thread that computed its
+            acceleration, as soon as it is final, instead of in a separate pass over every object. Steps are leapfrog
+            with the closing half kick merged into the next step, so velocities lag half a step behind positions and
+            accelerations are those at the start of the last step. The integrator is not used. Block timesteps take precedence.
+            Switching back, or taking a block step, computes accelerations at the current positions and applies the deferred closing half kick. */
+        void setPipelinedStep(bool enabled);
+
         /*! Steps simulation */
         void step();
 };
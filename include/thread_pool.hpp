@@ -0,0 +1,68 @@
+#ifndef NBT_THREAD_POOL_HPP
+#define NBT_THREAD_POOL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstdint>
+
+/**
+ * A persistent pool of worker threads.
+ * Workers are created once and sleep between jobs, so parallel
+ * phases that run every simulation step do not pay for thread
+ * creation and teardown.
+ */
+class ThreadPool {
+    private:
+        std::vector<std::thread> workers;                //!< Worker threads. The calling thread acts as thread 0, so there are nThreads - 1 workers.
+        const std::function<void(unsigned)>* task;      //!< Task of the current job. Only valid while a job is running.
+
+        std::mutex mtx;                         //!< Guards #task, #generation, #pending and #stopping.
+        std::condition_variable jobReady;       //!< Signalled when a new job is posted or the pool is stopping.
+        std::condition_variable jobDone;        //!< Signalled when the last worker finishes a job.
+        uint64_t generation = 0;                //!< Incremented every time a job is posted.
+        unsigned pending = 0;                   //!< Number of workers that have not finished the current job.
+        bool stopping = false;                  //!< True when the pool is being destroyed.
+
+        /*! Main loop of each worker thread. */
+        void workerLoop(unsigned threadIdx);
+    public:
+        const unsigned nThreads;    //!< Number of threads that execute a job, including the calling thread.
+
+        /**
+         * @brief Construct a ThreadPool object.
+         *
+         * @param nThreads Number of threads used for each job. 0 uses std::thread::hardware_concurrency().
+         */
+        ThreadPool(unsigned nThreads = 0);
+
+        /**
+         * @brief Destroy the ThreadPool object. Joins every worker.
+         */
+        ~ThreadPool();
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        /**
+         * @brief Runs task(threadIdx) once on every thread of the pool and blocks until all calls return.
+         *        threadIdx ranges from 0 to nThreads - 1. The calling thread runs threadIdx 0.
+         *
+         * @param task Function called on each thread
+         */
+        void run(const std::function<void(unsigned)>& task);
+
+        /**
+         * @brief Calls body(unitIdx, threadIdx) for every unitIdx in [0, nUnits) and blocks until all calls return.
+         *        Units are handed out one at a time through an atomic counter, so threads that finish
+         *        cheap units early keep taking work instead of sitting idle.
+         *
+         * @param nUnits Number of work units
+         * @param body Function called for each work unit
+         */
+        void parallelFor(int nUnits, const std::function<void(int, unsigned)>& body);
+};
+
+#endif
\ No newline at end of file
@@ -0,0 +1,62 @@
+#ifndef NBT_TIMESTEP_HPP
+#define NBT_TIMESTEP_HPP
+
+#include <Eigen>
+
+/**
+ * Abstract function object for per-particle timestep criteria.
+ * Used by the Simulator's block timesteps to pick the timestep bin of each particle.
+ */
+class TimestepCriterion {
+    public:
+        virtual ~TimestepCriterion() = default;
+
+        /**
+         * @brief Returns the largest timestep particle i may take.
+         *
+         * @param x_i Position of i
+         * @param v_i Velocity of i
+         * @param a_i Acceleration of i
+         * @param m_i Mass of i
+         * @return double
+         */
+        virtual double timestep(const Eigen::Vector3d& x_i,
+                                const Eigen::Vector3d& v_i,
+                                const Eigen::Vector3d& a_i,
+                                double m_i) = 0;
+};
+
+
+/**
+ * Limits the timestep to sqrt(2*eta*softening/|a|), so a particle moves a small
+ * fraction of the softening length under its own acceleration in one step.
+ */
+class AccelerationCriterion: public TimestepCriterion {
+    public:
+        const double eta;       //!< Accuracy parameter. Smaller values give shorter timesteps.
+        const double softening; //!< Length scale the displacement is measured against, usually the force softening.
+
+        /**
+         * @brief Construct a AccelerationCriterion object.
+         *
+         * @param eta Accuracy parameter
+         * @param softening Length scale
+         */
+        AccelerationCriterion(double eta, double softening);
+
+        /**
+         * @brief Returns sqrt(2*eta*softening/|a_i|), or infinity for an unaccelerated particle.
+         *
+         * @param x_i Position of i
+         * @param v_i Velocity of i
+         * @param a_i Acceleration of i
+         * @param m_i Mass of i
+         * @return double
+         */
+        double timestep(const Eigen::Vector3d& x_i,
+                        const Eigen::Vector3d& v_i,
+                        const Eigen::Vector3d& a_i,
+                        double m_i) override;
+};
+
+#endif
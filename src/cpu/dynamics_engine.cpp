@@ -3,23 +3,141 @@
 #include <Eigen>
 #include <cstdint>
 #include <cmath>
-#include <queue>
+#include <algorithm>
 #include <vector>
-#include <thread>
 
 
 /* class DynamicsEngine */
+
+DynamicsEngine::DynamicsEngine(unsigned nThreads)
+: threadPool(nThreads) {}
+
 double DynamicsEngine::totalPotentialEnergy(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                             const Eigen::Ref<const Eigen::RowVectorXd>& m) {
-    // Iterate through each pair of distinct objects and adds their potential energy to a sum.
-    double sumPotentialEnergies = 0;
-    for (int i = 0; i < x.cols(); ++i) {
-        for (int j = 0; j < x.cols(); ++j) {
-            if (i == j) continue;
-            sumPotentialEnergies += this->pairPotentialEnergy(x.col(i), x.col(j), m(i), m(j));
+    Eigen::RowVectorXd u(x.cols());
+    this->updatePotentialEnergies(u, x, m);
+    return u.sum();
+}
+
+
+void DynamicsEngine::updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                             const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                             const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Iterate through each pair of distinct objects, in blocks of particles i handed out to threads
+    const int blockSize = 64;
+    int n = x.cols();
+    this->threadPool.parallelFor((n + blockSize - 1)/blockSize, [&](int blockIdx, unsigned threadIdx) {
+        for (int i = blockIdx*blockSize; i < std::min(n, (blockIdx + 1)*blockSize); ++i) {
+            double sumPotentialEnergies = 0;
+            for (int j = 0; j < n; ++j) {
+                if (i == j) continue;
+                sumPotentialEnergies += this->pairPotentialEnergy(x.col(i), x.col(j), m(i), m(j));
+            }
+            u(i) = sumPotentialEnergies;
+        }
+    });
+}
+
+
+void DynamicsEngine::updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                  const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                  const AccelerationsReady& ready) {
+    this->updateAccelerations(a, x, m);
+    if (!ready) return;
+    const int blockSize = 64;
+    int n = x.cols();
+    this->threadPool.parallelFor((n + blockSize - 1)/blockSize, [&](int blockIdx, unsigned threadIdx) {
+        ready(nullptr, blockIdx*blockSize, std::min(n, (blockIdx + 1)*blockSize));
+    });
+}
+
+
+void DynamicsEngine::updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                               const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                               const std::vector<int>& active) {
+    // Active particles are handed out to threads in blocks, each summed over every particle
+    const int blockSize = 64;
+    int n = x.cols();
+    int nActive = active.size();
+    this->resizeOutputs(n);
+    this->threadPool.parallelFor((nActive + blockSize - 1)/blockSize, [&](int blockIdx, unsigned threadIdx) {
+        for (int k = blockIdx*blockSize; k < std::min(nActive, (blockIdx + 1)*blockSize); ++k) {
+            int i = active[k];
+            a.col(i).setZero();
+            for (int j = 0; j < n; ++j) {
+                if (i == j) continue;
+                this->pairAcceleration(a.col(i), x.col(i), x.col(j), m(i), m(j)); // Force computation
+            }
+            if (this->computePotentials || this->computeTidalTensors) this->directOutputs(x, m, i, i + 1);
         }
+    });
+}
+
+
+void DynamicsEngine::updateAccelerationsAndJerks(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                 Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                                 const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Iterate through each pair of distinct objects, in blocks of particles i handed out to threads
+    const int blockSize = 64;
+    int n = x.cols();
+    this->resizeOutputs(n);
+    this->threadPool.parallelFor((n + blockSize - 1)/blockSize, [&](int blockIdx, unsigned threadIdx) {
+        int iEnd = std::min(n, (blockIdx + 1)*blockSize);
+        for (int i = blockIdx*blockSize; i < iEnd; ++i) {
+            a.col(i).setZero();
+            jerk.col(i).setZero();
+            for (int j = 0; j < n; ++j) {
+                if (i == j) continue;
+                this->pairAccelerationJerk(a.col(i), jerk.col(i), x.col(i), x.col(j), v.col(i), v.col(j), m(i), m(j)); // Force computation
+            }
+        }
+        if (this->computePotentials || this->computeTidalTensors) this->directOutputs(x, m, blockIdx*blockSize, iEnd);
+    });
+}
+
+
+void DynamicsEngine::pairAccelerationJerk(Eigen::Ref<Eigen::Vector3d> a_i,
+                                          Eigen::Ref<Eigen::Vector3d> j_i,
+                                          const Eigen::Vector3d& x_i,
+                                          const Eigen::Vector3d& x_j,
+                                          const Eigen::Vector3d& v_i,
+                                          const Eigen::Vector3d& v_j,
+                                          double m_i,
+                                          double m_j) {
+    // Jerk is the change of the acceleration along the relative motion
+    this->pairAcceleration(a_i, x_i, x_j, m_i, m_j);
+    Eigen::Matrix3d T = Eigen::Matrix3d::Zero();
+    this->pairTidalTensor(T, x_i, x_j, m_i, m_j);
+    j_i -= T*(v_i - v_j);
+}
+
+
+void DynamicsEngine::batchAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                                       const Eigen::Vector3d& x_i,
+                                       double m_i,
+                                       const SourceBlock& sources) {
+    for (int j = 0; j < sources.n; ++j) {
+        Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+        if (x_j == x_i) continue;
+        this->pairAcceleration(a_i, x_i, x_j, m_i, sources.m[j]); // Force computation
     }
-    return sumPotentialEnergies;
+}
+
+
+void DynamicsEngine::batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                              double* phi_i,
+                                              Eigen::Matrix3d* T_i,
+                                              const Eigen::Vector3d& x_i,
+                                              double m_i,
+                                              const SourceBlock& sources) {
+    this->batchAcceleration(a_i, x_i, m_i, sources); // Force computation
+    // Pair energies are halved, so the potential of a unit mass is twice their sum
+    if (phi_i) *phi_i += 2*this->batchPotentialEnergy(x_i, 1.0, sources);
+    if (T_i) this->batchTidalTensor(*T_i, x_i, m_i, sources);
 }
 
 
@@ -33,71 +151,735 @@ double DynamicsEngine::pairPotentialEnergy(const Eigen::Vector3d& x_i,
 }
 
 
+double DynamicsEngine::batchPotentialEnergy(const Eigen::Vector3d& x_i,
+                                            double m_i,
+                                            const SourceBlock& sources) {
+    double u = 0;
+    for (int j = 0; j < sources.n; ++j) {
+        Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+        if (x_j == x_i) continue;
+        u += this->pairPotentialEnergy(x_i, x_j, m_i, sources.m[j]);
+    }
+    return u;
+}
+
+
+void DynamicsEngine::pairTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                     const Eigen::Vector3d& x_i,
+                                     const Eigen::Vector3d& x_j,
+                                     double m_i,
+                                     double m_j) {
+    // Central differences of the acceleration, which is minus the gradient of the potential
+    double h = 1e-5*(x_i - x_j).norm();
+    if (h == 0) return;
+    for (int dim = 0; dim < 3; ++dim) {
+        Eigen::Vector3d xPlus = x_i, xMinus = x_i;
+        xPlus(dim) += h;
+        xMinus(dim) -= h;
+        Eigen::Vector3d aPlus = Eigen::Vector3d::Zero(), aMinus = Eigen::Vector3d::Zero();
+        this->pairAcceleration(aPlus, xPlus, x_j, m_i, m_j);
+        this->pairAcceleration(aMinus, xMinus, x_j, m_i, m_j);
+        T_i.col(dim) -= (aPlus - aMinus)/(2*h);
+    }
+}
+
+
+void DynamicsEngine::batchTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                      const Eigen::Vector3d& x_i,
+                                      double m_i,
+                                      const SourceBlock& sources) {
+    for (int j = 0; j < sources.n; ++j) {
+        Eigen::Vector3d x_j(sources.x[j], sources.y[j], sources.z[j]);
+        if (x_j == x_i) continue;
+        this->pairTidalTensor(T_i, x_i, x_j, m_i, sources.m[j]);
+    }
+}
+
+
+void DynamicsEngine::resizeOutputs(int n) {
+    if (this->computePotentials) this->potentials.resize(n);
+    if (this->computeTidalTensors) this->tidalTensors.resize(9, n);
+}
+
+
+void DynamicsEngine::clearOutputs(int begin, int end) {
+    if (this->computePotentials) this->potentials.segment(begin, end - begin).setZero();
+    if (this->computeTidalTensors) this->tidalTensors.middleCols(begin, end - begin).setZero();
+}
+
+
+void DynamicsEngine::directOutputs(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                   int iBegin, int iEnd) {
+    int n = x.cols();
+    for (int i = iBegin; i < iEnd; ++i) {
+        double phi = 0;
+        Eigen::Matrix3d T_i = Eigen::Matrix3d::Zero();
+        for (int j = 0; j < n; ++j) {
+            if (i == j) continue;
+            // Pair energies are halved, so the potential of a unit mass is twice their sum
+            if (this->computePotentials) phi += 2*this->pairPotentialEnergy(x.col(i), x.col(j), 1.0, m(j));
+            if (this->computeTidalTensors) this->pairTidalTensor(T_i, x.col(i), x.col(j), m(i), m(j));
+        }
+        if (this->computePotentials) this->potentials(i) = phi;
+        if (this->computeTidalTensors) this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+    }
+}
+
+
 /* class Abstract_Direct */
 
+Abstract_Direct::Abstract_Direct(unsigned nThreads)
+: DynamicsEngine(nThreads) {}
+
+
+void Abstract_Direct::tileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                       int iBegin, int iEnd, int jBegin, int jEnd) {
+    SourceBlock tile = this->sources.block(jBegin, jEnd);
+    for (int i = iBegin; i < iEnd; ++i) {
+        this->batchAcceleration(a.col(i), x.col(i), m(i), tile); // Force computation
+    }
+}
+
+
+void Abstract_Direct::tileAccelerationOutputs(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                              const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                              const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                              int iBegin, int iEnd, int jBegin, int jEnd) {
+    SourceBlock tile = this->sources.block(jBegin, jEnd);
+    for (int i = iBegin; i < iEnd; ++i) {
+        double* phi_i = this->computePotentials ? &this->potentials(i) : nullptr;
+        Eigen::Matrix3d T_i;
+        if (this->computeTidalTensors) T_i = Eigen::Map<const Eigen::Matrix3d>(this->tidalTensors.col(i).data());
+        this->batchAccelerationOutputs(a.col(i), phi_i, this->computeTidalTensors ? &T_i : nullptr, x.col(i), m(i), tile); // Force computation
+        if (this->computeTidalTensors) this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+    }
+}
+
+
+void Abstract_Direct::symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                int iBegin, int iEnd, int jBegin, int jEnd) {
+    for (int i = iBegin; i < iEnd; ++i) {
+        // Pairs within one tile are only visited with j > i
+        for (int j = std::max(jBegin, i + 1); j < jEnd; ++j) {
+            Eigen::Vector3d a_ij = Eigen::Vector3d::Zero();
+            this->pairAcceleration(a_ij, x.col(i), x.col(j), m(i), m(j)); // Force computation
+            a.col(i) += a_ij;
+            if (m(j) != 0) {
+                a.col(j) -= a_ij*m(i)/m(j);
+            } else {
+                // A massless body feels the pair force but cannot take the reaction, so evaluate its side on its own
+                this->pairAcceleration(a.col(j), x.col(j), x.col(i), m(j), m(i)); // Force computation
+            }
+        }
+    }
+}
+
+
+void Abstract_Direct::tileAccelerationJerk(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                           Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                           const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                           const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                           const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                           int iBegin, int iEnd, int jBegin, int jEnd) {
+    for (int i = iBegin; i < iEnd; ++i) {
+        for (int j = jBegin; j < jEnd; ++j) {
+            if (i == j) continue;
+            this->pairAccelerationJerk(a.col(i), jerk.col(i), x.col(i), x.col(j), v.col(i), v.col(j), m(i), m(j)); // Force computation
+        }
+    }
+}
+
+
 void Abstract_Direct::updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                           const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                           const Eigen::Ref<const Eigen::RowVectorXd>& m) {
-    // Iterate through each pair of objects and compute gravitational force
-    uint64_t n = x.cols();
-    for (uint64_t i = 0; i < n; ++i) {
-        a.col(i).setZero(); // Clear net acceleration
+    this->updateAccelerationsPipelined(a, x, m, AccelerationsReady());
+}
 
-        for (uint64_t j = 0; j < n; ++j) {
-            if (i == j) continue;
-            this->pairAcceleration(a.col(i), x.col(i), x.col(j), m(i), m(j)); // Force computation
+
+void Abstract_Direct::updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                   const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                   const AccelerationsReady& ready) {
+    int n = x.cols();
+    int tileSize = std::max(1, this->tileSize);
+    int nTiles = (n + tileSize - 1)/tileSize;
+    auto tileBegin = [&](int tileIdx) { return std::min(n, tileIdx*tileSize); };
+    bool withOutputs = this->computePotentials || this->computeTidalTensors;
+    this->resizeOutputs(n);
+
+    // Outputs are computed in the same sweep as the accelerations, which the symmetric mode has no room for
+    if (!this->useSymmetry || withOutputs) {
+        // Gather sources into structure-of-arrays layout for the batch kernel
+        this->sources.resize(n);
+        this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+            for (int j = tileBegin(tileIdx); j < tileBegin(tileIdx + 1); ++j) {
+                this->sources.set(j, j, x, m);
+            }
+        });
+
+        // Each work unit owns the accelerations of one i tile and sweeps every j tile over it
+        this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+            int iBegin = tileBegin(tileIdx), iEnd = tileBegin(tileIdx + 1);
+            a.middleCols(iBegin, iEnd - iBegin).setZero();
+            if (withOutputs) this->clearOutputs(iBegin, iEnd);
+            for (int jTile = 0; jTile < nTiles; ++jTile) {
+                if (withOutputs) {
+                    this->tileAccelerationOutputs(a, x, m, iBegin, iEnd, tileBegin(jTile), tileBegin(jTile + 1));
+                } else {
+                    this->tileAcceleration(a, x, m, iBegin, iEnd, tileBegin(jTile), tileBegin(jTile + 1));
+                }
+            }
+            if (ready) ready(nullptr, iBegin, iEnd);
+        });
+        return;
+    }
+
+    // Each tile pair is computed once. Both halves of a pair land in the accumulator
+    // of the thread that computed it, so threads never write to the same memory.
+    this->threadAccelerations.resize(this->threadPool.nThreads);
+    this->threadPool.run([&](unsigned threadIdx) {
+        this->threadAccelerations[threadIdx].setZero(3, n);
+    });
+
+    this->tilePairs.clear();
+    for (int iTile = 0; iTile < nTiles; ++iTile) {
+        for (int jTile = iTile; jTile < nTiles; ++jTile) {
+            this->tilePairs.push_back({iTile, jTile});
+        }
+    }
+    this->threadPool.parallelFor(this->tilePairs.size(), [&](int pairIdx, unsigned threadIdx) {
+        int iTile = this->tilePairs[pairIdx].first;
+        int jTile = this->tilePairs[pairIdx].second;
+        this->symmetricTileAcceleration(this->threadAccelerations[threadIdx], x, m,
+                                        tileBegin(iTile), tileBegin(iTile + 1), tileBegin(jTile), tileBegin(jTile + 1));
+    });
+
+    // Sum the accumulators tile by tile
+    this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+        int begin = tileBegin(tileIdx), end = tileBegin(tileIdx + 1);
+        a.middleCols(begin, end - begin) = this->threadAccelerations[0].middleCols(begin, end - begin);
+        for (int t = 1; t < (int)this->threadAccelerations.size(); ++t) {
+            a.middleCols(begin, end - begin) += this->threadAccelerations[t].middleCols(begin, end - begin);
         }
+        if (ready) ready(nullptr, begin, end);
+    });
+}
+
+
+void Abstract_Direct::updateAccelerationsAndJerks(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                  Eigen::Ref<Eigen::Matrix3Xd> jerk,
+                                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                  const Eigen::Ref<const Eigen::Matrix3Xd>& v,
+                                                  const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    int n = x.cols();
+    int tileSize = std::max(1, this->tileSize);
+    int nTiles = (n + tileSize - 1)/tileSize;
+    auto tileBegin = [&](int tileIdx) { return std::min(n, tileIdx*tileSize); };
+    bool withOutputs = this->computePotentials || this->computeTidalTensors;
+    this->resizeOutputs(n);
+
+    // Outputs go through the batch kernels, which read sources in structure-of-arrays layout
+    if (withOutputs) {
+        this->sources.resize(n);
+        this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+            for (int j = tileBegin(tileIdx); j < tileBegin(tileIdx + 1); ++j) {
+                this->sources.set(j, j, x, m);
+            }
+        });
     }
+
+    // Each work unit owns the accelerations and jerks of one i tile and sweeps every j tile over it.
+    // Outputs are added while the j tile is still in cache.
+    this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+        int iBegin = tileBegin(tileIdx), iEnd = tileBegin(tileIdx + 1);
+        a.middleCols(iBegin, iEnd - iBegin).setZero();
+        jerk.middleCols(iBegin, iEnd - iBegin).setZero();
+        if (withOutputs) this->clearOutputs(iBegin, iEnd);
+        for (int jTile = 0; jTile < nTiles; ++jTile) {
+            int jBegin = tileBegin(jTile), jEnd = tileBegin(jTile + 1);
+            this->tileAccelerationJerk(a, jerk, x, v, m, iBegin, iEnd, jBegin, jEnd);
+            if (!withOutputs) continue;
+            SourceBlock tile = this->sources.block(jBegin, jEnd);
+            for (int i = iBegin; i < iEnd; ++i) {
+                // Pair energies are halved, so the potential of a unit mass is twice their sum
+                if (this->computePotentials) this->potentials(i) += 2*this->batchPotentialEnergy(x.col(i), 1.0, tile);
+                if (this->computeTidalTensors) {
+                    Eigen::Matrix3d T_i = Eigen::Map<const Eigen::Matrix3d>(this->tidalTensors.col(i).data());
+                    this->batchTidalTensor(T_i, x.col(i), m(i), tile);
+                    this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+                }
+            }
+        }
+    });
+}
+
+
+void Abstract_Direct::updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                const std::vector<int>& active) {
+    int n = x.cols();
+    int nActive = active.size();
+    int tileSize = std::max(1, this->tileSize);
+    int nTiles = (n + tileSize - 1)/tileSize;
+    auto tileBegin = [&](int tileIdx) { return std::min(n, tileIdx*tileSize); };
+    bool withOutputs = this->computePotentials || this->computeTidalTensors;
+    this->resizeOutputs(n);
+
+    // Every particle is a source, so the whole structure of arrays is refreshed
+    this->sources.resize(n);
+    this->threadPool.parallelFor(nTiles, [&](int tileIdx, unsigned threadIdx) {
+        for (int j = tileBegin(tileIdx); j < tileBegin(tileIdx + 1); ++j) {
+            this->sources.set(j, j, x, m);
+        }
+    });
+
+    // Active particles are scattered, so each work unit sweeps a run of them over every tile
+    int activeTileSize = std::max(1, std::min(tileSize, nActive/(int)this->threadPool.nThreads));
+    int nActiveTiles = (nActive + activeTileSize - 1)/activeTileSize;
+    this->threadPool.parallelFor(nActiveTiles, [&](int activeTileIdx, unsigned threadIdx) {
+        int kEnd = std::min(nActive, (activeTileIdx + 1)*activeTileSize);
+        for (int k = activeTileIdx*activeTileSize; k < kEnd; ++k) {
+            a.col(active[k]).setZero();
+            if (withOutputs) this->clearOutputs(active[k], active[k] + 1);
+        }
+        for (int jTile = 0; jTile < nTiles; ++jTile) {
+            int jBegin = tileBegin(jTile), jEnd = tileBegin(jTile + 1);
+            SourceBlock tile = this->sources.block(jBegin, jEnd);
+            for (int k = activeTileIdx*activeTileSize; k < kEnd; ++k) {
+                int i = active[k];
+                if (withOutputs) {
+                    this->tileAccelerationOutputs(a, x, m, i, i + 1, jBegin, jEnd);
+                } else {
+                    this->batchAcceleration(a.col(i), x.col(i), m(i), tile); // Force computation
+                }
+            }
+        }
+    });
 }
 
 
 /* class Abstract_BarnesHut */
 
-Abstract_BarnesHut::Abstract_BarnesHut(double theta)
-: root(nullptr)
+Abstract_BarnesHut::Abstract_BarnesHut(double theta, unsigned nThreads)
+: DynamicsEngine(nThreads)
+, root(nullptr)
 , theta(theta) {}
 
 
 Abstract_BarnesHut::~Abstract_BarnesHut() {
-    // this->root guaranteed pointing to OctreeNode or nullptr
-    delete this->root;
+    // Tree nodes are freed with this->arena
 }
 
 
 void Abstract_BarnesHut::threadUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                                    const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                                    const Eigen::Ref<const Eigen::RowVectorXd>& m,
-                                                   int startIdx, int endIdx) {
-    for (int i = startIdx; i < endIdx; ++i) {
-        // Set acceleration to zero
-        a.col(i).setZero();
-
-        // Iterate through tree using breadth-first traversal
-        std::queue<OctreeNode*> bfsQ;
-        bfsQ.push(this->root);
-        while (bfsQ.size() > 0) {
-            // Get current node
-            OctreeNode* currNode = bfsQ.front();
-            bfsQ.pop();
-
-            // Compute s/d
-            double s = currNode->xMax - currNode->xMin;
-            double d = (x.col(i) - currNode->centerOfMass).norm();
-            if (s/d < theta || currNode->isExternal) {
-                // Current node is sufficiently far away from the current object
-                this->pairAcceleration(a.col(i), x.col(i), currNode->centerOfMass, m(i), currNode->totalMass); // Force computation
+                                                   int startIdx, int endIdx, const int* indices, unsigned threadIdx) {
+    this->walkBodies<Abstract_BarnesHut>(a, x, m, startIdx, endIdx, indices, threadIdx);
+}
+
+
+void Abstract_BarnesHut::threadUpdatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                       const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                       int startIdx, int endIdx, unsigned threadIdx) {
+    this->walkPotentials<Abstract_BarnesHut>(u, x, m, startIdx, endIdx, threadIdx);
+}
+
+
+void Abstract_BarnesHut::buildOctree(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                     const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    ThreadPool& pool = this->threadPool;
+    int n = x.cols();
+    int nChunks = pool.nThreads;
+    auto chunkBegin = [&](int chunkIdx) { return (int)((int64_t)n*chunkIdx/nChunks); };
+
+    // Get octree root bounds and construct octree root
+    Eigen::Matrix3Xd chunkMin(3, nChunks), chunkMax(3, nChunks);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        int begin = chunkBegin(chunkIdx);
+        int end = chunkBegin(chunkIdx + 1);
+        if (begin == end) {
+            chunkMin.col(chunkIdx) = x.col(0);
+            chunkMax.col(chunkIdx) = x.col(0);
+        } else {
+            chunkMin.col(chunkIdx) = x.middleCols(begin, end - begin).rowwise().minCoeff();
+            chunkMax.col(chunkIdx) = x.middleCols(begin, end - begin).rowwise().maxCoeff();
+        }
+    });
+    Eigen::Vector3d minPos = chunkMin.rowwise().minCoeff();
+    Eigen::Vector3d maxPos = chunkMax.rowwise().maxCoeff();
+    double rootWidth = (maxPos - minPos).maxCoeff();
+
+    this->root = this->arena.allocate(minPos(0), minPos(0) + rootWidth,
+                                      minPos(1), minPos(1) + rootWidth,
+                                      minPos(2), minPos(2) + rootWidth);
+
+    if (pool.nThreads == 1) {
+        // Construct Barnes-Hut tree
+        this->treeDepth = 0;
+        for (int i = 0; i < n; ++i) {
+            this->treeDepth = std::max(this->treeDepth, this->root->addObject(i, x, m, this->leafCapacity, this->maxTreeDepth));
+        }
+
+        // Combine moments bottom-up once all bodies are in place, as the parallel build does
+        this->root->computeMoments(x, m, this->expansionOrder >= 2);
+        return;
+    }
+
+    // Split enough top levels to keep every thread busy
+    int topLevels = 1;
+    while ((1 << 3*topLevels) < 8*(int)pool.nThreads && topLevels < 3) ++topLevels;
+    int nCells = 1 << 3*topLevels;
+
+    // Find the top level cell of each body, halving bounds exactly as OctreeNode::createChildren() does
+    this->bodyCells.resize(n);
+    std::vector<int> cellOffsets(nChunks*nCells, 0);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int i = chunkBegin(chunkIdx); i < chunkBegin(chunkIdx + 1); ++i) {
+            double bounds[3][2] = {{this->root->xMin, this->root->xMax},
+                                   {this->root->yMin, this->root->yMax},
+                                   {this->root->zMin, this->root->zMax}};
+            int cell = 0;
+            for (int level = 0; level < topLevels; ++level) {
+                // Octant digits are ordered (z y x) like OctreeNode::children
+                int octant = 0;
+                for (int dim = 2; dim >= 0; --dim) {
+                    double mid = (bounds[dim][0] + bounds[dim][1])/2.0;
+                    int half = x(dim, i) < mid ? 0 : 1;
+                    bounds[dim][1 - half] = mid;
+                    octant = 2*octant + half;
+                }
+                cell = 8*cell + octant;
+            }
+            this->bodyCells[i] = cell;
+            cellOffsets[chunkIdx*nCells + cell]++;
+        }
+    });
+
+    // Group bodies by cell. Chunks are in index order, so each cell stays in index order.
+    std::vector<int> cellBegin(nCells + 1);
+    int offset = 0;
+    for (int cell = 0; cell < nCells; ++cell) {
+        cellBegin[cell] = offset;
+        for (int chunkIdx = 0; chunkIdx < nChunks; ++chunkIdx) {
+            int count = cellOffsets[chunkIdx*nCells + cell];
+            cellOffsets[chunkIdx*nCells + cell] = offset;
+            offset += count;
+        }
+    }
+    cellBegin[nCells] = n;
+    this->cellBodies.resize(n);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int i = chunkBegin(chunkIdx); i < chunkBegin(chunkIdx + 1); ++i) {
+            this->cellBodies[cellOffsets[chunkIdx*nCells + this->bodyCells[i]]++] = i;
+        }
+    });
+
+    // Split the top levels serially. A node splits exactly when inserting its bodies would split it.
+    // Every other node becomes the root of a subtree built by one thread.
+    struct TopNode {
+        OctreeNode* node;
+        int cellBegin, cellEnd;     // Range of top level cells covered by the node
+    };
+    int leafCapacity = std::min(std::max(this->leafCapacity, 1), OCTREE_MAX_LEAF_CAPACITY);
+    std::vector<TopNode> splitNodes, subtrees;
+    std::vector<TopNode> queue {{this->root, 0, nCells}};
+    for (int k = 0; k < (int)queue.size(); ++k) {
+        TopNode top = queue[k];
+        int nBodies = cellBegin[top.cellEnd] - cellBegin[top.cellBegin];
+        if (nBodies == 0) continue;
+        if (nBodies <= leafCapacity || top.node->depth >= this->maxTreeDepth || top.node->depth == topLevels) {
+            subtrees.push_back(top);
+            continue;
+        }
+
+        top.node->createChildren();
+        top.node->isExternal = false;
+        splitNodes.push_back(top);
+        int width = (top.cellEnd - top.cellBegin)/8;
+        for (int octant = 0; octant < 8; ++octant) {
+            OctreeNode* child = top.node->children[octant >> 2][(octant >> 1) & 1][octant & 1];
+            queue.push_back({child, top.cellBegin + octant*width, top.cellBegin + (octant + 1)*width});
+        }
+    }
+
+    // Build the subtrees, each in index order, on the worker threads
+    while (this->threadArenas.size() < pool.nThreads) {
+        this->threadArenas.push_back(std::unique_ptr<OctreeArena>(new OctreeArena()));
+    }
+    for (int i = 0; i < (int)pool.nThreads; ++i) {
+        this->threadArenas[i]->reset();
+    }
+    std::vector<int> subtreeDepths(subtrees.size(), 0);
+    pool.parallelFor(subtrees.size(), [&](int unitIdx, unsigned threadIdx) {
+        const TopNode& subtree = subtrees[unitIdx];
+        OctreeNode* node = subtree.node;
+        node->arena = this->threadArenas[threadIdx].get();
+        std::vector<int> bodies(this->cellBodies.begin() + cellBegin[subtree.cellBegin],
+                                this->cellBodies.begin() + cellBegin[subtree.cellEnd]);
+        if (subtree.cellEnd - subtree.cellBegin > 1) {
+            std::sort(bodies.begin(), bodies.end());
+        }
+
+        int depth = 0;
+        for (int i : bodies) {
+            depth = std::max(depth, node->depth + node->addObject(i, x, m, leafCapacity, this->maxTreeDepth));
+        }
+        node->computeMoments(x, m, this->expansionOrder >= 2);
+        subtreeDepths[unitIdx] = depth;
+    });
+
+    this->treeDepth = 0;
+    for (int depth : subtreeDepths) {
+        this->treeDepth = std::max(this->treeDepth, depth);
+    }
+
+    // Split nodes combine the moments of their children, in the same order as computeMoments().
+    // Children of split nodes come after their parents, so a reverse sweep visits children first.
+    for (int k = splitNodes.size() - 1; k >= 0; --k) {
+        splitNodes[k].node->combineChildMoments(this->expansionOrder >= 2);
+    }
+}
+
+
+void Abstract_BarnesHut::collectGroups(int nodeIdx) {
+    const LinearOctreeNode& node = this->linearTree.nodes[nodeIdx];
+    if (node.isExternal || node.nBodies <= this->groupCapacity) {
+        this->groups.push_back(nodeIdx);
+        return;
+    }
+    for (int k = 0; k < node.nChildren; ++k) {
+        this->collectGroups(nodeIdx + node.childOffset + k);
+    }
+}
+
+
+void Abstract_BarnesHut::threadGroupUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                        const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                        int startIdx, int endIdx, unsigned threadIdx) {
+    const LinearOctreeNode* nodes = this->linearTree.nodes.data();
+    const int* order = this->linearTree.order.data();
+    const LinearOctreeNode** stack = this->linearWalkStacks[threadIdx].data();
+    InteractionList& list = this->interactionLists[threadIdx];
+    bool withQuadrupole = this->expansionOrder >= 2;
+
+    for (int g = startIdx; g < endIdx; ++g) {
+        const LinearOctreeNode& group = nodes[this->groups[g]];
+        const int* bodies = order + group.bodyBegin;
+
+        // Bounding box of the group's bodies, which can be much tighter than the node's bounds
+        Eigen::Vector3d boxMin = x.col(bodies[0]);
+        Eigen::Vector3d boxMax = x.col(bodies[0]);
+        for (int k = 1; k < group.nBodies; ++k) {
+            boxMin = boxMin.cwiseMin(x.col(bodies[k]));
+            boxMax = boxMax.cwiseMax(x.col(bodies[k]));
+        }
+
+        // Build the interaction list using the distance to the nearest point of the box,
+        // so every accepted node passes the opening test for every body of the group
+        list.clear();
+        int stackSize = 0;
+        stack[stackSize++] = nodes;
+        while (stackSize > 0) {
+            const LinearOctreeNode* currNode = stack[--stackSize];
+
+            double s = nodeSize(currNode);
+            Eigen::Vector3d gap = (boxMin - currNode->centerOfMass).cwiseMax(currNode->centerOfMass - boxMax).cwiseMax(0.0);
+            double d = gap.norm();
+
+            // Nodes holding the group's own bodies are always opened, whatever theta is
+            bool holdsGroup = currNode->bodyBegin <= group.bodyBegin && group.bodyBegin < currNode->bodyBegin + currNode->nBodies;
+            if (!holdsGroup && s < theta*d) {
+                // Current node is sufficiently far away from every body of the group
+                list.addNode(*currNode, withQuadrupole);
+            } else if (currNode->isExternal) {
+                // Interact with each of its bodies directly
+                list.addBodies(this->linearTree.bodies.block(currNode->bodyBegin, currNode->bodyBegin + currNode->nBodies));
             } else {
-                // Current node not sufficiently far from the current object
-                // Add currNode's children to queue
-                for (int z = 0; z < 2; ++z) {
-                    for (int y = 0; y < 2; ++y) {
-                        for (int x = 0; x < 2; ++x) {
-                            OctreeNode* child = currNode->children[z][y][x];
-                            if (!child->isEmpty) bfsQ.push(child);
-                        }
+                forEachChild(currNode, [&](const LinearOctreeNode* child) {
+                    stack[stackSize++] = child;
+                });
+            }
+        }
+
+        // Single precision sources are taken relative to the middle of the group, where they keep their precision
+        if (this->useMixedPrecision) {
+            list.convertToFloat(0.5*(boxMin + boxMax));
+        }
+
+        // Evaluate the whole list against every body of the group
+        for (int k = 0; k < group.nBodies; ++k) {
+            a.col(bodies[k]).setZero();
+            this->interactionCounts[bodies[k]] = list.nNodes() + list.nBodies();
+        }
+        this->listAcceleration(a, bodies, group.nBodies, list, x, m);
+
+        // Potentials and tidal tensors reuse the group's list
+        if (this->computePotentials) {
+            for (int k = 0; k < group.nBodies; ++k) {
+                int i = bodies[k];
+                double u = this->batchPotentialEnergy(x.col(i), 1.0, list.bodySources());
+                for (int l = 0; l < list.nNodes(); ++l) {
+                    Eigen::Vector3d centerOfMass(list.nodeX[l], list.nodeY[l], list.nodeZ[l]);
+                    if (withQuadrupole) {
+                        u += this->multipolePotentialEnergy(x.col(i), 1.0, centerOfMass, list.nodeM[l], list.quadrupole(l));
+                    } else {
+                        u += this->pairPotentialEnergy(x.col(i), centerOfMass, 1.0, list.nodeM[l]);
+                    }
+                }
+                this->potentials(i) = 2*u;
+            }
+        }
+        if (this->computeTidalTensors) {
+            for (int k = 0; k < group.nBodies; ++k) {
+                int i = bodies[k];
+                Eigen::Matrix3d T_i = Eigen::Matrix3d::Zero();
+                this->batchTidalTensor(T_i, x.col(i), m(i), list.bodySources());
+                for (int l = 0; l < list.nNodes(); ++l) {
+                    Eigen::Vector3d centerOfMass(list.nodeX[l], list.nodeY[l], list.nodeZ[l]);
+                    if (withQuadrupole) {
+                        this->multipoleTidalTensor(T_i, x.col(i), m(i), centerOfMass, list.nodeM[l], list.quadrupole(l));
+                    } else {
+                        this->pairTidalTensor(T_i, x.col(i), centerOfMass, m(i), list.nodeM[l]);
                     }
                 }
+                this->tidalTensors.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+            }
+        }
+    }
+}
+
+
+void Abstract_BarnesHut::listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                          const int* bodies,
+                                          int nBodies,
+                                          const InteractionList& list,
+                                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                          const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    for (int k = 0; k < nBodies; ++k) {
+        int i = bodies[k];
+        if (this->expansionOrder >= 2) {
+            for (int l = 0; l < list.nNodes(); ++l) {
+                Eigen::Vector3d centerOfMass(list.nodeX[l], list.nodeY[l], list.nodeZ[l]);
+                this->multipoleAcceleration(a.col(i), x.col(i), m(i), centerOfMass, list.nodeM[l], list.quadrupole(l)); // Force computation
             }
+        } else {
+            this->batchAcceleration(a.col(i), x.col(i), m(i), list.nodeSources()); // Force computation
+        }
+        this->batchAcceleration(a.col(i), x.col(i), m(i), list.bodySources()); // Force computation
+    }
+}
+
+
+void Abstract_BarnesHut::multipoleAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                                               const Eigen::Vector3d& x_i,
+                                               double m_i,
+                                               const Eigen::Vector3d& centerOfMass,
+                                               double totalMass,
+                                               const Eigen::Matrix3d& quadrupole) {
+    this->pairAcceleration(a_i, x_i, centerOfMass, m_i, totalMass);
+}
+
+
+double Abstract_BarnesHut::multipolePotentialEnergy(const Eigen::Vector3d& x_i,
+                                                    double m_i,
+                                                    const Eigen::Vector3d& centerOfMass,
+                                                    double totalMass,
+                                                    const Eigen::Matrix3d& quadrupole) {
+    return this->pairPotentialEnergy(x_i, centerOfMass, m_i, totalMass);
+}
+
+
+void Abstract_BarnesHut::multipoleTidalTensor(Eigen::Ref<Eigen::Matrix3d> T_i,
+                                              const Eigen::Vector3d& x_i,
+                                              double m_i,
+                                              const Eigen::Vector3d& centerOfMass,
+                                              double totalMass,
+                                              const Eigen::Matrix3d& quadrupole) {
+    this->pairTidalTensor(T_i, x_i, centerOfMass, m_i, totalMass);
+}
+
+
+void Abstract_BarnesHut::partitionWorkUnits(int n) {
+    // Use equal costs if there is no cost estimate for this set of particles
+    if ((int)this->interactionCounts.size() != n) {
+        this->interactionCounts.assign(n, 1);
+    }
+    this->partitionWorkUnits(this->interactionCounts);
+}
+
+
+void Abstract_BarnesHut::partitionWorkUnits(const std::vector<uint32_t>& costs) {
+    int n = costs.size();
+    uint64_t totalCost = 0;
+    for (int i = 0; i < n; ++i) {
+        totalCost += costs[i];
+    }
+
+    // Cut the particle range whenever the running cost passes the next multiple of unitCost
+    int nUnits = std::max(1, std::min<int>(n, this->workUnitsPerThread*this->threadPool.nThreads));
+    double unitCost = (double)totalCost/nUnits;
+    this->workUnitBounds.clear();
+    this->workUnitBounds.push_back(0);
+
+    uint64_t runningCost = 0;
+    for (int i = 0; i < n; ++i) {
+        runningCost += costs[i];
+        if (runningCost >= unitCost*this->workUnitBounds.size() && i + 1 < n) {
+            this->workUnitBounds.push_back(i + 1);
+        }
+    }
+    this->workUnitBounds.push_back(n);
+}
+
+
+void Abstract_BarnesHut::buildTree(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                   const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Release the previous tree. The arena keeps its memory for this step's tree.
+    this->arena.reset();
+    this->root = nullptr;
+
+    if (this->useLinearOctree) {
+        // Keep last step's tree if it still has the same bodies and parameters, and refit it
+        LinearOctree& tree = this->linearTree;
+        bool refit = this->useTreeRefit && !tree.nodes.empty() && (int)tree.order.size() == x.cols() &&
+                     this->refitSteps < this->maxRefitSteps &&
+                     tree.leafCapacity == this->leafCapacity && tree.maxDepth == this->maxTreeDepth &&
+                     tree.expansionOrder == this->expansionOrder;
+        if (refit && tree.refit(x, m, this->threadPool) <= 1 + this->refitTolerance) {
+            ++this->refitSteps;
+        } else {
+            // Construct Barnes-Hut tree from Morton-sorted bodies
+            tree.leafCapacity = this->leafCapacity;
+            tree.maxDepth = this->maxTreeDepth;
+            tree.expansionOrder = this->expansionOrder;
+            tree.build(x, m, this->threadPool);
+            this->refitSteps = 0;
+        }
+        this->treeDepth = tree.depth;
+    } else {
+        this->buildOctree(x, m);
+    }
+
+    // A depth-first walk holds at most 7 unvisited siblings per level plus the children of the deepest node
+    this->walkStacks.resize(this->threadPool.nThreads);
+    this->linearWalkStacks.resize(this->threadPool.nThreads);
+    this->leafBuffers.resize(this->threadPool.nThreads);
+    for (int i = 0; i < (int)this->threadPool.nThreads; ++i) {
+        this->leafBuffers[i].resize(OCTREE_MAX_LEAF_CAPACITY);
+        if (this->useLinearOctree) {
+            this->linearWalkStacks[i].resize(7*this->treeDepth + 8);
+        } else {
+            this->walkStacks[i].resize(7*this->treeDepth + 8);
         }
     }
 }
@@ -106,86 +888,257 @@ void Abstract_BarnesHut::threadUpdateAccelerations(Eigen::Ref<Eigen::Matrix3Xd>
 void Abstract_BarnesHut::updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
                                              const Eigen::Ref<const Eigen::Matrix3Xd>& x,
                                              const Eigen::Ref<const Eigen::RowVectorXd>& m) {
-    delete this->root;
+    this->updateAccelerationsPipelined(a, x, m, AccelerationsReady());
+}
 
-    // Get octree root bounds and construct octree root
-    Eigen::Matrix<double, 3, 1> minPos = x.rowwise().minCoeff();
-    Eigen::Matrix<double, 3, 1> maxPos = x.rowwise().maxCoeff();
-    Eigen::Matrix<double, 3, 1> widths = maxPos - minPos;
-    double rootWidth = widths.maxCoeff();
 
-    this->root = new OctreeNode(minPos(0), minPos(0) + rootWidth,
-                                minPos(1), minPos(1) + rootWidth,
-                                minPos(2), minPos(2) + rootWidth);
-    
-    // Construct Barnes-Hut tree
-    for (int i = 0; i < x.cols(); ++i) {
-        this->root->addObject(m(i), x.col(i));
-    }
+void Abstract_BarnesHut::updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                      const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                      const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                      const AccelerationsReady& ready) {
+    this->buildTree(x, m);
+    this->resizeOutputs(x.cols());
 
-    // Compute accelerations
-    int nThreads = std::thread::hardware_concurrency();
-    int width = x.cols() / nThreads;
-    int remainder = x.cols() % nThreads;
-    std::vector<std::thread> threads;
-    for (int i = 0; i < nThreads; ++i) {
-        int startIdx = i*width;
-        int endIdx = (i + 1)*width;
-        if (i == nThreads - 1) {
-            endIdx += remainder; // Add remaining indices to final thread
+    if (this->useLinearOctree && this->useGroupWalk) {
+        // Split bodies into groups and weigh each group by the interactions of its bodies
+        this->groups.clear();
+        this->collectGroups(0);
+        if ((int)this->interactionCounts.size() != x.cols()) {
+            this->interactionCounts.assign(x.cols(), 1);
         }
+        this->groupCosts.resize(this->groups.size());
+        for (int g = 0; g < (int)this->groups.size(); ++g) {
+            const LinearOctreeNode& group = this->linearTree.nodes[this->groups[g]];
+            uint32_t cost = 0;
+            for (int k = group.bodyBegin; k < group.bodyBegin + group.nBodies; ++k) {
+                cost += this->interactionCounts[this->linearTree.order[k]];
+            }
+            this->groupCosts[g] = cost;
+        }
+
+        // Each work unit is a run of groups in Morton order
+        this->interactionLists.resize(this->threadPool.nThreads);
+        this->partitionWorkUnits(this->groupCosts);
+        int nUnits = this->workUnitBounds.size() - 1;
+        this->threadPool.parallelFor(nUnits, [&](int unitIdx, unsigned threadIdx) {
+            int gBegin = this->workUnitBounds[unitIdx], gEnd = this->workUnitBounds[unitIdx + 1];
+            this->threadGroupUpdateAccelerations(a, x, m, gBegin, gEnd, threadIdx);
+            if (ready && gBegin < gEnd) {
+                const LinearOctreeNode& last = this->linearTree.nodes[this->groups[gEnd - 1]];
+                ready(this->linearTree.order.data(), this->linearTree.nodes[this->groups[gBegin]].bodyBegin, last.bodyBegin + last.nBodies);
+            }
+        });
+        return;
+    }
+
+    // Compute accelerations on the engine's worker threads.
+    // Work units are handed out dynamically so threads that get
+    // cheap particles (e.g. in a sparse halo) keep taking work.
+    this->partitionWorkUnits(x.cols());
+    int nUnits = this->workUnitBounds.size() - 1;
+    this->threadPool.parallelFor(nUnits, [&](int unitIdx, unsigned threadIdx) {
+        this->threadUpdateAccelerations(a, x, m, this->workUnitBounds[unitIdx], this->workUnitBounds[unitIdx + 1], nullptr, threadIdx);
+        if (ready) ready(nullptr, this->workUnitBounds[unitIdx], this->workUnitBounds[unitIdx + 1]);
+    });
+}
+
 
-        threads.emplace_back(&Abstract_BarnesHut::threadUpdateAccelerations, this, a, x, m, startIdx, endIdx);
+void Abstract_BarnesHut::updateActiveAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                   const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                   const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                   const std::vector<int>& active) {
+    // Inactive particles are still sources, so the tree always holds every particle.
+    // With #useTreeRefit the tree is refit to their predicted positions instead of rebuilt.
+    this->buildTree(x, m);
+    this->resizeOutputs(x.cols());
+
+    // Balance the active particles by their interaction counts from the last time they were walked
+    if ((int)this->interactionCounts.size() != x.cols()) {
+        this->interactionCounts.assign(x.cols(), 1);
+    }
+    this->activeCosts.resize(active.size());
+    for (int k = 0; k < (int)active.size(); ++k) {
+        this->activeCosts[k] = this->interactionCounts[active[k]];
     }
+    this->partitionWorkUnits(this->activeCosts);
+    int nUnits = this->workUnitBounds.size() - 1;
+    this->threadPool.parallelFor(nUnits, [&](int unitIdx, unsigned threadIdx) {
+        this->threadUpdateAccelerations(a, x, m, this->workUnitBounds[unitIdx], this->workUnitBounds[unitIdx + 1], active.data(), threadIdx);
+    });
+}
+
 
-    for (int i = 0; i < threads.size(); ++i) {
-        threads[i].join();
+void Abstract_BarnesHut::updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                 const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // An energy diagnostic walks the force pass's tree if it is still current, and otherwise does not count towards
+    // its refit budget, so steps come out the same however often energies are sampled
+    LinearOctree& tree = this->linearTree;
+    bool current = this->useLinearOctree && tree.leafCapacity == this->leafCapacity && tree.maxDepth == this->maxTreeDepth &&
+                   tree.expansionOrder == this->expansionOrder && tree.holds(x, m);
+    if (!current) {
+        int refitSteps = this->refitSteps;
+        this->buildTree(x, m);
+        if (this->refitSteps > 0) this->refitSteps = refitSteps;
     }
+
+    // Bodies are walked one by one even with the group walk, using the force pass's work units
+    this->partitionWorkUnits(x.cols());
+    int nUnits = this->workUnitBounds.size() - 1;
+    this->threadPool.parallelFor(nUnits, [&](int unitIdx, unsigned threadIdx) {
+        this->threadUpdatePotentialEnergies(u, x, m, this->workUnitBounds[unitIdx], this->workUnitBounds[unitIdx + 1], threadIdx);
+    });
 }
 
 
-/* class Gravitational_Direct */
+/* class Abstract_FMM */
 
-Gravitational_Direct::Gravitational_Direct(double softening, unit_t l, unit_t m, unit_t t)
-: softening(softening)
-, G(6.67430e-11/l/l/l*m*t*t) {}
+Abstract_FMM::Abstract_FMM(double theta, unsigned nThreads)
+: DynamicsEngine(nThreads)
+, theta(theta) {}
 
 
-void Gravitational_Direct::pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
-                                            const Eigen::Vector3d& x_i,
-                                            const Eigen::Vector3d& x_j,
-                                            double m_i, double m_j) {
-    Eigen::VectorXd dx = x_i - x_j;
-    a_i += -G*m_j*(dx)/std::pow(dx.squaredNorm() + softening*softening, 1.5);
+void Abstract_FMM::collectTargetCells(int nodeIdx, int maxBodies) {
+    const LinearOctreeNode& node = this->tree.nodes[nodeIdx];
+    if (node.isExternal || node.nBodies <= maxBodies) {
+        this->targetCells.push_back(nodeIdx);
+        return;
+    }
+    for (int k = 0; k < node.nChildren; ++k) {
+        this->collectTargetCells(nodeIdx + node.childOffset + k, maxBodies);
+    }
 }
 
 
-double Gravitational_Direct::pairPotentialEnergy(const Eigen::Vector3d& x_i,
-                                                 const Eigen::Vector3d& x_j,
-                                                 double m_i, double m_j) {
-    return -G*m_j*m_i/2.0/(x_j - x_i).norm();
+void Abstract_FMM::walkTargetCell(int nodeIdx,
+                                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                  const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    this->interact<Abstract_FMM>(nodeIdx, 0, a, x, m);
 }
 
 
-/* class Gravitational_BarnesHut */
+void Abstract_FMM::evaluateLocals(int nodeIdx,
+                                  Eigen::Ref<Eigen::Matrix3Xd> a,
+                                  const Eigen::Ref<const Eigen::Matrix3Xd>& x) {
+    const LinearOctreeNode& node = this->tree.nodes[nodeIdx];
+    const LocalExpansion& local = this->locals[nodeIdx];
+    int order = std::min(this->expansionOrder, 2);
 
-Gravitational_BarnesHut::Gravitational_BarnesHut(double theta, double softening, unit_t l, unit_t m, unit_t t)
-: Abstract_BarnesHut(theta)
-, softening(softening)
-, G(6.67430e-11/l/l/l*m*t*t) {}
+    if (node.isExternal) {
+        for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+            int i = this->tree.order[k];
+            Eigen::Vector3d d = x.col(i) - node.centerOfMass;
+            a.col(i) += local.evaluate(d, order);
+            if (this->computePotentials) this->potentials(i) += local.evaluatePotential(d, order);
+            if (this->computeTidalTensors) {
+                Eigen::Matrix3d T_i = local.evaluateTidalTensor(d, order);
+                this->tidalTensors.col(i) += Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+            }
+        }
+        return;
+    }
 
+    for (int k = 0; k < node.nChildren; ++k) {
+        int childIdx = nodeIdx + node.childOffset + k;
+        local.shiftTo(this->locals[childIdx], this->tree.nodes[childIdx].centerOfMass - node.centerOfMass, order);
+        this->evaluateLocals(childIdx, a, x);
+    }
+}
 
-void Gravitational_BarnesHut::pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
-                                               const Eigen::Vector3d& x_i,
-                                               const Eigen::Vector3d& x_j,
-                                               double m_i, double m_j) {
-    Eigen::VectorXd dx = x_i - x_j;
-    a_i += -G*m_j*(dx)/std::pow(dx.squaredNorm() + softening*softening, 1.5);
+
+void Abstract_FMM::multipoleToLocal(LocalExpansion& local,
+                                    const LinearOctreeNode& target,
+                                    const LinearOctreeNode& source) {
+    // Mean body mass of the target stands in for m_i
+    double m_i = target.totalMass/target.nBodies;
+    Eigen::Vector3d g = Eigen::Vector3d::Zero();
+    this->pairAcceleration(g, target.centerOfMass, source.centerOfMass, m_i, source.totalMass);
+    local.g += g;
+    local.phi += 2*this->pairPotentialEnergy(target.centerOfMass, source.centerOfMass, 1.0, source.totalMass);
+    if (this->expansionOrder < 1) return;
+    Eigen::Matrix3d tidal = Eigen::Matrix3d::Zero();
+    this->pairTidalTensor(tidal, target.centerOfMass, source.centerOfMass, m_i, source.totalMass);
+    local.T -= tidal;
+}
+
+
+void Abstract_FMM::updateAccelerations(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                       const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                       const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    this->updateAccelerationsPipelined(a, x, m, AccelerationsReady());
+}
+
+
+void Abstract_FMM::updatePotentialEnergies(Eigen::Ref<Eigen::RowVectorXd> u,
+                                           const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                           const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Expansions hold the potential of a unit mass, so a force pass gives every energy at once
+    bool computePotentials = this->computePotentials;
+    bool computeTidalTensors = this->computeTidalTensors;
+    this->computePotentials = true;
+    this->computeTidalTensors = false;
+    Eigen::RowVectorXd lastPotentials;
+    lastPotentials.swap(this->potentials);
+
+    Eigen::Matrix3Xd a(3, x.cols());
+    this->updateAccelerations(a, x, m);
+
+    // Pair energies are halved
+    u = 0.5*m.cwiseProduct(this->potentials);
+    this->potentials.swap(lastPotentials);
+    this->computePotentials = computePotentials;
+    this->computeTidalTensors = computeTidalTensors;
 }
 
 
-double Gravitational_BarnesHut::pairPotentialEnergy(const Eigen::Vector3d& x_i,
-                                                    const Eigen::Vector3d& x_j,
-                                                    double m_i, double m_j) {
-    return -G*m_j*m_i/2.0/(x_j - x_i).norm();
+void Abstract_FMM::updateAccelerationsPipelined(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                const AccelerationsReady& ready) {
+    int n = x.cols();
+    if (n == 0) return;
+
+    // Upward pass: the tree accumulates multipoles while it is built
+    this->tree.leafCapacity = this->leafCapacity;
+    this->tree.maxDepth = this->maxTreeDepth;
+    this->tree.expansionOrder = this->expansionOrder >= 2 ? 2 : 0;
+    this->tree.build(x, m, this->threadPool);
+
+    // Cell radii bound the distance from the center of mass to any body of the cell
+    int nNodes = this->tree.nodes.size();
+    this->radii.resize(nNodes);
+    this->locals.resize(nNodes);
+    int nChunks = this->threadPool.nThreads;
+    this->threadPool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int i = (int64_t)nNodes*chunkIdx/nChunks; i < (int64_t)nNodes*(chunkIdx + 1)/nChunks; ++i) {
+            const LinearOctreeNode& node = this->tree.nodes[i];
+            Eigen::Vector3d farthest(std::max(node.centerOfMass(0) - node.xMin, node.xMax - node.centerOfMass(0)),
+                                     std::max(node.centerOfMass(1) - node.yMin, node.yMax - node.centerOfMass(1)),
+                                     std::max(node.centerOfMass(2) - node.zMin, node.zMax - node.centerOfMass(2)));
+            this->radii[i] = farthest.norm();
+            this->locals[i].setZero();
+        }
+    });
+    this->resizeOutputs(n);
+
+    // Each target cell is walked against the whole tree, then its local expansions are passed down.
+    // Target subtrees are disjoint, so threads never write to the same expansion or body.
+    this->targetCells.clear();
+    this->collectTargetCells(0, std::max(this->leafCapacity, n/(this->workUnitsPerThread*(int)this->threadPool.nThreads)));
+    this->threadPool.parallelFor(this->targetCells.size(), [&](int cellIdx, unsigned threadIdx) {
+        int nodeIdx = this->targetCells[cellIdx];
+        const LinearOctreeNode& node = this->tree.nodes[nodeIdx];
+        bool withOutputs = this->computePotentials || this->computeTidalTensors;
+        for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+            int i = this->tree.order[k];
+            a.col(i).setZero();
+            if (withOutputs) this->clearOutputs(i, i + 1);
+        }
+        this->walkTargetCell(nodeIdx, a, x, m);
+        this->evaluateLocals(nodeIdx, a, x);
+        if (ready) ready(this->tree.order.data(), node.bodyBegin, node.bodyBegin + node.nBodies);
+    });
 }
+
+
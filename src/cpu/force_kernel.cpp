@@ -0,0 +1,203 @@
+#include "force_kernel.hpp"
+#include "force_kernel_simd.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#if defined(NBT_X86_KERNELS) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+
+/* struct SourceArrays */
+
+void SourceArrays::resize(int n) {
+    this->x.resize(n);
+    this->y.resize(n);
+    this->z.resize(n);
+    this->m.resize(n);
+}
+
+
+SourceBlock SourceArrays::block(int begin, int end) const {
+    return {this->x.data() + begin, this->y.data() + begin, this->z.data() + begin, this->m.data() + begin, end - begin};
+}
+
+
+/* struct FloatSourceArrays */
+
+void FloatSourceArrays::resize(int n) {
+    this->x.resize(n);
+    this->y.resize(n);
+    this->z.resize(n);
+    this->m.resize(n);
+}
+
+
+FloatSourceBlock FloatSourceArrays::block(int begin, int end) const {
+    return {this->x.data() + begin, this->y.data() + begin, this->z.data() + begin, this->m.data() + begin, end - begin};
+}
+
+
+/* Instruction set dispatch */
+
+SimdLevel detectSimdLevel() {
+#if defined(NBT_X86_KERNELS) && defined(_MSC_VER)
+    // Wide registers are only usable if the OS saves them, which XCR0 reports
+    int info[4];
+    __cpuid(info, 0);
+    int maxLeaf = info[0];
+    __cpuid(info, 1);
+    bool fma = info[2] & (1 << 12);
+    bool osSavesState = info[2] & (1 << 27);
+    unsigned long long xcr0 = osSavesState ? _xgetbv(0) : 0;
+    bool avx2 = false, avx512 = false;
+    if (maxLeaf >= 7) {
+        __cpuidex(info, 7, 0);
+        avx2 = info[1] & (1 << 5);
+        avx512 = info[1] & (1 << 16);
+    }
+    if (avx512 && (xcr0 & 0xe6) == 0xe6) return SimdLevel::AVX512;
+    if (avx2 && fma && (xcr0 & 0x6) == 0x6) return SimdLevel::AVX2;
+    return SimdLevel::SSE2;
+#elif defined(NBT_X86_KERNELS)
+    // Also checks that the OS saves the wide registers
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE2: return "sse2";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+
+static SimdLevel initialSimdLevel() {
+    SimdLevel detected = detectSimdLevel();
+    const char* requested = std::getenv("NBT_SIMD");
+    if (requested == nullptr) return detected;
+
+    // A level above what the CPU supports falls back to the detected one. Unknown names are ignored.
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (std::strcmp(requested, simdLevelName(level)) == 0) {
+            return std::min(level, detected);
+        }
+    }
+    return detected;
+}
+
+
+static std::atomic<SimdLevel>& activeSimdLevel() {
+    static std::atomic<SimdLevel> level(initialSimdLevel());
+    return level;
+}
+
+
+SimdLevel getSimdLevel() {
+    return activeSimdLevel().load(std::memory_order_relaxed);
+}
+
+
+void setSimdLevel(SimdLevel level) {
+    if (level > detectSimdLevel()) {
+        throw std::invalid_argument(std::string("Error: SIMD level ") + simdLevelName(level) + " not supported.");
+    }
+    activeSimdLevel().store(level, std::memory_order_relaxed);
+}
+
+
+/* Force kernels */
+
+void gravitationalBatch(Eigen::Ref<Eigen::Vector3d> a_i,
+                        const Eigen::Vector3d& x_i,
+                        const SourceBlock& sources,
+                        double G,
+                        double softening2) {
+    double sum[3] = {0, 0, 0};
+    int j = 0;
+
+    // Whole vectors of sources at the selected level
+    switch (getSimdLevel()) {
+#if defined(NBT_X86_KERNELS)
+        case SimdLevel::AVX512: j = gravitationalBatchAVX512(x_i.data(), sources.x, sources.y, sources.z, sources.m, sources.n, softening2, sum); break;
+        case SimdLevel::AVX2: j = gravitationalBatchAVX2(x_i.data(), sources.x, sources.y, sources.z, sources.m, sources.n, softening2, sum); break;
+        case SimdLevel::SSE2: j = gravitationalBatchSSE2(x_i.data(), sources.x, sources.y, sources.z, sources.m, sources.n, softening2, sum); break;
+#endif
+        default: break;
+    }
+
+    // Remaining sources, or every source at the scalar level.
+    // The division is done unconditionally and the result selected afterwards, keeping the loop branch-free.
+    const double posX = x_i(0), posY = x_i(1), posZ = x_i(2);
+    double ax = sum[0], ay = sum[1], az = sum[2];
+    for (; j < sources.n; ++j) {
+        double dx = sources.x[j] - posX;
+        double dy = sources.y[j] - posY;
+        double dz = sources.z[j] - posZ;
+        double r2 = dx*dx + dy*dy + dz*dz + softening2;
+        double mR3 = sources.m[j]/(r2*std::sqrt(r2));
+        double mOverR3 = r2 > 0 ? mR3 : 0.0;
+        ax += mOverR3*dx;
+        ay += mOverR3*dy;
+        az += mOverR3*dz;
+    }
+
+    a_i(0) += G*ax;
+    a_i(1) += G*ay;
+    a_i(2) += G*az;
+}
+
+
+void gravitationalBatchMixed(Eigen::Ref<Eigen::Vector3d> a_i,
+                             const Eigen::Vector3d& x_i,
+                             const FloatSourceBlock& sources,
+                             double G,
+                             double softening2) {
+    const float pos[3] = {(float)x_i(0), (float)x_i(1), (float)x_i(2)};
+    const float eps2 = softening2;
+    double sum[3] = {0, 0, 0};
+    int j = 0;
+
+    // Whole vectors of sources at the selected level
+    switch (getSimdLevel()) {
+#if defined(NBT_X86_KERNELS)
+        case SimdLevel::AVX512: j = gravitationalBatchMixedAVX512(pos, sources.x, sources.y, sources.z, sources.m, sources.n, eps2, sum); break;
+        case SimdLevel::AVX2: j = gravitationalBatchMixedAVX2(pos, sources.x, sources.y, sources.z, sources.m, sources.n, eps2, sum); break;
+        case SimdLevel::SSE2: j = gravitationalBatchMixedSSE2(pos, sources.x, sources.y, sources.z, sources.m, sources.n, eps2, sum); break;
+#endif
+        default: break;
+    }
+
+    // Remaining sources, or every source at the scalar level
+    double ax = sum[0], ay = sum[1], az = sum[2];
+    for (; j < sources.n; ++j) {
+        float dx = sources.x[j] - pos[0];
+        float dy = sources.y[j] - pos[1];
+        float dz = sources.z[j] - pos[2];
+        float r2 = dx*dx + dy*dy + dz*dz + eps2;
+        float invR = 1.0f/std::sqrt(r2);
+        float mOverR3 = r2 > 0 ? sources.m[j]*invR*invR*invR : 0.0f;
+        ax += mOverR3*dx;
+        ay += mOverR3*dy;
+        az += mOverR3*dz;
+    }
+
+    a_i(0) += G*ax;
+    a_i(1) += G*ay;
+    a_i(2) += G*az;
+}
@@ -0,0 +1,93 @@
+#include "force_kernel_simd.hpp"
+
+#if defined(NBT_X86_KERNELS)
+
+#include <immintrin.h>
+
+
+static inline double horizontalSum(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+
+int gravitationalBatchAVX2(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                           double softening2, double* sum) {
+    // 4 sources per iteration. AVX2 has no double precision rsqrt, and a float estimate
+    // would overflow for SI scale distances, so 1/sqrt(r2) uses the exact instructions.
+    __m256d xi = _mm256_set1_pd(x_i[0]), yi = _mm256_set1_pd(x_i[1]), zi = _mm256_set1_pd(x_i[2]);
+    __m256d eps2 = _mm256_set1_pd(softening2);
+    __m256d one = _mm256_set1_pd(1.0), zero = _mm256_setzero_pd();
+    __m256d sumX = _mm256_setzero_pd(), sumY = _mm256_setzero_pd(), sumZ = _mm256_setzero_pd();
+    int j = 0;
+    for (; j + 4 <= n; j += 4) {
+        __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), xi);
+        __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), yi);
+        __m256d dz = _mm256_sub_pd(_mm256_loadu_pd(z + j), zi);
+        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, eps2)));
+
+        __m256d invR = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+        __m256d nonZero = _mm256_cmp_pd(r2, zero, _CMP_GT_OQ);
+        __m256d mOverR3 = _mm256_and_pd(nonZero, _mm256_mul_pd(_mm256_loadu_pd(m + j), _mm256_mul_pd(invR, _mm256_mul_pd(invR, invR))));
+        sumX = _mm256_fmadd_pd(mOverR3, dx, sumX);
+        sumY = _mm256_fmadd_pd(mOverR3, dy, sumY);
+        sumZ = _mm256_fmadd_pd(mOverR3, dz, sumZ);
+    }
+    sum[0] += horizontalSum(sumX);
+    sum[1] += horizontalSum(sumY);
+    sum[2] += horizontalSum(sumZ);
+    return j;
+}
+
+
+
+static inline __m256d lowToDouble(__m256 v) {
+    return _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+}
+
+static inline __m256d highToDouble(__m256 v) {
+    return _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+}
+
+
+int gravitationalBatchMixedAVX2(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                float softening2, double* sum) {
+    // 8 sources per iteration. 1/sqrt(r2) is a 12 bit estimate refined by one Newton step.
+    __m256 xi = _mm256_set1_ps(x_i[0]), yi = _mm256_set1_ps(x_i[1]), zi = _mm256_set1_ps(x_i[2]);
+    __m256 eps2 = _mm256_set1_ps(softening2);
+    __m256 half = _mm256_set1_ps(0.5f), threeHalves = _mm256_set1_ps(1.5f), zero = _mm256_setzero_ps();
+    __m256d sumX = _mm256_setzero_pd(), sumY = _mm256_setzero_pd(), sumZ = _mm256_setzero_pd();
+    int j = 0;
+    while (j + 8 <= n) {
+        // Partial sums stay in single precision for at most MIXED_CHUNK vectors before moving to the double sums
+        __m256 partX = _mm256_setzero_ps(), partY = _mm256_setzero_ps(), partZ = _mm256_setzero_ps();
+        int chunkEnd = n - j < MIXED_CHUNK*8 ? n - n % 8 : j + MIXED_CHUNK*8;
+        for (; j < chunkEnd; j += 8) {
+            __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+            __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+            __m256 dz = _mm256_sub_ps(_mm256_loadu_ps(z + j), zi);
+            __m256 r2 = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, _mm256_fmadd_ps(dz, dz, eps2)));
+
+            __m256 invR = _mm256_rsqrt_ps(r2);
+            invR = _mm256_mul_ps(invR, _mm256_fnmadd_ps(_mm256_mul_ps(half, r2), _mm256_mul_ps(invR, invR), threeHalves));
+
+            // m/r^3 is built up one factor at a time so it stays in single precision range
+            __m256 nonZero = _mm256_cmp_ps(r2, zero, _CMP_GT_OQ);
+            __m256 mOverR3 = _mm256_and_ps(nonZero, _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(m + j), invR), invR), invR));
+            partX = _mm256_fmadd_ps(mOverR3, dx, partX);
+            partY = _mm256_fmadd_ps(mOverR3, dy, partY);
+            partZ = _mm256_fmadd_ps(mOverR3, dz, partZ);
+        }
+        sumX = _mm256_add_pd(sumX, _mm256_add_pd(lowToDouble(partX), highToDouble(partX)));
+        sumY = _mm256_add_pd(sumY, _mm256_add_pd(lowToDouble(partY), highToDouble(partY)));
+        sumZ = _mm256_add_pd(sumZ, _mm256_add_pd(lowToDouble(partZ), highToDouble(partZ)));
+    }
+    sum[0] += horizontalSum(sumX);
+    sum[1] += horizontalSum(sumY);
+    sum[2] += horizontalSum(sumZ);
+    return j;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#include "force_kernel_simd.hpp"
+
+#if defined(NBT_X86_KERNELS)
+
+#include <immintrin.h>
+
+
+int gravitationalBatchAVX512(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                             double softening2, double* sum) {
+    // 8 sources per iteration. 1/sqrt(r2) starts from a 14 bit estimate and two
+    // Newton steps bring it to double precision without a divide or square root.
+    __m512d xi = _mm512_set1_pd(x_i[0]), yi = _mm512_set1_pd(x_i[1]), zi = _mm512_set1_pd(x_i[2]);
+    __m512d eps2 = _mm512_set1_pd(softening2);
+    __m512d half = _mm512_set1_pd(0.5), threeHalves = _mm512_set1_pd(1.5);
+    __m512d sumX = _mm512_setzero_pd(), sumY = _mm512_setzero_pd(), sumZ = _mm512_setzero_pd();
+    int j = 0;
+    for (; j + 8 <= n; j += 8) {
+        __m512d dx = _mm512_sub_pd(_mm512_loadu_pd(x + j), xi);
+        __m512d dy = _mm512_sub_pd(_mm512_loadu_pd(y + j), yi);
+        __m512d dz = _mm512_sub_pd(_mm512_loadu_pd(z + j), zi);
+        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, eps2)));
+
+        __m512d invR = _mm512_rsqrt14_pd(r2);
+        __m512d halfR2 = _mm512_mul_pd(half, r2);
+        invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(halfR2, _mm512_mul_pd(invR, invR), threeHalves));
+        invR = _mm512_mul_pd(invR, _mm512_fnmadd_pd(halfR2, _mm512_mul_pd(invR, invR), threeHalves));
+
+        // Sources at x_i (r2 == 0) are masked out instead of producing inf*0
+        __mmask8 nonZero = _mm512_cmp_pd_mask(r2, _mm512_setzero_pd(), _CMP_GT_OQ);
+        __m512d mOverR3 = _mm512_maskz_mul_pd(nonZero, _mm512_loadu_pd(m + j), _mm512_mul_pd(invR, _mm512_mul_pd(invR, invR)));
+        sumX = _mm512_fmadd_pd(mOverR3, dx, sumX);
+        sumY = _mm512_fmadd_pd(mOverR3, dy, sumY);
+        sumZ = _mm512_fmadd_pd(mOverR3, dz, sumZ);
+    }
+    sum[0] += _mm512_reduce_add_pd(sumX);
+    sum[1] += _mm512_reduce_add_pd(sumY);
+    sum[2] += _mm512_reduce_add_pd(sumZ);
+    return j;
+}
+
+
+
+static inline __m512d lowToDouble(__m512 v) {
+    return _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+}
+
+static inline __m512d highToDouble(__m512 v) {
+    return _mm512_cvtps_pd(_mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+}
+
+
+int gravitationalBatchMixedAVX512(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                  float softening2, double* sum) {
+    // 16 sources per iteration. 1/sqrt(r2) is a 14 bit estimate refined by one Newton step.
+    __m512 xi = _mm512_set1_ps(x_i[0]), yi = _mm512_set1_ps(x_i[1]), zi = _mm512_set1_ps(x_i[2]);
+    __m512 eps2 = _mm512_set1_ps(softening2);
+    __m512 half = _mm512_set1_ps(0.5f), threeHalves = _mm512_set1_ps(1.5f);
+    __m512d sumX = _mm512_setzero_pd(), sumY = _mm512_setzero_pd(), sumZ = _mm512_setzero_pd();
+    int j = 0;
+    while (j + 16 <= n) {
+        // Partial sums stay in single precision for at most MIXED_CHUNK vectors before moving to the double sums
+        __m512 partX = _mm512_setzero_ps(), partY = _mm512_setzero_ps(), partZ = _mm512_setzero_ps();
+        int chunkEnd = n - j < MIXED_CHUNK*16 ? n - n % 16 : j + MIXED_CHUNK*16;
+        for (; j < chunkEnd; j += 16) {
+            __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), xi);
+            __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), yi);
+            __m512 dz = _mm512_sub_ps(_mm512_loadu_ps(z + j), zi);
+            __m512 r2 = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, _mm512_fmadd_ps(dz, dz, eps2)));
+
+            __m512 invR = _mm512_rsqrt14_ps(r2);
+            invR = _mm512_mul_ps(invR, _mm512_fnmadd_ps(_mm512_mul_ps(half, r2), _mm512_mul_ps(invR, invR), threeHalves));
+
+            // m/r^3 is built up one factor at a time so it stays in single precision range
+            __mmask16 nonZero = _mm512_cmp_ps_mask(r2, _mm512_setzero_ps(), _CMP_GT_OQ);
+            __m512 mOverR3 = _mm512_maskz_mul_ps(nonZero, _mm512_mul_ps(_mm512_mul_ps(_mm512_loadu_ps(m + j), invR), invR), invR);
+            partX = _mm512_fmadd_ps(mOverR3, dx, partX);
+            partY = _mm512_fmadd_ps(mOverR3, dy, partY);
+            partZ = _mm512_fmadd_ps(mOverR3, dz, partZ);
+        }
+        sumX = _mm512_add_pd(sumX, _mm512_add_pd(lowToDouble(partX), highToDouble(partX)));
+        sumY = _mm512_add_pd(sumY, _mm512_add_pd(lowToDouble(partY), highToDouble(partY)));
+        sumZ = _mm512_add_pd(sumZ, _mm512_add_pd(lowToDouble(partZ), highToDouble(partZ)));
+    }
+    sum[0] += _mm512_reduce_add_pd(sumX);
+    sum[1] += _mm512_reduce_add_pd(sumY);
+    sum[2] += _mm512_reduce_add_pd(sumZ);
+    return j;
+}
+
+#endif
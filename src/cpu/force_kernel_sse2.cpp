@@ -0,0 +1,80 @@
+#include "force_kernel_simd.hpp"
+
+#if defined(NBT_X86_KERNELS)
+
+#include <emmintrin.h>
+
+
+static inline double horizontalSum(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+
+int gravitationalBatchSSE2(const double* x_i, const double* x, const double* y, const double* z, const double* m, int n,
+                           double softening2, double* sum) {
+    // 2 sources per iteration, with the exact square root and division
+    __m128d xi = _mm_set1_pd(x_i[0]), yi = _mm_set1_pd(x_i[1]), zi = _mm_set1_pd(x_i[2]);
+    __m128d eps2 = _mm_set1_pd(softening2);
+    __m128d one = _mm_set1_pd(1.0), zero = _mm_setzero_pd();
+    __m128d sumX = _mm_setzero_pd(), sumY = _mm_setzero_pd(), sumZ = _mm_setzero_pd();
+    int j = 0;
+    for (; j + 2 <= n; j += 2) {
+        __m128d dx = _mm_sub_pd(_mm_loadu_pd(x + j), xi);
+        __m128d dy = _mm_sub_pd(_mm_loadu_pd(y + j), yi);
+        __m128d dz = _mm_sub_pd(_mm_loadu_pd(z + j), zi);
+        __m128d r2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, dx), _mm_mul_pd(dy, dy)), _mm_add_pd(_mm_mul_pd(dz, dz), eps2));
+
+        __m128d invR = _mm_div_pd(one, _mm_sqrt_pd(r2));
+        __m128d nonZero = _mm_cmpgt_pd(r2, zero);
+        __m128d mOverR3 = _mm_and_pd(nonZero, _mm_mul_pd(_mm_loadu_pd(m + j), _mm_mul_pd(invR, _mm_mul_pd(invR, invR))));
+        sumX = _mm_add_pd(sumX, _mm_mul_pd(mOverR3, dx));
+        sumY = _mm_add_pd(sumY, _mm_mul_pd(mOverR3, dy));
+        sumZ = _mm_add_pd(sumZ, _mm_mul_pd(mOverR3, dz));
+    }
+    sum[0] += horizontalSum(sumX);
+    sum[1] += horizontalSum(sumY);
+    sum[2] += horizontalSum(sumZ);
+    return j;
+}
+
+
+
+int gravitationalBatchMixedSSE2(const float* x_i, const float* x, const float* y, const float* z, const float* m, int n,
+                                float softening2, double* sum) {
+    // 4 sources per iteration. 1/sqrt(r2) is a 12 bit estimate refined by one Newton step.
+    __m128 xi = _mm_set1_ps(x_i[0]), yi = _mm_set1_ps(x_i[1]), zi = _mm_set1_ps(x_i[2]);
+    __m128 eps2 = _mm_set1_ps(softening2);
+    __m128 half = _mm_set1_ps(0.5f), threeHalves = _mm_set1_ps(1.5f), zero = _mm_setzero_ps();
+    __m128d sumX = _mm_setzero_pd(), sumY = _mm_setzero_pd(), sumZ = _mm_setzero_pd();
+    int j = 0;
+    while (j + 4 <= n) {
+        // Partial sums stay in single precision for at most MIXED_CHUNK vectors before moving to the double sums
+        __m128 partX = _mm_setzero_ps(), partY = _mm_setzero_ps(), partZ = _mm_setzero_ps();
+        int chunkEnd = n - j < MIXED_CHUNK*4 ? n - n % 4 : j + MIXED_CHUNK*4;
+        for (; j < chunkEnd; j += 4) {
+            __m128 dx = _mm_sub_ps(_mm_loadu_ps(x + j), xi);
+            __m128 dy = _mm_sub_ps(_mm_loadu_ps(y + j), yi);
+            __m128 dz = _mm_sub_ps(_mm_loadu_ps(z + j), zi);
+            __m128 r2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_add_ps(_mm_mul_ps(dz, dz), eps2));
+
+            __m128 invR = _mm_rsqrt_ps(r2);
+            invR = _mm_mul_ps(invR, _mm_sub_ps(threeHalves, _mm_mul_ps(_mm_mul_ps(half, r2), _mm_mul_ps(invR, invR))));
+
+            // m/r^3 is built up one factor at a time so it stays in single precision range
+            __m128 nonZero = _mm_cmpgt_ps(r2, zero);
+            __m128 mOverR3 = _mm_and_ps(nonZero, _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(_mm_loadu_ps(m + j), invR), invR), invR));
+            partX = _mm_add_ps(partX, _mm_mul_ps(mOverR3, dx));
+            partY = _mm_add_ps(partY, _mm_mul_ps(mOverR3, dy));
+            partZ = _mm_add_ps(partZ, _mm_mul_ps(mOverR3, dz));
+        }
+        sumX = _mm_add_pd(sumX, _mm_add_pd(_mm_cvtps_pd(partX), _mm_cvtps_pd(_mm_movehl_ps(partX, partX))));
+        sumY = _mm_add_pd(sumY, _mm_add_pd(_mm_cvtps_pd(partY), _mm_cvtps_pd(_mm_movehl_ps(partY, partY))));
+        sumZ = _mm_add_pd(sumZ, _mm_add_pd(_mm_cvtps_pd(partZ), _mm_cvtps_pd(_mm_movehl_ps(partZ, partZ))));
+    }
+    sum[0] += horizontalSum(sumX);
+    sum[1] += horizontalSum(sumY);
+    sum[2] += horizontalSum(sumZ);
+    return j;
+}
+
+#endif
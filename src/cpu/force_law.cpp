@@ -0,0 +1,399 @@
+#include "force_law.hpp"
+
+#include <Eigen>
+#include <cmath>
+#include <algorithm>
+
+
+/* struct InteractionList */
+
+void InteractionList::clear() {
+    this->nodeX.clear(); this->nodeY.clear(); this->nodeZ.clear(); this->nodeM.clear();
+    this->qxx.clear(); this->qxy.clear(); this->qxz.clear();
+    this->qyy.clear(); this->qyz.clear(); this->qzz.clear();
+    this->bodyX.clear(); this->bodyY.clear(); this->bodyZ.clear(); this->bodyM.clear();
+}
+
+
+void InteractionList::addNode(const LinearOctreeNode& node, bool withQuadrupole) {
+    this->nodeX.push_back(node.centerOfMass(0));
+    this->nodeY.push_back(node.centerOfMass(1));
+    this->nodeZ.push_back(node.centerOfMass(2));
+    this->nodeM.push_back(node.totalMass);
+
+    if (withQuadrupole) {
+        this->qxx.push_back(node.quadrupole(0, 0));
+        this->qxy.push_back(node.quadrupole(0, 1));
+        this->qxz.push_back(node.quadrupole(0, 2));
+        this->qyy.push_back(node.quadrupole(1, 1));
+        this->qyz.push_back(node.quadrupole(1, 2));
+        this->qzz.push_back(node.quadrupole(2, 2));
+    }
+}
+
+
+void InteractionList::addBodies(const SourceBlock& bodies) {
+    this->bodyX.insert(this->bodyX.end(), bodies.x, bodies.x + bodies.n);
+    this->bodyY.insert(this->bodyY.end(), bodies.y, bodies.y + bodies.n);
+    this->bodyZ.insert(this->bodyZ.end(), bodies.z, bodies.z + bodies.n);
+    this->bodyM.insert(this->bodyM.end(), bodies.m, bodies.m + bodies.n);
+}
+
+
+SourceBlock InteractionList::nodeSources() const {
+    return {this->nodeX.data(), this->nodeY.data(), this->nodeZ.data(), this->nodeM.data(), this->nNodes()};
+}
+
+
+SourceBlock InteractionList::bodySources() const {
+    return {this->bodyX.data(), this->bodyY.data(), this->bodyZ.data(), this->bodyM.data(), this->nBodies()};
+}
+
+
+Eigen::Matrix3d InteractionList::quadrupole(int k) const {
+    Eigen::Matrix3d q;
+    q << this->qxx[k], this->qxy[k], this->qxz[k],
+         this->qxy[k], this->qyy[k], this->qyz[k],
+         this->qxz[k], this->qyz[k], this->qzz[k];
+    return q;
+}
+
+
+void InteractionList::convertToFloat(const Eigen::Vector3d& center) {
+    int nNodes = this->nNodes();
+    this->floatCenter = center;
+    this->floatSources.resize(nNodes + this->nBodies());
+    for (int k = 0; k < nNodes; ++k) {
+        this->floatSources.x[k] = this->nodeX[k] - center(0);
+        this->floatSources.y[k] = this->nodeY[k] - center(1);
+        this->floatSources.z[k] = this->nodeZ[k] - center(2);
+        this->floatSources.m[k] = this->nodeM[k];
+    }
+    for (int k = 0; k < this->nBodies(); ++k) {
+        this->floatSources.x[nNodes + k] = this->bodyX[k] - center(0);
+        this->floatSources.y[nNodes + k] = this->bodyY[k] - center(1);
+        this->floatSources.z[nNodes + k] = this->bodyZ[k] - center(2);
+        this->floatSources.m[nNodes + k] = this->bodyM[k];
+    }
+}
+
+
+/* struct LocalExpansion */
+
+void LocalExpansion::setZero() {
+    this->phi = 0;
+    this->g.setZero();
+    this->T.setZero();
+    for (int i = 0; i < 3; ++i) {
+        this->S[i].setZero();
+    }
+}
+
+
+Eigen::Vector3d LocalExpansion::evaluate(const Eigen::Vector3d& d, int order) const {
+    Eigen::Vector3d result = this->g;
+    if (order >= 1) {
+        result += this->T*d;
+    }
+    if (order >= 2) {
+        for (int i = 0; i < 3; ++i) {
+            result(i) += 0.5*d.dot(this->S[i]*d);
+        }
+    }
+    return result;
+}
+
+
+double LocalExpansion::evaluatePotential(const Eigen::Vector3d& d, int order) const {
+    // Derivatives of the potential are minus those of the acceleration
+    double result = this->phi - this->g.dot(d);
+    if (order >= 1) {
+        result -= 0.5*d.dot(this->T*d);
+    }
+    if (order >= 2) {
+        for (int i = 0; i < 3; ++i) {
+            result -= d(i)*d.dot(this->S[i]*d)/6.0;
+        }
+    }
+    return result;
+}
+
+
+Eigen::Matrix3d LocalExpansion::evaluateTidalTensor(const Eigen::Vector3d& d, int order) const {
+    Eigen::Matrix3d result = Eigen::Matrix3d::Zero();
+    if (order >= 1) {
+        result -= this->T;
+    }
+    if (order >= 2) {
+        for (int i = 0; i < 3; ++i) {
+            result.row(i) -= (this->S[i]*d).transpose();
+        }
+    }
+    return result;
+}
+
+
+void LocalExpansion::shiftTo(LocalExpansion& other, const Eigen::Vector3d& d, int order) const {
+    // Taylor series of each term about the new center
+    other.phi += this->evaluatePotential(d, order);
+    other.g += this->evaluate(d, order);
+    if (order >= 1) {
+        other.T += this->T;
+    }
+    if (order >= 2) {
+        for (int i = 0; i < 3; ++i) {
+            other.T.row(i) += (this->S[i]*d).transpose();
+            other.S[i] += this->S[i];
+        }
+    }
+}
+
+
+/* struct NewtonianGravity */
+
+NewtonianGravity::NewtonianGravity(double softening, unit_t l, unit_t m, unit_t t)
+: G(6.67430e-11/l/l/l*m*t*t)
+, softening(softening) {}
+
+
+void NewtonianGravity::listAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                        const int* bodies,
+                                        int nBodies,
+                                        const InteractionList& list,
+                                        const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                        int expansionOrder,
+                                        bool mixedPrecision) const {
+    // Monopoles and bodies go through the batch kernel. Only the quadrupole correction needs its own loop.
+    double softening2 = softening*softening;
+    SourceBlock nodeSources = list.nodeSources();
+    SourceBlock bodySources = list.bodySources();
+    const int nNodes = list.nNodes();
+
+    for (int k = 0; k < nBodies; ++k) {
+        int i = bodies[k];
+        if (mixedPrecision) {
+            gravitationalBatchMixed(a.col(i), x.col(i) - list.floatCenter, list.floatSources.block(0, nNodes + list.nBodies()), G, softening2);
+        } else {
+            gravitationalBatch(a.col(i), x.col(i), nodeSources, G, softening2);
+            gravitationalBatch(a.col(i), x.col(i), bodySources, G, softening2);
+        }
+        if (expansionOrder < 2) continue;
+
+        double xi = x(0, i), yi = x(1, i), zi = x(2, i);
+        double ax = 0, ay = 0, az = 0;
+        for (int l = 0; l < nNodes; ++l) {
+            // r points from the center of mass of the node to i
+            double dx = xi - list.nodeX[l];
+            double dy = yi - list.nodeY[l];
+            double dz = zi - list.nodeZ[l];
+            double invR2 = 1.0/(dx*dx + dy*dy + dz*dz + softening2);
+            double invR5 = invR2*invR2*std::sqrt(invR2);
+            double qx = list.qxx[l]*dx + list.qxy[l]*dy + list.qxz[l]*dz;
+            double qy = list.qxy[l]*dx + list.qyy[l]*dy + list.qyz[l]*dz;
+            double qz = list.qxz[l]*dx + list.qyz[l]*dy + list.qzz[l]*dz;
+            double rQr = dx*qx + dy*qy + dz*qz;
+            ax += invR5*(qx - 2.5*rQr*invR2*dx);
+            ay += invR5*(qy - 2.5*rQr*invR2*dy);
+            az += invR5*(qz - 2.5*rQr*invR2*dz);
+        }
+        a.col(i) += G*Eigen::Vector3d(ax, ay, az);
+    }
+}
+
+
+void NewtonianGravity::multipoleToLocal(LocalExpansion& local,
+                                        const LinearOctreeNode& target,
+                                        const LinearOctreeNode& source,
+                                        int order) const {
+    // The source potential is -G*(M*D + Q_jk*D_jk/6), where D_ij... are derivatives of the
+    // softened 1/|r| with r pointing from the source to the target. With s^2 = |r|^2 + softening^2,
+    // D_i = a1*r_i, D_ij = a2*r_i*r_j + a1*delta_ij, ... where a_n = (-1)^n*(2n - 1)!!/s^(2n + 1).
+    order = std::min(order, 2);
+    Eigen::Vector3d r = target.centerOfMass - source.centerOfMass;
+    double invS2 = 1.0/(r.squaredNorm() + softening*softening);
+    double a1 = -invS2*std::sqrt(invS2);
+    double a2 = -3.0*a1*invS2;
+    double a3 = -5.0*a2*invS2;
+    double a4 = -7.0*a3*invS2;
+    double a5 = -9.0*a4*invS2;
+
+    double M = source.totalMass;
+    bool withQuadrupole = order >= 2;
+    Eigen::Vector3d q = withQuadrupole ? Eigen::Vector3d(source.quadrupole*r) : Eigen::Vector3d::Zero();
+    double w = r.dot(q);
+
+    // Potential, unsoftened like pairPotentialEnergy() and multipolePotentialEnergy()
+    double invR2 = 1.0/r.squaredNorm();
+    double invR = std::sqrt(invR2);
+    double phi = M*invR;
+    if (withQuadrupole) {
+        phi += 0.5*w*invR2*invR2*invR;
+    }
+    local.phi -= G*phi;
+
+    // Acceleration
+    Eigen::Vector3d g = M*a1*r;
+    if (withQuadrupole) {
+        g += (a3*w*r + 2.0*a2*q)/6.0;
+    }
+    local.g += G*g;
+    if (order < 1) return;
+
+    // First derivatives
+    Eigen::Matrix3d I = Eigen::Matrix3d::Identity();
+    Eigen::Matrix3d rr = r*r.transpose();
+    Eigen::Matrix3d qr = q*r.transpose();
+    Eigen::Matrix3d T = M*(a2*rr + a1*I);
+    if (withQuadrupole) {
+        T += (a4*w*rr + a3*(w*I + 2.0*(qr + qr.transpose())) + 2.0*a2*source.quadrupole)/6.0;
+    }
+    local.T += G*T;
+    if (order < 2) return;
+
+    // Second derivatives
+    for (int i = 0; i < 3; ++i) {
+        Eigen::Vector3d e = I.col(i);
+        Eigen::Matrix3d er = e*r.transpose() + r*e.transpose() + r(i)*I;
+        Eigen::Matrix3d eq = e*q.transpose() + q*e.transpose() + q(i)*I;
+        Eigen::Vector3d Qi = source.quadrupole.col(i);
+        Eigen::Matrix3d Qr = r(i)*source.quadrupole + Qi*r.transpose() + r*Qi.transpose();
+
+        Eigen::Matrix3d S = M*(a3*r(i)*rr + a2*er);
+        S += (a5*w*r(i)*rr + a4*(w*er + 2.0*(q(i)*rr + r(i)*(qr + qr.transpose()))) + 2.0*a3*(eq + Qr))/6.0;
+        local.S[i] += G*S;
+    }
+}
+
+
+void NewtonianGravity::symmetricTileAcceleration(Eigen::Ref<Eigen::Matrix3Xd> a,
+                                                 const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                                 const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                                 int iBegin, int iEnd, int jBegin, int jEnd) const {
+    // One inverse cube per pair, scaled by the mass of the other body for each side
+    double softening2 = softening*softening;
+    for (int i = iBegin; i < iEnd; ++i) {
+        double xi = x(0, i), yi = x(1, i), zi = x(2, i);
+        double mi = G*m(i);
+        double ax = 0, ay = 0, az = 0;
+        for (int j = std::max(jBegin, i + 1); j < jEnd; ++j) {
+            double dx = x(0, j) - xi;
+            double dy = x(1, j) - yi;
+            double dz = x(2, j) - zi;
+            double r2 = dx*dx + dy*dy + dz*dz + softening2;
+            double invR3 = 1.0/(r2*std::sqrt(r2));
+            double mj = G*m(j)*invR3;
+            ax += mj*dx;
+            ay += mj*dy;
+            az += mj*dz;
+            a(0, j) -= mi*invR3*dx;
+            a(1, j) -= mi*invR3*dy;
+            a(2, j) -= mi*invR3*dz;
+        }
+        a(0, i) += ax;
+        a(1, i) += ay;
+        a(2, i) += az;
+    }
+}
+
+
+void NewtonianGravity::batchAccelerationOutputs(Eigen::Ref<Eigen::Vector3d> a_i,
+                                                double* phi_i,
+                                                Eigen::Matrix3d* T_i,
+                                                const Eigen::Vector3d& x_i,
+                                                double m_i,
+                                                const SourceBlock& sources) const {
+    // The potential is unsoftened like pairPotentialEnergy(), so it only shares the inverse distance without softening
+    double softening2 = softening*softening;
+    double xi = x_i(0), yi = x_i(1), zi = x_i(2);
+    double ax = 0, ay = 0, az = 0, phi = 0;
+    double txx = 0, txy = 0, txz = 0, tyy = 0, tyz = 0, tzz = 0;
+    for (int j = 0; j < sources.n; ++j) {
+        double dx = sources.x[j] - xi;
+        double dy = sources.y[j] - yi;
+        double dz = sources.z[j] - zi;
+        double d2 = dx*dx + dy*dy + dz*dz;
+        if (d2 == 0) continue;
+        double invR2 = 1.0/(d2 + softening2);
+        double invR = std::sqrt(invR2);
+        double mj = G*sources.m[j];
+        double mjInvR3 = mj*invR2*invR;
+        ax += mjInvR3*dx;
+        ay += mjInvR3*dy;
+        az += mjInvR3*dz;
+        if (phi_i) phi -= mj*(softening2 == 0 ? invR : 1.0/std::sqrt(d2));
+        if (T_i) {
+            // G*m_j/r^3*(I - 3*r*r^T/r^2)
+            double s = 3.0*invR2;
+            txx += mjInvR3*(1 - s*dx*dx);
+            tyy += mjInvR3*(1 - s*dy*dy);
+            tzz += mjInvR3*(1 - s*dz*dz);
+            txy -= mjInvR3*s*dx*dy;
+            txz -= mjInvR3*s*dx*dz;
+            tyz -= mjInvR3*s*dy*dz;
+        }
+    }
+    a_i += Eigen::Vector3d(ax, ay, az);
+    if (phi_i) *phi_i += phi;
+    if (T_i) {
+        Eigen::Matrix3d T;
+        T << txx, txy, txz,
+             txy, tyy, tyz,
+             txz, tyz, tzz;
+        *T_i += T;
+    }
+}
+
+
+/* struct SplineGravity */
+
+SplineGravity::SplineGravity(double h, unit_t l, unit_t m, unit_t t)
+: G(6.67430e-11/l/l/l*m*t*t)
+, h(h) {}
+
+
+double SplineGravity::pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                                          const Eigen::Vector3d& x_j,
+                                          double m_i, double m_j) const {
+    double r = (x_j - x_i).norm();
+    if (r >= h) {
+        return -G*m_j*m_i/2.0/r;
+    }
+
+    // Kernel potential in units of 1/h. Equals -1 at u = 1.
+    double u = r/h;
+    double w;
+    if (u < 0.5) {
+        w = -2.8 + u*u*(16.0/3.0 + u*u*(6.4*u - 9.6));
+    } else {
+        w = -3.2 + 1.0/15.0/u + u*u*(32.0/3.0 + u*(-16.0 + u*(9.6 - 32.0/15.0*u)));
+    }
+    return G*m_j*m_i/2.0*w/h;
+}
+
+
+/* struct LennardJones */
+
+LennardJones::LennardJones(double epsilon, double sigma, double cutoff)
+: epsilon(epsilon)
+, sigma(sigma)
+, cutoff(cutoff) {}
+
+
+double LennardJones::pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                                         const Eigen::Vector3d& x_j,
+                                         double m_i, double m_j) const {
+    double r2 = (x_j - x_i).squaredNorm();
+    if (r2 > cutoff*cutoff) return 0;
+    double s6 = sigma*sigma/r2;
+    s6 = s6*s6*s6;
+    return 4.0*epsilon*(s6*s6 - s6)/2.0;
+}
+
+
+/* struct Coulomb */
+
+Coulomb::Coulomb(double chargeToMass, double softening, unit_t l, unit_t m, unit_t t)
+: k(8.9875517923e9/l/l/l*m*t*t)
+, chargeToMass(chargeToMass)
+, softening(softening) {}
@@ -1,24 +1,401 @@
 #include "integrator.hpp"
+#include "dynamics_engine.hpp"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+/* class Integrator */
+
+void Integrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                      Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                      const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    engine.updateAccelerations(a, x, m);
+    this->integrate(dt, a, v, x);
+}
+
+
+// Integrators update each coefficient of a 3xN matrix on its own. Matrices without padding between
+// columns are viewed as one vector of 3N coefficients, so Eigen vectorizes across columns instead of
+// within each 3-row column. Update expressions are templates instantiated for both views.
+static bool isContiguous(const Eigen::Ref<const Eigen::Matrix3Xd>& mat) {
+    return mat.outerStride() == 3 || mat.cols() <= 1;
+}
+
+static Eigen::Map<Eigen::VectorXd> flat(Eigen::Ref<Eigen::Matrix3Xd> mat) {
+    return Eigen::Map<Eigen::VectorXd>(mat.data(), mat.size());
+}
+
+static Eigen::Map<const Eigen::VectorXd> flatConst(const Eigen::Ref<const Eigen::Matrix3Xd>& mat) {
+    return Eigen::Map<const Eigen::VectorXd>(mat.data(), mat.size());
+}
+
 
 /* class EulerIntegrator */
 
-void EulerIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::MatrixXd>& a,
-                                Eigen::Ref<Eigen::MatrixXd> v, Eigen::Ref<Eigen::MatrixXd> x) {
+template <typename ConstMatrix, typename Matrix>
+static void eulerUpdate(double dt, const ConstMatrix& a, Matrix v, Matrix x) {
     x += v*dt;
     v += a*dt;
 }
 
 
+void EulerIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    if (isContiguous(a) && isContiguous(v) && isContiguous(x)) {
+        eulerUpdate(dt, flatConst(a), flat(v), flat(x));
+    } else {
+        eulerUpdate(dt, a, v, x);
+    }
+}
+
+
 /* class VerletIntegrator */
 
-void VerletIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::MatrixXd>& a,
-                                Eigen::Ref<Eigen::MatrixXd> v, Eigen::Ref<Eigen::MatrixXd> x) {
-    if (!this->isFirstIteration) {
-        v = v + 0.5*(aPrev + a)*dt;
+template <typename ConstMatrix, typename Matrix>
+static void verletUpdate(double dt, bool isFirstIteration, const ConstMatrix& a, const ConstMatrix& aPrev, Matrix v, Matrix x) {
+    if (!isFirstIteration) {
+        v += 0.5*(aPrev + a)*dt;
+    }
+    x += v*dt + 0.5*a*dt*dt;
+}
+
+
+void VerletIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    if (isContiguous(a) && isContiguous(v) && isContiguous(x)) {
+        verletUpdate(dt, this->isFirstIteration, flatConst(a), flatConst(this->aPrev), flat(v), flat(x));
     } else {
-        this->isFirstIteration = false;
+        verletUpdate(dt, this->isFirstIteration, a, Eigen::Ref<const Eigen::Matrix3Xd>(this->aPrev), v, x);
     }
-    
-    x = x + v*dt + 0.5*a*dt*dt;
-    aPrev = a;
+    this->isFirstIteration = false;
+    this->aPrev = a;
+}
+
+
+/* class LeapfrogIntegrator */
+
+// Bodies per work unit of the fused loops
+static const int leapfrogChunkSize = 4096;
+
+// Kicks velocities by kick*a and drifts positions by dt*v for bodies begin to end, reading each column once
+static void kickDrift(double kick, double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                      Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x, int begin, int end) {
+    for (int i = begin; i < end; ++i) {
+        v.col(i) += kick*a.col(i);
+        x.col(i) += dt*v.col(i);
+    }
+}
+
+
+// Runs kickDrift over every body in chunks on the engine's threads
+static void parallelKickDrift(DynamicsEngine& engine, double kick, double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                              Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    int n = x.cols();
+    engine.threadPool.parallelFor((n + leapfrogChunkSize - 1)/leapfrogChunkSize, [&](int chunkIdx, unsigned threadIdx) {
+        kickDrift(kick, dt, a, v, x, chunkIdx*leapfrogChunkSize, std::min(n, (chunkIdx + 1)*leapfrogChunkSize));
+    });
+}
+
+
+// Kicks velocities by kick*a in chunks on the engine's threads
+static void parallelKick(DynamicsEngine& engine, double kick, const Eigen::Ref<const Eigen::Matrix3Xd>& a, Eigen::Ref<Eigen::Matrix3Xd> v) {
+    int n = v.cols();
+    engine.threadPool.parallelFor((n + leapfrogChunkSize - 1)/leapfrogChunkSize, [&](int chunkIdx, unsigned threadIdx) {
+        int begin = chunkIdx*leapfrogChunkSize;
+        int end = std::min(n, begin + leapfrogChunkSize);
+        v.middleCols(begin, end - begin) += kick*a.middleCols(begin, end - begin);
+    });
+}
+
+
+void LeapfrogIntegrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                              Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                              const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Accelerations of the last step are at the current positions unless bodies were added since
+    if (!this->accelerationsValid) {
+        engine.updateAccelerations(a, x, m);
+        this->accelerationsValid = true;
+    }
+
+    // Opening half kick, merged with the last closing one if it was deferred, then drift
+    double kick = this->velocitiesLag ? dt : dt/2;
+    parallelKickDrift(engine, kick, dt, a, v, x);
+
+    engine.updateAccelerations(a, x, m);
+
+    // Closing half kick
+    this->velocitiesLag = !this->synchronizeVelocities;
+    if (this->synchronizeVelocities) {
+        parallelKick(engine, dt/2, a, v);
+    }
+}
+
+
+void LeapfrogIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                   Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    double kick = this->velocitiesLag ? dt : dt/2;
+    kickDrift(kick, dt, a, v, x, 0, x.cols());
+    this->velocitiesLag = true;
+}
+
+
+/* class HermiteIntegrator */
+
+void HermiteIntegrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                             Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                             const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Forces of the last step's predicted state only carry over if no bodies were added since
+    if (!this->accelerationsValid || this->jerk.cols() != x.cols()) {
+        this->jerk.resize(3, x.cols());
+        engine.updateAccelerationsAndJerks(a, this->jerk, x, v, m);
+        this->accelerationsValid = true;
+    }
+    this->a0 = a;
+    this->j0 = this->jerk;
+    this->x0 = x;
+    this->v0 = v;
+
+    // Predict with the Taylor series of the start of the step
+    x += v*dt + a*(dt*dt/2) + this->jerk*(dt*dt*dt/6);
+    v += a*dt + this->jerk*(dt*dt/2);
+
+    // Evaluate at the predicted state and correct
+    engine.updateAccelerationsAndJerks(a, this->jerk, x, v, m);
+    v = this->v0 + (this->a0 + a)*(dt/2) + (this->j0 - this->jerk)*(dt*dt/12);
+    x = this->x0 + (this->v0 + v)*(dt/2) + (this->a0 - a)*(dt*dt/12);
+}
+
+
+void HermiteIntegrator::removeBody(int idx, int lastIdx) {
+    Integrator::removeBody(idx, lastIdx);
+
+    // Jerks not computed for every body yet are left to the evaluation in step()
+    if (lastIdx != this->jerk.cols() - 1) return;
+    this->jerk.col(idx) = this->jerk.col(lastIdx);
+    this->jerk.conservativeResize(3, lastIdx);
+}
+
+
+void HermiteIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                  Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    throw std::logic_error("Error: HermiteIntegrator needs forces at the predicted state, use step().");
+}
+
+
+/* class RungeKuttaIntegrator */
+
+void RungeKuttaIntegrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                                Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                                const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Accelerations of the last step are at the current positions unless bodies were added since
+    if (!this->accelerationsValid) {
+        engine.updateAccelerations(a, x, m);
+        this->accelerationsValid = true;
+    }
+
+    // First stage is the current state. Buffers keep their size between steps, so assignments do not reallocate.
+    this->kx = v;
+    this->kv = a;
+    this->xSlope = this->kx;
+    this->vSlope = this->kv;
+
+    // Each later stage starts from the current state along the slopes of the one before
+    const double h[3] = {dt/2, dt/2, dt};
+    const double weight[3] = {2, 2, 1};
+    for (int stage = 0; stage < 3; ++stage) {
+        this->xStage = x + h[stage]*this->kx;
+        this->kx = v + h[stage]*this->kv;
+        engine.updateAccelerations(this->kv, this->xStage, m);
+        this->xSlope += weight[stage]*this->kx;
+        this->vSlope += weight[stage]*this->kv;
+    }
+
+    x += (dt/6)*this->xSlope;
+    v += (dt/6)*this->vSlope;
+    engine.updateAccelerations(a, x, m);
+}
+
+
+void RungeKuttaIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                     Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    throw std::logic_error("Error: RungeKuttaIntegrator needs forces at trial states, use step().");
+}
+
+
+/* class YoshidaIntegrator */
+
+YoshidaIntegrator::YoshidaIntegrator(int order)
+: order(order) {
+    if (order == 4) {
+        // Triple jump
+        double w1 = 1/(2 - std::cbrt(2.0));
+        double w0 = 1 - 2*w1;
+        this->weights = {w1, w0, w1};
+    } else if (order == 6) {
+        // Solution A of Yoshida (1990)
+        double w1 = -1.17767998417887, w2 = 0.235573213359357, w3 = 0.784513610477560;
+        double w0 = 1 - 2*(w1 + w2 + w3);
+        this->weights = {w3, w2, w1, w0, w1, w2, w3};
+    } else {
+        throw std::invalid_argument("Error: YoshidaIntegrator order must be 4 or 6.");
+    }
+}
+
+
+void YoshidaIntegrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                             Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                             const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Accelerations of the last step are at the current positions unless bodies were added since
+    if (!this->accelerationsValid) {
+        engine.updateAccelerations(a, x, m);
+        this->accelerationsValid = true;
+    }
+
+    // Closing half kick of each substep is merged with the opening half kick of the next
+    double kick = 0;
+    for (double w : this->weights) {
+        double h = w*dt;
+        parallelKickDrift(engine, kick + h/2, h, a, v, x);
+        engine.updateAccelerations(a, x, m);
+        kick = h/2;
+    }
+    parallelKick(engine, kick, a, v);
+}
+
+
+void YoshidaIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                  Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    throw std::logic_error("Error: YoshidaIntegrator needs forces after every substep, use step().");
+}
+
+
+/* class AdamsBashforthMoultonIntegrator */
+
+// Weights of the Lagrange polynomials through nodes firstNode, firstNode - 1, ... (in units of the step, relative to t_n),
+// integrated over the step. velocityWeights[j] = integral of L_j, positionWeights[j] = integral of (1 - s)*L_j.
+static void adamsWeights(int nNodes, int firstNode, std::vector<double>& velocityWeights, std::vector<double>& positionWeights) {
+    velocityWeights.assign(nNodes, 0);
+    positionWeights.assign(nNodes, 0);
+    for (int j = 0; j < nNodes; ++j) {
+        // Coefficients of L_j(s) in increasing powers of s
+        std::vector<double> poly = {1};
+        for (int i = 0; i < nNodes; ++i) {
+            if (i == j) continue;
+            double s_i = firstNode - i, s_j = firstNode - j;
+            std::vector<double> product(poly.size() + 1, 0);
+            for (int p = 0; p < (int)poly.size(); ++p) {
+                product[p + 1] += poly[p]/(s_j - s_i);
+                product[p] -= poly[p]*s_i/(s_j - s_i);
+            }
+            poly = product;
+        }
+        for (int p = 0; p < (int)poly.size(); ++p) {
+            velocityWeights[j] += poly[p]/(p + 1);
+            positionWeights[j] += poly[p]/((p + 1)*(p + 2));
+        }
+    }
+}
+
+
+AdamsBashforthMoultonIntegrator::AdamsBashforthMoultonIntegrator(int order)
+: order(order) {
+    if (order < 2 || order > 8) {
+        throw std::invalid_argument("Error: AdamsBashforthMoultonIntegrator order must be between 2 and 8.");
+    }
+    this->history.resize(order);
+    adamsWeights(order, 0, this->predictV, this->predictX);
+    adamsWeights(order, 1, this->correctV, this->correctX);
+}
+
+
+const Eigen::Matrix3Xd& AdamsBashforthMoultonIntegrator::past(int back) const {
+    return this->history[(this->newest - back + this->order) % this->order];
+}
+
+
+void AdamsBashforthMoultonIntegrator::step(double dt, DynamicsEngine& engine, Eigen::Ref<Eigen::Matrix3Xd> a,
+                                           Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x,
+                                           const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    int n = x.cols();
+
+    // Bodies were added, steps were taken without the history or the integrator is new,
+    // so the history starts over from the current positions
+    if (n != this->nBodies || !this->accelerationsValid) {
+        engine.updateAccelerations(a, x, m);
+        this->nBodies = n;
+        this->newest = 0;
+        this->history[0] = a;
+        this->nHistory = 1;
+        this->starter.accelerationsValid = true;
+        this->accelerationsValid = true;
+    }
+
+    // Startup steps fill the history with a self-starting integrator of high order
+    if (this->nHistory < this->order) {
+        for (int s = 0; s < this->startupSubsteps; ++s) {
+            this->starter.step(dt/this->startupSubsteps, engine, a, v, x, m);
+        }
+        this->newest = (this->newest + 1) % this->order;
+        this->history[this->newest] = a;
+        this->nHistory++;
+        return;
+    }
+
+    // Predict in chunks on the engine's threads, summing the history of each chunk while it is in cache
+    int nChunks = (n + leapfrogChunkSize - 1)/leapfrogChunkSize;
+    this->x0.resize(3, n);
+    this->v0.resize(3, n);
+    engine.threadPool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        int begin = chunkIdx*leapfrogChunkSize;
+        int size = std::min(n, begin + leapfrogChunkSize) - begin;
+        this->x0.middleCols(begin, size) = x.middleCols(begin, size);
+        this->v0.middleCols(begin, size) = v.middleCols(begin, size);
+        x.middleCols(begin, size) += dt*v.middleCols(begin, size);
+        for (int j = 0; j < this->order; ++j) {
+            x.middleCols(begin, size) += (dt*dt*this->predictX[j])*this->past(j).middleCols(begin, size);
+            v.middleCols(begin, size) += (dt*this->predictV[j])*this->past(j).middleCols(begin, size);
+        }
+    });
+
+    // Evaluate into the slot of the oldest accelerations, which the corrector no longer needs
+    this->newest = (this->newest + 1) % this->order;
+    engine.updateAccelerations(this->history[this->newest], x, m);
+
+    // Correct from the start of the step
+    engine.threadPool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        int begin = chunkIdx*leapfrogChunkSize;
+        int size = std::min(n, begin + leapfrogChunkSize) - begin;
+        x.middleCols(begin, size) = this->x0.middleCols(begin, size) + dt*this->v0.middleCols(begin, size);
+        v.middleCols(begin, size) = this->v0.middleCols(begin, size);
+        for (int j = 0; j < this->order; ++j) {
+            x.middleCols(begin, size) += (dt*dt*this->correctX[j])*this->past(j).middleCols(begin, size);
+            v.middleCols(begin, size) += (dt*this->correctV[j])*this->past(j).middleCols(begin, size);
+        }
+        a.middleCols(begin, size) = this->past(0).middleCols(begin, size);
+    });
+}
+
+
+void AdamsBashforthMoultonIntegrator::addBody(int idx) {
+    Integrator::addBody(idx);
+    this->nBodies = -1;
+}
+
+
+void AdamsBashforthMoultonIntegrator::removeBody(int idx, int lastIdx) {
+    // Bodies the history does not cover are left to the restart in step()
+    if (lastIdx != this->nBodies - 1) return;
+    for (int k = 0; k < this->nHistory; ++k) {
+        Eigen::Matrix3Xd& h = this->history[(this->newest - k + this->order) % this->order];
+        h.col(idx) = h.col(lastIdx);
+        h.conservativeResize(3, lastIdx);
+    }
+    this->nBodies--;
+}
+
+
+void AdamsBashforthMoultonIntegrator::integrate(double dt, const Eigen::Ref<const Eigen::Matrix3Xd>& a,
+                                                Eigen::Ref<Eigen::Matrix3Xd> v, Eigen::Ref<Eigen::Matrix3Xd> x) {
+    throw std::logic_error("Error: AdamsBashforthMoultonIntegrator needs forces at the predicted state, use step().");
 }
@@ -0,0 +1,403 @@
+#include "linear_octree.hpp"
+#include "octree.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+
+/* Utility Functions */
+
+uint64_t spreadBits(uint64_t v) {
+    // Inserts two zero bits between each of the lower 21 bits of v
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffff;
+    v = (v | v << 16) & 0x1f0000ff0000ff;
+    v = (v | v <<  8) & 0x100f00f00f00f00f;
+    v = (v | v <<  4) & 0x10c30c30c30c30c3;
+    v = (v | v <<  2) & 0x1249249249249249;
+    return v;
+}
+
+uint64_t mortonKey(uint64_t xq, uint64_t yq, uint64_t zq) {
+    // Interleaves quantized coordinates so that each 3 bit digit
+    // is an octant index in the order (z y x) used by OctreeNode::children
+    return spreadBits(xq) | spreadBits(yq) << 1 | spreadBits(zq) << 2;
+}
+
+int octantDigit(uint64_t key, int level) {
+    // Returns the octant of key's cell at depth level + 1 within its cell at depth level
+    return (key >> 3*(LINEAR_OCTREE_MAX_DEPTH - 1 - level)) & 7;
+}
+
+void computeLeafMoments(LinearOctreeNode& node, const std::vector<int>& order,
+                        const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                        const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                        int expansionOrder) {
+    // Sums mass and mass-weighted positions of the bodies in a leaf
+    node.totalMass = 0;
+    node.centerOfMass.setZero();
+    for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+        node.totalMass += m(order[k]);
+        node.centerOfMass += m(order[k])*x.col(order[k]);
+    }
+    if (node.totalMass > 0) {
+        node.centerOfMass /= node.totalMass;
+    } else {
+        // Massless leaves are centered on the mean position of their bodies
+        for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+            node.centerOfMass += x.col(order[k]);
+        }
+        node.centerOfMass /= node.nBodies;
+    }
+
+    if (expansionOrder >= 2) {
+        node.quadrupole.setZero();
+        for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+            node.quadrupole += pointQuadrupole(m(order[k]), x.col(order[k]) - node.centerOfMass);
+        }
+    }
+}
+
+void computeInternalMoments(LinearOctreeNode* node, int expansionOrder) {
+    // Combines the moments of a node's children
+    const LinearOctreeNode* children = node + node->childOffset;
+    node->totalMass = 0;
+    node->centerOfMass.setZero();
+    for (int k = 0; k < node->nChildren; ++k) {
+        node->totalMass += children[k].totalMass;
+        node->centerOfMass += children[k].totalMass*children[k].centerOfMass;
+    }
+    if (node->totalMass > 0) {
+        node->centerOfMass /= node->totalMass;
+    } else {
+        // Children of a massless node are massless too, so their centers are mean body positions
+        for (int k = 0; k < node->nChildren; ++k) {
+            node->centerOfMass += children[k].nBodies*children[k].centerOfMass;
+        }
+        node->centerOfMass /= node->nBodies;
+    }
+
+    if (expansionOrder >= 2) {
+        // Shift each child's moment to this node's center of mass
+        node->quadrupole.setZero();
+        for (int k = 0; k < node->nChildren; ++k) {
+            node->quadrupole += children[k].quadrupole +
+                                pointQuadrupole(children[k].totalMass, children[k].centerOfMass - node->centerOfMass);
+        }
+    }
+}
+
+
+/* LinearOctree method implementations */
+
+void LinearOctree::sortKeys(ThreadPool& pool) {
+    int n = this->keys.size();
+    int nRuns = std::min<int>(pool.nThreads, std::max(1, n/1024));
+    if (nRuns == 1) {
+        std::sort(this->keys.begin(), this->keys.end());
+        return;
+    }
+
+    // Sort one run per thread
+    std::vector<int> runBounds(nRuns + 1);
+    for (int i = 0; i <= nRuns; ++i) {
+        runBounds[i] = (int64_t)n*i/nRuns;
+    }
+    pool.parallelFor(nRuns, [&](int runIdx, unsigned threadIdx) {
+        std::sort(this->keys.begin() + runBounds[runIdx], this->keys.begin() + runBounds[runIdx + 1]);
+    });
+
+    // Merge neighbouring runs pairwise until one run is left
+    this->sortBuffer.resize(n);
+    for (int width = 1; width < nRuns; width *= 2) {
+        int nMerges = (nRuns + 2*width - 1)/(2*width);
+        pool.parallelFor(nMerges, [&](int mergeIdx, unsigned threadIdx) {
+            int begin = runBounds[std::min(nRuns, 2*width*mergeIdx)];
+            int mid   = runBounds[std::min(nRuns, 2*width*mergeIdx + width)];
+            int end   = runBounds[std::min(nRuns, 2*width*mergeIdx + 2*width)];
+            std::merge(this->keys.begin() + begin, this->keys.begin() + mid,
+                       this->keys.begin() + mid,   this->keys.begin() + end,
+                       this->sortBuffer.begin() + begin);
+        });
+        this->keys.swap(this->sortBuffer);
+    }
+}
+
+
+int LinearOctree::buildSubtree(std::vector<LinearOctreeNode>& out, int nodeIdx, int level, int stopLevel,
+                               std::vector<int>* frontier,
+                               const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                               const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    // Copy the node, since appending children to out may reallocate it
+    LinearOctreeNode node = out[nodeIdx];
+
+    if (node.nBodies <= this->leafCapacity || level >= std::min(this->maxDepth, LINEAR_OCTREE_MAX_DEPTH)) {
+        // Node is external
+        node.isExternal = true;
+        node.childOffset = 0;
+        node.nChildren = 0;
+        computeLeafMoments(node, this->order, x, m, this->expansionOrder);
+        out[nodeIdx] = node;
+        return 0;
+    }
+
+    if (level == stopLevel) {
+        // Subtree below this node is built later by another thread
+        frontier->push_back(nodeIdx);
+        return 0;
+    }
+
+    // Bodies are sorted by key, so each non-empty octant is a contiguous range of keys
+    double xMid = (node.xMin + node.xMax)/2.0;
+    double yMid = (node.yMin + node.yMax)/2.0;
+    double zMid = (node.zMin + node.zMax)/2.0;
+
+    node.isExternal = false;
+    node.childOffset = out.size() - nodeIdx;
+    node.nChildren = 0;
+
+    int begin = node.bodyBegin;
+    int end = node.bodyBegin + node.nBodies;
+    while (begin < end) {
+        // Find the end of the current octant
+        int octant = octantDigit(this->keys[begin].first, level);
+        int octantEnd = std::partition_point(this->keys.begin() + begin, this->keys.begin() + end,
+                                             [&](const std::pair<uint64_t, int>& key) {
+                                                 return octantDigit(key.first, level) <= octant;
+                                             }) - this->keys.begin();
+
+        // Construct child
+        LinearOctreeNode child;
+        child.xMin = (octant & 1) ? xMid : node.xMin;
+        child.xMax = (octant & 1) ? node.xMax : xMid;
+        child.yMin = (octant & 2) ? yMid : node.yMin;
+        child.yMax = (octant & 2) ? node.yMax : yMid;
+        child.zMin = (octant & 4) ? zMid : node.zMin;
+        child.zMax = (octant & 4) ? node.zMax : zMid;
+        child.cellWidth = node.cellWidth/2.0;
+        child.size = child.cellWidth;
+        child.bodyBegin = begin;
+        child.nBodies = octantEnd - begin;
+        out.push_back(child);
+
+        node.nChildren++;
+        begin = octantEnd;
+    }
+    out[nodeIdx] = node;
+
+    // Recursively build children
+    int subtreeDepth = 0;
+    int firstChild = nodeIdx + node.childOffset;
+    for (int k = 0; k < node.nChildren; ++k) {
+        subtreeDepth = std::max(subtreeDepth, 1 + this->buildSubtree(out, firstChild + k, level + 1, stopLevel, frontier, x, m));
+    }
+
+    // Moments of the top levels are computed once the frontier subtrees exist
+    if (frontier == nullptr) {
+        computeInternalMoments(&out[nodeIdx], this->expansionOrder);
+    }
+    return subtreeDepth;
+}
+
+
+void LinearOctree::build(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                         const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                         ThreadPool& pool) {
+    int n = x.cols();
+    this->nodes.clear();
+    this->subtreeRoots.clear();
+    this->subtreeBegins.clear();
+    this->nTopNodes = 0;
+    this->depth = 0;
+    if (n == 0) return;
+
+    // Static chunks of bodies for element-wise phases
+    int nChunks = pool.nThreads;
+    auto chunkBegin = [&](int chunkIdx) { return (int)((int64_t)n*chunkIdx/nChunks); };
+
+    // Get root bounds
+    Eigen::Matrix3Xd chunkMin(3, nChunks), chunkMax(3, nChunks);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        int begin = chunkBegin(chunkIdx);
+        int end = chunkBegin(chunkIdx + 1);
+        if (begin == end) {
+            chunkMin.col(chunkIdx) = x.col(0);
+            chunkMax.col(chunkIdx) = x.col(0);
+        } else {
+            chunkMin.col(chunkIdx) = x.middleCols(begin, end - begin).rowwise().minCoeff();
+            chunkMax.col(chunkIdx) = x.middleCols(begin, end - begin).rowwise().maxCoeff();
+        }
+    });
+    Eigen::Vector3d minPos = chunkMin.rowwise().minCoeff();
+    Eigen::Vector3d maxPos = chunkMax.rowwise().maxCoeff();
+    double rootWidth = (maxPos - minPos).maxCoeff();
+    if (rootWidth == 0) rootWidth = 1;
+
+    // Compute Morton keys
+    const double nCells = (double)(1 << LINEAR_OCTREE_MAX_DEPTH);
+    const double scale = nCells/rootWidth;
+    this->keys.resize(n);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int i = chunkBegin(chunkIdx); i < chunkBegin(chunkIdx + 1); ++i) {
+            uint64_t q[3];
+            for (int dim = 0; dim < 3; ++dim) {
+                double cell = std::floor((x(dim, i) - minPos(dim))*scale);
+                q[dim] = (uint64_t)std::min(std::max(cell, 0.0), nCells - 1);
+            }
+            this->keys[i] = {mortonKey(q[0], q[1], q[2]), i};
+        }
+    });
+
+    // Sort bodies along the Morton curve
+    this->sortKeys(pool);
+    this->order.resize(n);
+    this->bodies.resize(n);
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int k = chunkBegin(chunkIdx); k < chunkBegin(chunkIdx + 1); ++k) {
+            this->order[k] = this->keys[k].second;
+            this->bodies.set(k, this->order[k], x, m);
+        }
+    });
+
+    // Construct root
+    LinearOctreeNode root;
+    root.xMin = minPos(0); root.xMax = minPos(0) + rootWidth;
+    root.yMin = minPos(1); root.yMax = minPos(1) + rootWidth;
+    root.zMin = minPos(2); root.zMax = minPos(2) + rootWidth;
+    root.cellWidth = rootWidth;
+    root.size = rootWidth;
+    root.bodyBegin = 0;
+    root.nBodies = n;
+    this->nodes.push_back(root);
+
+    if (pool.nThreads == 1) {
+        this->depth = this->buildSubtree(this->nodes, 0, 0, LINEAR_OCTREE_MAX_DEPTH + 1, nullptr, x, m);
+        this->nTopNodes = this->nodes.size();
+        return;
+    }
+
+    // Build the top levels serially until there are enough subtrees to keep every thread busy
+    int stopLevel = 1;
+    while ((1 << 3*stopLevel) < 8*(int)pool.nThreads && stopLevel < 4) ++stopLevel;
+    std::vector<int> frontier;
+    this->depth = this->buildSubtree(this->nodes, 0, 0, stopLevel, &frontier, x, m);
+    int nTopNodes = this->nodes.size();
+
+    // Build each frontier subtree in its own array. Element 0 is the subtree root.
+    std::vector<std::vector<LinearOctreeNode>>& subtrees = this->subtrees;
+    subtrees.resize(frontier.size());
+    std::vector<int> subtreeDepths(frontier.size());
+    pool.parallelFor(frontier.size(), [&](int subtreeIdx, unsigned threadIdx) {
+        std::vector<LinearOctreeNode>& subtree = subtrees[subtreeIdx];
+        subtree.clear();
+        subtree.push_back(this->nodes[frontier[subtreeIdx]]);
+        subtreeDepths[subtreeIdx] = stopLevel + this->buildSubtree(subtree, 0, stopLevel, LINEAR_OCTREE_MAX_DEPTH + 1, nullptr, x, m);
+    });
+
+    // Append subtrees. Child offsets are relative, so only the subtree roots need adjusting.
+    std::vector<int> bases(frontier.size() + 1, nTopNodes);
+    for (int i = 0; i < (int)frontier.size(); ++i) {
+        bases[i + 1] = bases[i] + subtrees[i].size() - 1;
+        this->depth = std::max(this->depth, subtreeDepths[i]);
+    }
+    this->nodes.resize(bases.back());
+    pool.parallelFor(frontier.size(), [&](int subtreeIdx, unsigned threadIdx) {
+        const std::vector<LinearOctreeNode>& subtree = subtrees[subtreeIdx];
+        LinearOctreeNode& subtreeRoot = this->nodes[frontier[subtreeIdx]];
+        subtreeRoot = subtree[0];
+        if (!subtreeRoot.isExternal) {
+            subtreeRoot.childOffset = bases[subtreeIdx] + subtree[0].childOffset - 1 - frontier[subtreeIdx];
+        }
+        std::copy(subtree.begin() + 1, subtree.end(), this->nodes.begin() + bases[subtreeIdx]);
+    });
+
+    // Children of top level nodes come after their parents, so a reverse sweep visits children first
+    for (int i = nTopNodes - 1; i >= 0; --i) {
+        LinearOctreeNode& node = this->nodes[i];
+        if (!node.isExternal && i + node.childOffset < nTopNodes) {
+            computeInternalMoments(&node, this->expansionOrder);
+        }
+    }
+
+    // Keep the subtree layout for refit()
+    this->subtreeRoots.swap(frontier);
+    this->subtreeBegins.swap(bases);
+    this->nTopNodes = nTopNodes;
+}
+
+
+double LinearOctree::refit(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                           const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                           ThreadPool& pool) {
+    int n = x.cols();
+    if (this->nodes.empty()) return 1;
+
+    // Gather the moved bodies in Morton order
+    int nChunks = pool.nThreads;
+    pool.parallelFor(nChunks, [&](int chunkIdx, unsigned threadIdx) {
+        for (int k = (int64_t)n*chunkIdx/nChunks; k < (int64_t)n*(chunkIdx + 1)/nChunks; ++k) {
+            this->bodies.set(k, this->order[k], x, m);
+        }
+    });
+
+    // Refits one node from its bodies or its already refit children, returning how much it outgrew its cell
+    auto refitNode = [&](LinearOctreeNode& node) {
+        Eigen::Vector3d boxMin, boxMax;
+        if (node.isExternal) {
+            computeLeafMoments(node, this->order, x, m, this->expansionOrder);
+            boxMin = boxMax = x.col(this->order[node.bodyBegin]);
+            for (int k = node.bodyBegin + 1; k < node.bodyBegin + node.nBodies; ++k) {
+                boxMin = boxMin.cwiseMin(x.col(this->order[k]));
+                boxMax = boxMax.cwiseMax(x.col(this->order[k]));
+            }
+        } else {
+            computeInternalMoments(&node, this->expansionOrder);
+            const LinearOctreeNode* children = &node + node.childOffset;
+            boxMin << children[0].xMin, children[0].yMin, children[0].zMin;
+            boxMax << children[0].xMax, children[0].yMax, children[0].zMax;
+            for (int k = 1; k < node.nChildren; ++k) {
+                boxMin = boxMin.cwiseMin(Eigen::Vector3d(children[k].xMin, children[k].yMin, children[k].zMin));
+                boxMax = boxMax.cwiseMax(Eigen::Vector3d(children[k].xMax, children[k].yMax, children[k].zMax));
+            }
+        }
+        node.xMin = boxMin(0); node.xMax = boxMax(0);
+        node.yMin = boxMin(1); node.yMax = boxMax(1);
+        node.zMin = boxMin(2); node.zMax = boxMax(2);
+        node.size = std::max(node.size, (boxMax - boxMin).maxCoeff());
+        return node.size/node.cellWidth;
+    };
+
+    // Children come after their parents, so a reverse sweep over each subtree visits children first
+    std::vector<double> subtreeGrowth(this->subtreeRoots.size(), 1.0);
+    pool.parallelFor(this->subtreeRoots.size(), [&](int subtreeIdx, unsigned threadIdx) {
+        double growth = 1;
+        for (int i = this->subtreeBegins[subtreeIdx + 1] - 1; i >= this->subtreeBegins[subtreeIdx]; --i) {
+            growth = std::max(growth, refitNode(this->nodes[i]));
+        }
+        subtreeGrowth[subtreeIdx] = std::max(growth, refitNode(this->nodes[this->subtreeRoots[subtreeIdx]]));
+    });
+
+    // Then the top levels, skipping the subtree roots
+    double growth = 1;
+    for (double subtree : subtreeGrowth) growth = std::max(growth, subtree);
+    for (int i = this->nTopNodes - 1; i >= 0; --i) {
+        LinearOctreeNode& node = this->nodes[i];
+        if (node.isExternal || i + node.childOffset < this->nTopNodes) {
+            growth = std::max(growth, refitNode(node));
+        }
+    }
+    return growth;
+}
+
+bool LinearOctree::holds(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                         const Eigen::Ref<const Eigen::RowVectorXd>& m) const {
+    int n = x.cols();
+    if (this->nodes.empty() || (int)this->order.size() != n) return false;
+    for (int k = 0; k < n; ++k) {
+        int j = this->order[k];
+        if (this->bodies.x[k] != x(0, j) || this->bodies.y[k] != x(1, j) || this->bodies.z[k] != x(2, j) || this->bodies.m[k] != m(j)) {
+            return false;
+        }
+    }
+    return true;
+}
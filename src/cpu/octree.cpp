@@ -1,11 +1,18 @@
 #include "octree.hpp"
 
+#include <algorithm>
+#include <new>
+
 /* Utility Functions */
 double midpoint(double min, double max) {
     // Returns the midpoint bisecting min and max.
     return (min + max)/2.0;
 }
 
+Eigen::Matrix3d pointQuadrupole(double m, const Eigen::Vector3d& d) {
+    return m*(3.0*d*d.transpose() - d.squaredNorm()*Eigen::Matrix3d::Identity());
+}
+
 int childIdx(double x, double mid) {
     // Returns 0 if x <  mid
     // Returns 1 if x >= mid
@@ -17,16 +24,23 @@ int childIdx(double x, double mid) {
 
 /* OctreeNode method implementations */
 
-OctreeNode::OctreeNode(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax)
+OctreeNode::OctreeNode(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax, OctreeArena* arena)
 : children() // Initialize children to nullptrs
 , isEmpty(true)
 , isExternal(true)
 , xMin(xMin), xMax(xMax)
 , yMin(yMin), yMax(yMax)
-, zMin(zMin), zMax(zMax) {}
+, zMin(zMin), zMax(zMax)
+, arena(arena)
+, depth(0)
+, nBodies(0)
+, overflow(nullptr) {}
 
 
 OctreeNode::~OctreeNode() {
+    // Arena nodes are released all at once by OctreeArena::reset()
+    if (this->arena != nullptr) return;
+
     // Iterate through each child and deallocate
     for (int z = 0; z < 2; ++z) {
         for (int y = 0; y < 2; ++y) {
@@ -35,10 +49,11 @@ OctreeNode::~OctreeNode() {
             }
         }
     }
+    delete this->overflow;
 }
 
 
-void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos) {
+int OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos) {
     // Recursively add object to Octree
     if (this->isEmpty) {
         // Node is empty
@@ -47,6 +62,7 @@ void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos
         this->centerOfMass = pos;
 
         this->isEmpty = false;
+        return 0;
     } else if (this->isExternal) {
         // Node is external
         // Compute midpoints
@@ -54,58 +70,9 @@ void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos
         double yMid = midpoint(this->yMin, this->yMax);
         double zMid = midpoint(this->zMin, this->zMax);
 
-        // Iterate through each child (z, y, x)
-        // and determine child_Mins and child_Maxs
-        for (int z = 0; z < 2; ++z) {
-            // Compute child_zMin, child_zMax
-            double child_zMin, child_zMax;
-            switch (z) {
-                case 0:
-                    child_zMin = this->zMin;
-                    child_zMax = zMid;
-                    break;
-                case 1:
-                    child_zMin = zMid;
-                    child_zMax = this->zMax;
-                    break;
-            }
-
-            for (int y = 0; y < 2; ++y) {
-                // Compute child_zMin, child_zMax
-                double child_yMin, child_yMax;
-                switch (y) {
-                    case 0:
-                        child_yMin = this->yMin;
-                        child_yMax = yMid;
-                        break;
-                    case 1:
-                        child_yMin = yMid;
-                        child_yMax = this->yMax;
-                        break;
-                }
+        // Split node
+        this->createChildren();
 
-                for (int x = 0; x < 2; ++x) {
-                    // Compute child_zMin, child_zMax
-                    double child_xMin, child_xMax;
-                    switch (x) {
-                        case 0:
-                            child_xMin = this->xMin;
-                            child_xMax = xMid;
-                            break;
-                        case 1:
-                            child_xMin = xMid;
-                            child_xMax = this->xMax;
-                            break;
-                    }
-
-                    // Construct child
-                    this->children[z][y][x] = new OctreeNode(child_xMin, child_xMax,
-                                                             child_yMin, child_yMax,
-                                                             child_zMin, child_zMax);
-                }
-            }
-        }
- 
         // Compute preexisting object child indices
         int pre_xIdx = childIdx(this->centerOfMass(0), xMid);
         int pre_yIdx = childIdx(this->centerOfMass(1), yMid);
@@ -117,8 +84,8 @@ void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos
         int new_zIdx = childIdx(pos(2), zMid);
 
         // Recursively add preexisting and new body to children
-        this->children[pre_zIdx][pre_yIdx][pre_xIdx]->addObject(this->totalMass, this->centerOfMass);
-        this->children[new_zIdx][new_yIdx][new_xIdx]->addObject(m, pos);
+        int preDepth = this->children[pre_zIdx][pre_yIdx][pre_xIdx]->addObject(this->totalMass, this->centerOfMass);
+        int newDepth = this->children[new_zIdx][new_yIdx][new_xIdx]->addObject(m, pos);
 
         // Update totalMass and centerOfMass
         double newTotalMass = this->totalMass + m;
@@ -126,6 +93,7 @@ void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos
         this->totalMass = newTotalMass;
 
         this->isExternal = false;
+        return 1 + std::max(preDepth, newDepth);
     } else {
         // Node is internal
         // Update totalMass and centerOfMass
@@ -144,7 +112,234 @@ void OctreeNode::addObject(double m, const Eigen::Ref<const Eigen::Vector3d> pos
         int zIdx = childIdx(pos(2), zMid);
 
         // Recursively add node to child
-        this->children[zIdx][yIdx][xIdx]->addObject(m, pos);
+        return 1 + this->children[zIdx][yIdx][xIdx]->addObject(m, pos);
+    }
+}
+
+
+int OctreeNode::addObject(int idx,
+                          const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                          const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                          int leafCapacity, int maxDepth) {
+    // Recursively add object to Octree, keeping up to leafCapacity bodies per external node
+    leafCapacity = std::min(std::max(leafCapacity, 1), OCTREE_MAX_LEAF_CAPACITY);
+
+    if (this->isEmpty) {
+        // Node is empty
+        // Start this node's bucket with the object
+        this->totalMass = m(idx);
+        this->centerOfMass = x.col(idx);
+        this->bodies[0] = idx;
+        this->nBodies = 1;
+
+        this->isEmpty = false;
+        return 0;
+    }
+
+    // Update totalMass and centerOfMass
+    this->addMass(m(idx), x.col(idx));
+
+    if (this->isExternal && (this->nBodies < leafCapacity || this->depth >= maxDepth)) {
+        // Bucket has room, or node is at the maximum depth and may not split.
+        // Indices past the bucket's storage continue in a chain of overflow buckets,
+        // so coincident bodies can still be summed directly and skip themselves.
+        OctreeNode* bucket = this;
+        while (bucket->nBodies >= OCTREE_MAX_LEAF_CAPACITY) {
+            bucket->nBodies++;
+            if (bucket->overflow == nullptr) {
+                if (this->arena != nullptr) {
+                    bucket->overflow = this->arena->allocate(this->xMin, this->xMax, this->yMin, this->yMax, this->zMin, this->zMax);
+                } else {
+                    bucket->overflow = new OctreeNode(this->xMin, this->xMax, this->yMin, this->yMax, this->zMin, this->zMax);
+                }
+                bucket->overflow->depth = this->depth;
+            }
+            bucket = bucket->overflow;
+        }
+        bucket->bodies[bucket->nBodies++] = idx;
+        return 0;
+    }
+
+    // Compute midpoints
+    double xMid = midpoint(this->xMin, this->xMax);
+    double yMid = midpoint(this->yMin, this->yMax);
+    double zMid = midpoint(this->zMin, this->zMax);
+
+    int subtreeDepth = 0;
+    if (this->isExternal) {
+        // Node is external and its bucket is full
+        // Split node and move the bucket into the children
+        this->createChildren();
+        this->isExternal = false;
+
+        for (int k = 0; k < this->nBodies; ++k) {
+            int bodyIdx = this->bodies[k];
+            OctreeNode* child = this->children[childIdx(x(2, bodyIdx), zMid)][childIdx(x(1, bodyIdx), yMid)][childIdx(x(0, bodyIdx), xMid)];
+            subtreeDepth = std::max(subtreeDepth, 1 + child->addObject(bodyIdx, x, m, leafCapacity, maxDepth));
+        }
+        this->nBodies = 0;
+    }
+
+    // Recursively add object to child
+    OctreeNode* child = this->children[childIdx(x(2, idx), zMid)][childIdx(x(1, idx), yMid)][childIdx(x(0, idx), xMid)];
+    return std::max(subtreeDepth, 1 + child->addObject(idx, x, m, leafCapacity, maxDepth));
+}
+
+
+void OctreeNode::computeQuadrupole(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                   const Eigen::Ref<const Eigen::RowVectorXd>& m) {
+    this->quadrupole.setZero();
+    if (this->isEmpty) return;
+
+    if (this->isExternal) {
+        // Sum the bodies of the bucket
+        this->forEachBody([&](int j) {
+            this->quadrupole += pointQuadrupole(m(j), x.col(j) - this->centerOfMass);
+        });
+        return;
+    }
+
+    for (int z = 0; z < 2; ++z) {
+        for (int y = 0; y < 2; ++y) {
+            for (int x_ = 0; x_ < 2; ++x_) {
+                OctreeNode* child = this->children[z][y][x_];
+                if (!child->isEmpty) child->computeQuadrupole(x, m);
+            }
+        }
+    }
+    this->combineChildQuadrupoles();
+}
+
+
+void OctreeNode::computeMoments(const Eigen::Ref<const Eigen::Matrix3Xd>& x,
+                                const Eigen::Ref<const Eigen::RowVectorXd>& m,
+                                bool withQuadrupole) {
+    if (this->isEmpty) return;
+
+    if (this->isExternal) {
+        // Bucket moments were accumulated in insertion order by addObject()
+        if (withQuadrupole) this->computeQuadrupole(x, m);
+        return;
+    }
+
+    for (int z = 0; z < 2; ++z) {
+        for (int y = 0; y < 2; ++y) {
+            for (int x_ = 0; x_ < 2; ++x_) {
+                OctreeNode* child = this->children[z][y][x_];
+                if (!child->isEmpty) child->computeMoments(x, m, withQuadrupole);
+            }
+        }
+    }
+    this->combineChildMoments(withQuadrupole);
+}
+
+
+void OctreeNode::combineChildMoments(bool withQuadrupole) {
+    this->totalMass = 0;
+    this->centerOfMass.setZero();
+    for (int z = 0; z < 2; ++z) {
+        for (int y = 0; y < 2; ++y) {
+            for (int x = 0; x < 2; ++x) {
+                const OctreeNode* child = this->children[z][y][x];
+                if (child->isEmpty) continue;
+                this->totalMass += child->totalMass;
+                this->centerOfMass += child->totalMass*child->centerOfMass;
+                this->isEmpty = false;
+            }
+        }
+    }
+    this->centerOfMass /= this->totalMass;
+    if (withQuadrupole) this->combineChildQuadrupoles();
+}
+
+
+void OctreeNode::addMass(double m, const Eigen::Ref<const Eigen::Vector3d>& pos) {
+    double newTotalMass = this->totalMass + m;
+    this->centerOfMass = (this->totalMass*this->centerOfMass + m*pos)/newTotalMass;
+    this->totalMass = newTotalMass;
+}
+
+
+void OctreeNode::combineChildQuadrupoles() {
+    // Shift each child's moment to this node's center of mass
+    this->quadrupole.setZero();
+    for (int z = 0; z < 2; ++z) {
+        for (int y = 0; y < 2; ++y) {
+            for (int x = 0; x < 2; ++x) {
+                const OctreeNode* child = this->children[z][y][x];
+                if (child->isEmpty) continue;
+                this->quadrupole += child->quadrupole + pointQuadrupole(child->totalMass, child->centerOfMass - this->centerOfMass);
+            }
+        }
+    }
+}
+
+
+void OctreeNode::createChildren() {
+    // Compute midpoints
+    double xMid = midpoint(this->xMin, this->xMax);
+    double yMid = midpoint(this->yMin, this->yMax);
+    double zMid = midpoint(this->zMin, this->zMax);
+
+    // Iterate through each child (z, y, x)
+    // and determine child_Mins and child_Maxs
+    for (int z = 0; z < 2; ++z) {
+        // Compute child_zMin, child_zMax
+        double child_zMin, child_zMax;
+        switch (z) {
+            case 0:
+                child_zMin = this->zMin;
+                child_zMax = zMid;
+                break;
+            case 1:
+                child_zMin = zMid;
+                child_zMax = this->zMax;
+                break;
+        }
+
+        for (int y = 0; y < 2; ++y) {
+            // Compute child_zMin, child_zMax
+            double child_yMin, child_yMax;
+            switch (y) {
+                case 0:
+                    child_yMin = this->yMin;
+                    child_yMax = yMid;
+                    break;
+                case 1:
+                    child_yMin = yMid;
+                    child_yMax = this->yMax;
+                    break;
+            }
+
+            for (int x = 0; x < 2; ++x) {
+                // Compute child_zMin, child_zMax
+                double child_xMin, child_xMax;
+                switch (x) {
+                    case 0:
+                        child_xMin = this->xMin;
+                        child_xMax = xMid;
+                        break;
+                    case 1:
+                        child_xMin = xMid;
+                        child_xMax = this->xMax;
+                        break;
+                }
+
+                // Construct child
+                OctreeNode* child;
+                if (this->arena != nullptr) {
+                    child = this->arena->allocate(child_xMin, child_xMax,
+                                                  child_yMin, child_yMax,
+                                                  child_zMin, child_zMax);
+                } else {
+                    child = new OctreeNode(child_xMin, child_xMax,
+                                           child_yMin, child_yMax,
+                                           child_zMin, child_zMax);
+                }
+                child->depth = this->depth + 1;
+                this->children[z][y][x] = child;
+            }
+        }
     }
 }
 
@@ -154,9 +349,49 @@ void OctreeNode::prune() {
     for (int z = 0; z < 2; ++z) {
         for (int y = 0; y < 2; ++y) {
             for (int x = 0; x < 2; ++x) {
-                delete this->children[z][y][x];
+                if (this->arena == nullptr) delete this->children[z][y][x];
                 this->children[z][y][x] = nullptr;
             }
         }
     }
+    if (this->arena == nullptr) delete this->overflow;
+    this->overflow = nullptr;
+}
+
+
+/* OctreeArena method implementations */
+
+OctreeArena::~OctreeArena() {
+    // Nodes are trivially destructible once detached from the arena, so only the blocks are freed
+    for (int i = 0; i < (int)this->blocks.size(); ++i) {
+        ::operator delete(this->blocks[i]);
+    }
+}
+
+
+OctreeNode* OctreeArena::allocate(double xMin, double xMax, double yMin, double yMax, double zMin, double zMax) {
+    if (this->blockIdx < this->blocks.size() && this->blockUsed == blockSize) {
+        // Current block is full, move on to the next kept block
+        this->blockIdx++;
+        this->blockUsed = 0;
+    }
+    if (this->blockIdx == this->blocks.size()) {
+        // Every kept block is full, grow the arena
+        this->blocks.push_back(static_cast<OctreeNode*>(::operator new(blockSize*sizeof(OctreeNode))));
+        this->blockUsed = 0;
+    }
+
+    OctreeNode* node = this->blocks[this->blockIdx] + this->blockUsed++;
+    return new (node) OctreeNode(xMin, xMax, yMin, yMax, zMin, zMax, this);
+}
+
+
+void OctreeArena::reset() {
+    this->blockIdx = 0;
+    this->blockUsed = 0;
+}
+
+
+size_t OctreeArena::size() const {
+    return this->blockIdx*blockSize + this->blockUsed;
 }
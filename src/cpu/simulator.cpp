@@ -4,6 +4,8 @@
 #include <exception>
 #include <cstdint>
 #include <limits>
+#include <cmath>
+#include <algorithm>
 #include <Eigen>
 
 Simulator::Simulator(double timeStep, uint64_t maxObjects, Integrator* integrator, DynamicsEngine* dynamicsEngine)
@@ -16,6 +18,8 @@ Simulator::Simulator(double timeStep, uint64_t maxObjects, Integrator* integrato
 , pos(3, maxObjects)
 , v(3, maxObjects)
 , a(3, maxObjects)
+, posNext(3, maxObjects)
+, timestepBin(1, maxObjects)
 , id2idx(maxObjects, RIGIDBODY_IDX_NULL)
 , idx2id(maxObjects, RIGIDBODY_ID_NULL)
 , availableUsedIDs{} {}
@@ -25,6 +29,7 @@ Simulator::~Simulator() {
     // Deallocate heap variables
     delete this->integrator;
     delete this->dynamicsEngine;
+    delete this->timestepCriterion;
 }
 
 
@@ -51,14 +56,25 @@ double Simulator::totalMomentOfInertia() {
 }
 
 
-Eigen::Ref<Eigen::MatrixXd> Simulator::active(Eigen::Ref<Eigen::MatrixXd> mat) {
-    // Return map to slice (1, this->nextIdx). Works because SoA is densely packed.
-    if (this->nObjects() == 0) {
+// Throws if there are no objects to slice
+static void requireObjects(Rigidbody nObjects) {
+    if (nObjects == 0) {
         std::cerr << "Error: Simulator method called on empty simulator." << std::endl;
         throw std::runtime_error("Error: Simulator method called on empty simulator.");
     }
+}
+
 
-    return mat(Eigen::all, Eigen::seq(0, this->nextIdx - 1));
+Eigen::Ref<Eigen::Matrix3Xd> Simulator::active(Eigen::Matrix3Xd& mat) {
+    // Return map to columns (0, this->nextIdx). Works because SoA is densely packed.
+    requireObjects(this->nObjects());
+    return mat.leftCols(this->nextIdx);
+}
+
+
+Eigen::Ref<Eigen::RowVectorXd> Simulator::active(Eigen::RowVectorXd& mat) {
+    requireObjects(this->nObjects());
+    return mat.leftCols(this->nextIdx);
 }
 
 
@@ -98,6 +114,11 @@ Rigidbody Simulator::addObject(double m, double r, const Eigen::Vector3d& p0, co
     this->pos(Eigen::all, idx) = p0;
     this->v(Eigen::all,   idx) = v0;
     this->a(Eigen::all,   idx) = Eigen::Vector3d::Zero();
+    this->timestepBin(idx) = 0;
+
+    // The new object has no acceleration yet
+    this->blockAccelerationsValid = false;
+    this->integrator->addBody(idx);
 
     return id;
 }
@@ -123,6 +144,11 @@ void Simulator::delObject(Rigidbody id) {
     this->pos(Eigen::all, idx) = this->pos(Eigen::all, topIdx);
     this->v(Eigen::all,   idx) = this->v(Eigen::all,   topIdx);
     this->a(Eigen::all,   idx) = this->a(Eigen::all,   topIdx);
+    this->timestepBin(idx) = this->timestepBin(topIdx);
+
+    // The deleted object no longer pulls on the others
+    this->blockAccelerationsValid = false;
+    this->integrator->removeBody(idx, topIdx);
 
     // Assign: idx to topID, topID to idx, null to id, null to topIdx
     this->id2idx[topID] = idx;
@@ -193,21 +219,182 @@ Eigen::Ref<const Eigen::RowVectorXd> Simulator::activeR() {
     return this->active(this->r);
 }
 
+void Simulator::setBlockTimesteps(TimestepCriterion* criterion, int maxBin) {
+    if (criterion != this->timestepCriterion) delete this->timestepCriterion;
+    this->timestepCriterion = criterion;
+    this->maxTimestepBin = std::min(std::max(maxBin, 0), 62);
+    this->blockAccelerationsValid = false;
+}
+
+Eigen::Ref<const Eigen::RowVectorXi> Simulator::activeTimestepBins() {
+    return this->timestepBin.head(this->nextIdx);
+}
+
+uint64_t Simulator::nForceEvaluations() {
+    return this->forceEvaluations;
+}
+
+void Simulator::setOutputs(bool potentials, bool tidalTensors) {
+    this->dynamicsEngine->computePotentials = potentials;
+    this->dynamicsEngine->computeTidalTensors = tidalTensors;
+}
+
+void Simulator::setPipelinedStep(bool enabled) {
+    // Velocities are synchronized with positions before the integrator takes over again
+    if (!enabled) this->synchronizeVelocities();
+    this->pipelined = enabled;
+}
+
+Eigen::Ref<const Eigen::RowVectorXd> Simulator::activePotentials() {
+    // Sized by the engine to the objects of the last force computation
+    return this->dynamicsEngine->potentials;
+}
+
+Eigen::Ref<const Eigen::Matrix<double, 9, Eigen::Dynamic>> Simulator::activeTidalTensors() {
+    return this->dynamicsEngine->tidalTensors;
+}
+
 void Simulator::updateAccelerations() {
     this->dynamicsEngine->updateAccelerations(
         this->active(this->a),
         this->active(this->pos),
         this->active(this->m)
     );
+    this->forceEvaluations += this->nObjects();
+}
+
+
+int Simulator::nextTimestepBin(RigidbodyIdx idx, int64_t tick) {
+    double dt = this->timestepCriterion->timestep(this->pos.col(idx), this->v.col(idx), this->a.col(idx), this->m(idx));
+
+    // Smallest bin whose timestep satisfies the criterion
+    int bin = 0;
+    while (bin < this->maxTimestepBin && std::ldexp(this->timeStep, -bin) > dt) {
+        bin++;
+    }
+
+    // A step may only start where a step of its bin would, so bins stay synchronized
+    int64_t nTicks = int64_t(1) << this->maxTimestepBin;
+    while (tick % (nTicks >> bin) != 0) {
+        bin++;
+    }
+    return bin;
+}
+
+
+void Simulator::blockStep() {
+    // Time is counted in ticks of the smallest timestep. A step of bin k lasts nTicks >> k ticks.
+    int n = this->nObjects();
+    int64_t nTicks = int64_t(1) << this->maxTimestepBin;
+    double dtMin = this->timeStep/nTicks;
+
+    // Block steps kick from synchronized velocities
+    this->synchronizeVelocities();
+
+    // Every object ends a block step synchronized, so accelerations carry over unless objects were added
+    if (!this->blockAccelerationsValid) {
+        this->updateAccelerations();
+        for (int i = 0; i < n; ++i) {
+            this->timestepBin(i) = this->nextTimestepBin(i, 0);
+        }
+        this->blockAccelerationsValid = true;
+    }
+
+    // Integrators do not see block steps, so they recompute any state they carry over
+    this->integrator->accelerationsValid = false;
+
+    int64_t tick = 0;
+    while (tick < nTicks) {
+        // Opening half kick of the objects starting a step
+        int64_t minTicks = nTicks;
+        for (int i = 0; i < n; ++i) {
+            int64_t ticks = nTicks >> this->timestepBin(i);
+            if (tick % ticks == 0) this->v.col(i) += 0.5*ticks*dtMin*this->a.col(i);
+            minTicks = std::min(minTicks, ticks);
+        }
+
+        // Drift every object to the end of the shortest step in progress,
+        // so inactive objects are sources at their current positions
+        int64_t nextTick = (tick/minTicks + 1)*minTicks;
+        this->active(this->pos) += this->active(this->v)*((nextTick - tick)*dtMin);
+        tick = nextTick;
+
+        // Only objects whose step ends now get new accelerations
+        this->activeIdx.clear();
+        for (int i = 0; i < n; ++i) {
+            if (tick % (nTicks >> this->timestepBin(i)) == 0) this->activeIdx.push_back(i);
+        }
+        if ((int)this->activeIdx.size() == n) {
+            this->updateAccelerations();
+        } else {
+            this->dynamicsEngine->updateActiveAccelerations(this->active(this->a), this->active(this->pos), this->active(this->m), this->activeIdx);
+            this->forceEvaluations += this->activeIdx.size();
+        }
+
+        // Closing half kick, then a new bin from the synchronized state
+        for (int i : this->activeIdx) {
+            int64_t ticks = nTicks >> this->timestepBin(i);
+            this->v.col(i) += 0.5*ticks*dtMin*this->a.col(i);
+            this->timestepBin(i) = this->nextTimestepBin(i, tick);
+        }
+    }
+}
+
+
+void Simulator::pipelinedStep() {
+    // Opening half kick on the first step, afterwards the last closing half kick merged with the next opening one
+    double dt = this->timeStep;
+    double kick = this->velocitiesLag ? dt : dt/2;
+
+    // Positions stay untouched during the pass since the engine still reads them as sources.
+    // Drifted positions go to #posNext and replace them afterwards.
+    this->dynamicsEngine->updateAccelerationsPipelined(
+        this->active(this->a),
+        this->active(this->pos),
+        this->active(this->m),
+        [&](const int* indices, int begin, int end) {
+            for (int k = begin; k < end; ++k) {
+                int i = indices ? indices[k] : k;
+                this->v.col(i) += kick*this->a.col(i);
+                this->posNext.col(i) = this->pos.col(i) + dt*this->v.col(i);
+            }
+        }
+    );
+    this->pos.swap(this->posNext);
+    this->velocitiesLag = true;
+
+    // #a is at the positions before the drift
+    this->blockAccelerationsValid = false;
+    this->integrator->accelerationsValid = false;
+}
+
+
+void Simulator::synchronizeVelocities() {
+    if (!this->velocitiesLag) return;
+    if (this->nObjects() > 0) {
+        this->updateAccelerations();
+        this->active(this->v) += (this->timeStep/2)*this->active(this->a);
+    }
+    this->velocitiesLag = false;
 }
 
 
 void Simulator::step() {
-    this->updateAccelerations();
-    this->integrator->integrate(
+    if (this->timestepCriterion != nullptr) {
+        this->blockStep();
+        return;
+    }
+    if (this->pipelined) {
+        this->pipelinedStep();
+        return;
+    }
+
+    this->integrator->step(
         this->timeStep,
+        *this->dynamicsEngine,
         this->active(this->a),
         this->active(this->v),
-        this->active(this->pos)
+        this->active(this->pos),
+        this->active(this->m)
     );
 }
@@ -0,0 +1,89 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <atomic>
+
+
+/* class ThreadPool */
+
+ThreadPool::ThreadPool(unsigned nThreads)
+: task(nullptr)
+, nThreads(std::max(1u, nThreads > 0 ? nThreads : std::thread::hardware_concurrency())) {
+    // The calling thread participates in every job, so only nThreads - 1 workers are spawned
+    for (unsigned i = 1; i < this->nThreads; ++i) {
+        this->workers.emplace_back(&ThreadPool::workerLoop, this, i);
+    }
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        this->stopping = true;
+    }
+    this->jobReady.notify_all();
+
+    for (int i = 0; i < (int)this->workers.size(); ++i) {
+        this->workers[i].join();
+    }
+}
+
+
+void ThreadPool::workerLoop(unsigned threadIdx) {
+    uint64_t lastGeneration = 0;
+    while (true) {
+        const std::function<void(unsigned)>* currTask;
+        {
+            // Sleep until a new job is posted
+            std::unique_lock<std::mutex> lock(this->mtx);
+            this->jobReady.wait(lock, [&] { return this->stopping || this->generation != lastGeneration; });
+            if (this->stopping) return;
+
+            lastGeneration = this->generation;
+            currTask = this->task;
+        }
+
+        (*currTask)(threadIdx);
+
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            if (--this->pending == 0) this->jobDone.notify_one();
+        }
+    }
+}
+
+
+void ThreadPool::run(const std::function<void(unsigned)>& task) {
+    if (this->workers.empty()) {
+        // Single threaded pool, no synchronization needed
+        task(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        this->task = &task;
+        this->pending = this->workers.size();
+        ++this->generation;
+    }
+    this->jobReady.notify_all();
+
+    // Calling thread does its share of the work
+    task(0);
+
+    // Wait for workers to finish before task goes out of scope
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->jobDone.wait(lock, [&] { return this->pending == 0; });
+    this->task = nullptr;
+}
+
+
+void ThreadPool::parallelFor(int nUnits, const std::function<void(int, unsigned)>& body) {
+    std::atomic<int> nextUnit(0);
+    this->run([&](unsigned threadIdx) {
+        // Claim units until none are left
+        for (int unitIdx = nextUnit++; unitIdx < nUnits; unitIdx = nextUnit++) {
+            body(unitIdx, threadIdx);
+        }
+    });
+}
\ No newline at end of file
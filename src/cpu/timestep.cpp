@@ -0,0 +1,18 @@
+#include "timestep.hpp"
+
+#include <cmath>
+#include <limits>
+
+/* class AccelerationCriterion */
+
+AccelerationCriterion::AccelerationCriterion(double eta, double softening)
+: eta(eta)
+, softening(softening) {}
+
+
+double AccelerationCriterion::timestep(const Eigen::Vector3d& x_i, const Eigen::Vector3d& v_i,
+                                       const Eigen::Vector3d& a_i, double m_i) {
+    double a = a_i.norm();
+    if (a == 0) return std::numeric_limits<double>::infinity();
+    return std::sqrt(2*this->eta*this->softening/a);
+}
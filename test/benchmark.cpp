@@ -2,6 +2,7 @@
 #include <chrono>
 #include <string>
 #include <cstdlib>
+#include <functional>
 #include <Eigen>
 #include "nbodytool.hpp"
 
@@ -27,6 +28,95 @@ void benchmark(Simulator& sim, int iters, const std::string& name) {
     std::cout << "step(): " << stepAvg/iters << " ms" << std::endl << std::endl;
 }
 
+void benchmarkEngine(DynamicsEngine& engine, const Eigen::Matrix3Xd& x, const Eigen::RowVectorXd& m, int iters, const std::string& name) {
+    std::cout << "Benchmarking " << name                  << std::endl
+              << "--------------------------------------" << std::endl
+              << "Average over " << iters << " iterations."       << std::endl;
+
+    Eigen::Matrix3Xd a(3, x.cols());
+    engine.updateAccelerations(a, x, m); // Warm up buffers and load balancing
+    std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
+    double stepAvg = 0;
+    for (int i = 0; i < iters; ++i) {
+        start = std::chrono::high_resolution_clock::now();
+        engine.updateAccelerations(a, x, m);
+        end   = std::chrono::high_resolution_clock::now();
+        stepAvg += std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count();
+    }
+    std::cout << "updateAccelerations(): " << stepAvg/iters << " ms" << std::endl << std::endl;
+}
+
+void benchmarkKernels(int nSources, int iters) {
+    std::cout << "Benchmarking force kernels (" << simdLevelName(getSimdLevel()) << ")" << std::endl
+              << "--------------------------------------" << std::endl
+              << nSources << " sources, " << iters << " targets." << std::endl;
+
+    SourceArrays sources;
+    FloatSourceArrays floatSources;
+    sources.resize(nSources);
+    floatSources.resize(nSources);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, nSources);
+    Eigen::RowVectorXd m = Eigen::RowVectorXd::Ones(nSources);
+    for (int j = 0; j < nSources; ++j) {
+        sources.set(j, j, x, m);
+        floatSources.x[j] = x(0, j);
+        floatSources.y[j] = x(1, j);
+        floatSources.z[j] = x(2, j);
+        floatSources.m[j] = m(j);
+    }
+
+    Eigen::Vector3d a = Eigen::Vector3d::Zero();
+    std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iters; ++i) {
+        gravitationalBatch(a, x.col(i % nSources), sources.block(0, nSources), 1, 0.01);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double doubleRate = (double)nSources*iters/std::chrono::duration<double>(end - start).count();
+
+    start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iters; ++i) {
+        gravitationalBatchMixed(a, x.col(i % nSources), floatSources.block(0, nSources), 1, 0.01);
+    }
+    end = std::chrono::high_resolution_clock::now();
+    double mixedRate = (double)nSources*iters/std::chrono::duration<double>(end - start).count();
+
+    std::cout << "gravitationalBatch(): " << doubleRate/1e9 << " G interactions/s" << std::endl
+              << "gravitationalBatchMixed(): " << mixedRate/1e9 << " G interactions/s" << std::endl
+              << "(checksum " << a.sum() << ")" << std::endl << std::endl;
+}
+
+// Update expressions of the integrators before they were specialised on 3 x N matrices
+typedef std::function<void(double, const Eigen::Ref<const Eigen::MatrixXd>&,
+                           Eigen::Ref<Eigen::MatrixXd>, Eigen::Ref<Eigen::MatrixXd>)> BaselineIntegrate;
+
+void benchmarkIntegrator(Integrator& integrator, BaselineIntegrate baseline, int n, int iters, const std::string& name) {
+    std::cout << "Benchmarking " << name                  << std::endl
+              << "--------------------------------------" << std::endl
+              << "Average over " << iters << " iterations."       << std::endl;
+
+    // Both paths update the same bodies in contiguous 3 x N storage of their own
+    Eigen::Matrix3Xd a = Eigen::Matrix3Xd::Random(3, n), v = Eigen::Matrix3Xd::Random(3, n), x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::Matrix3Xd vBaseline = v, xBaseline = x;
+
+    std::chrono::time_point<std::chrono::high_resolution_clock> start, end;
+    double integrateAvg = 0, baselineAvg = 0;
+    for (int i = 0; i < iters; ++i) {
+        start = std::chrono::high_resolution_clock::now();
+        integrator.integrate(1e-3, a, v, x);
+        end   = std::chrono::high_resolution_clock::now();
+        integrateAvg += std::chrono::duration<double, std::milli>(end - start).count();
+
+        start = std::chrono::high_resolution_clock::now();
+        baseline(1e-3, a, vBaseline, xBaseline);
+        end   = std::chrono::high_resolution_clock::now();
+        baselineAvg += std::chrono::duration<double, std::milli>(end - start).count();
+    }
+    std::cout << "integrate() 3xN: " << integrateAvg/iters << " ms" << std::endl
+              << "baseline Ref<MatrixXd>: " << baselineAvg/iters << " ms" << std::endl
+              << "(checksum " << (x - xBaseline).norm() << ")" << std::endl << std::endl;
+}
+
 void energyConservationTest(Simulator& sim, int iters, const std::string& name) {
     std::cout << "Testing Energy Conservation: " << name                  << std::endl
               << "--------------------------------------" << std::endl
@@ -66,10 +156,43 @@ int main() {
     initializeSim(sim2d_verlet_gbh_1k);
     initializeSim(sim2d_verlet_gbh_10k);
 
+    // Group walk on 100k bodies, double and mixed precision interactions
+    Eigen::Matrix3Xd x100k = Eigen::Matrix3Xd::Random(3, 100000)*10;
+    Eigen::RowVectorXd m100k = Eigen::RowVectorXd::Ones(100000);
+    Gravitational_BarnesHut gbh_group(0.5, 0.1, Unit::LightYear, Unit::SolarMass, Unit::JulianMillenium);
+    Gravitational_BarnesHut gbh_group_mixed(0.5, 0.1, Unit::LightYear, Unit::SolarMass, Unit::JulianMillenium);
+    for (Gravitational_BarnesHut* bh : {&gbh_group, &gbh_group_mixed}) {
+        bh->useLinearOctree = true;
+        bh->useGroupWalk = true;
+    }
+    gbh_group_mixed.useMixedPrecision = true;
+
     energyConservationTest(sim2d_verlet_gbh_1k, 100000, "Simulator Verlet Gravitational_BarnesHut 1k");
 
     benchmark(sim2d_euler_gd_1k, 3, "Simulator Euler Gravitational_Direct 1k");
     benchmark(sim2d_verlet_gbh_10k, 5, "Simulator Verlet Gravitational_BarnesHut 10k");
+    EulerIntegrator euler;
+    VerletIntegrator verlet;
+    benchmarkIntegrator(euler, [](double dt, const Eigen::Ref<const Eigen::MatrixXd>& a,
+                                  Eigen::Ref<Eigen::MatrixXd> v, Eigen::Ref<Eigen::MatrixXd> x) {
+        x += v*dt;
+        v += a*dt;
+    }, 1000000, 20, "EulerIntegrator 1M");
+    Eigen::MatrixXd aPrev;
+    bool isFirstIteration = true;
+    benchmarkIntegrator(verlet, [&](double dt, const Eigen::Ref<const Eigen::MatrixXd>& a,
+                                    Eigen::Ref<Eigen::MatrixXd> v, Eigen::Ref<Eigen::MatrixXd> x) {
+        if (!isFirstIteration) {
+            v = v + 0.5*(aPrev + a)*dt;
+        } else {
+            isFirstIteration = false;
+        }
+        x = x + v*dt + 0.5*a*dt*dt;
+        aPrev = a;
+    }, 1000000, 20, "VerletIntegrator 1M");
+    benchmarkKernels(2048, 20000);
+    benchmarkEngine(gbh_group, x100k, m100k, 5, "Gravitational_BarnesHut group walk 100k (" + std::string(simdLevelName(getSimdLevel())) + ")");
+    benchmarkEngine(gbh_group_mixed, x100k, m100k, 5, "Gravitational_BarnesHut group walk mixed precision 100k (" + std::string(simdLevelName(getSimdLevel())) + ")");
 
     return 0;
 }
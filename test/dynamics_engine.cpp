@@ -0,0 +1,586 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+#include <Eigen>
+#include "dynamics_engine.hpp"
+
+class DynamicsEngineTest: public ::testing::Test {
+    protected:
+        void SetUp() override {
+            srand(0);
+            m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+            x = Eigen::Matrix3Xd::Random(3, n)*10;
+
+            // Dense clump to give the tree walk an uneven workload
+            x.leftCols(n/4) *= 0.05;
+
+            Gravitational_Direct direct(0.1);
+            aDirect.resize(3, n);
+            direct.updateAccelerations(aDirect, x, m);
+        }
+
+        // Returns the largest relative error of a against aDirect
+        double maxRelativeError(const Eigen::Matrix3Xd& a) {
+            return ((a - aDirect).colwise().norm().array()/aDirect.colwise().norm().array()).maxCoeff();
+        }
+
+        const int n = 1000;
+        Eigen::RowVectorXd m;
+        Eigen::Matrix3Xd x;
+        Eigen::Matrix3Xd aDirect;
+};
+
+TEST_F(DynamicsEngineTest, DirectTilingTest) {
+    // Tiled and symmetric sums match a single-threaded sum with one tile
+    Gravitational_Direct reference(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    reference.tileSize = n;
+    Eigen::Matrix3Xd aReference(3, n);
+    reference.updateAccelerations(aReference, x, m);
+
+    for (int symmetric = 0; symmetric < 2; ++symmetric) {
+        Gravitational_Direct direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        direct.tileSize = 64;
+        direct.useSymmetry = symmetric;
+        Eigen::Matrix3Xd a(3, n);
+        direct.updateAccelerations(a, x, m);
+        EXPECT_LT((a - aReference).norm()/aReference.norm(), 1e-12);
+    }
+}
+
+TEST_F(DynamicsEngineTest, BarnesHutAccuracyTest) {
+    Gravitational_BarnesHut bh(0.3, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    Eigen::Matrix3Xd a(3, n);
+
+    // Second step uses interaction counts from the first one to balance work
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT(maxRelativeError(a), 1e-2);
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT(maxRelativeError(a), 1e-2);
+}
+
+TEST_F(DynamicsEngineTest, LinearOctreeAccuracyTest) {
+    Gravitational_BarnesHut bh(0.3, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    bh.useLinearOctree = true;
+    Eigen::Matrix3Xd a(3, n);
+
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT(maxRelativeError(a), 1e-2);
+}
+
+TEST_F(DynamicsEngineTest, QuadrupoleAccuracyTest) {
+    // Quadrupole moments reduce the force error at the same theta
+    for (int linear = 0; linear < 2; ++linear) {
+        Gravitational_BarnesHut monopole(0.8, 0.1);
+        Gravitational_BarnesHut quadrupole(0.8, 0.1);
+        monopole.useLinearOctree = linear;
+        quadrupole.useLinearOctree = linear;
+        quadrupole.expansionOrder = 2;
+
+        Eigen::Matrix3Xd aMonopole(3, n), aQuadrupole(3, n);
+        monopole.updateAccelerations(aMonopole, x, m);
+        quadrupole.updateAccelerations(aQuadrupole, x, m);
+
+        double monopoleError = (aMonopole - aDirect).norm()/aDirect.norm();
+        double quadrupoleError = (aQuadrupole - aDirect).norm()/aDirect.norm();
+        EXPECT_LT(quadrupoleError, 0.5*monopoleError);
+    }
+}
+
+TEST_F(DynamicsEngineTest, GroupWalkAccuracyTest) {
+    Gravitational_BarnesHut bh(0.3, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    bh.useLinearOctree = true;
+    bh.useGroupWalk = true;
+    Eigen::Matrix3Xd a(3, n);
+
+    // Second step balances groups by the interaction counts of the first one
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT(maxRelativeError(a), 1e-2);
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT(maxRelativeError(a), 1e-2);
+
+    // Opening nodes against the group's bounding box is at least as accurate as the per-body walk
+    Gravitational_BarnesHut perBody(0.8, 0.1);
+    Gravitational_BarnesHut group(0.8, 0.1);
+    perBody.useLinearOctree = true;
+    group.useLinearOctree = true;
+    group.useGroupWalk = true;
+    perBody.expansionOrder = 2;
+    group.expansionOrder = 2;
+
+    Eigen::Matrix3Xd aPerBody(3, n);
+    perBody.updateAccelerations(aPerBody, x, m);
+    group.updateAccelerations(a, x, m);
+    EXPECT_LE((a - aDirect).norm(), (aPerBody - aDirect).norm());
+}
+
+TEST_F(DynamicsEngineTest, MixedPrecisionTest) {
+    // Single precision interactions stay far below the Barnes-Hut error, also far from the origin
+    for (double offset : {0.0, 1e5}) {
+        Eigen::Matrix3Xd xOffset = x.array() + offset;
+        for (int order : {0, 2}) {
+            Gravitational_BarnesHut reference(0.5, 0.1);
+            Gravitational_BarnesHut mixed(0.5, 0.1);
+            for (Gravitational_BarnesHut* bh : {&reference, &mixed}) {
+                bh->useLinearOctree = true;
+                bh->useGroupWalk = true;
+                bh->expansionOrder = order;
+            }
+            mixed.useMixedPrecision = true;
+
+            Eigen::Matrix3Xd aReference(3, n), aMixed(3, n);
+            reference.updateAccelerations(aReference, xOffset, m);
+            mixed.updateAccelerations(aMixed, xOffset, m);
+            EXPECT_LT((aMixed - aReference).norm()/aReference.norm(), 1e-5);
+            EXPECT_LT((aMixed - aDirect).norm()/aDirect.norm(), 1e-2);
+        }
+    }
+}
+
+TEST_F(DynamicsEngineTest, TreeRefitTest) {
+    for (bool groupWalk : {false, true}) {
+        Gravitational_BarnesHut bh(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        bh.useLinearOctree = true;
+        bh.useGroupWalk = groupWalk;
+        bh.useTreeRefit = true;
+        bh.expansionOrder = 2;
+        Eigen::Matrix3Xd aBuilt(3, n), aRefit(3, n);
+        bh.updateAccelerations(aBuilt, x, m);
+        EXPECT_EQ(bh.refitSteps, 0);
+
+        // Refitting to unchanged positions reproduces the built tree
+        bh.updateAccelerations(aRefit, x, m);
+        EXPECT_EQ(bh.refitSteps, 1);
+        EXPECT_LT((aRefit - aBuilt).norm()/aBuilt.norm(), 1e-12);
+
+        // Small moves keep the refit tree about as accurate as a new one
+        Eigen::Matrix3Xd xMoved = x + 0.01*Eigen::Matrix3Xd::Random(3, n);
+        Gravitational_Direct direct(0.1);
+        Eigen::Matrix3Xd aMovedDirect(3, n);
+        direct.updateAccelerations(aMovedDirect, xMoved, m);
+        bh.updateAccelerations(aRefit, xMoved, m);
+        EXPECT_EQ(bh.refitSteps, 2);
+        EXPECT_LT((aRefit - aMovedDirect).norm()/aMovedDirect.norm(), 1e-3);
+
+        // Energy diagnostics walk the current tree, or refit without counting a step
+        Eigen::RowVectorXd u(n);
+        bh.updatePotentialEnergies(u, xMoved, m);
+        EXPECT_EQ(bh.refitSteps, 2);
+        bh.updatePotentialEnergies(u, x, m);
+        EXPECT_EQ(bh.refitSteps, 2);
+        bh.updateAccelerations(aRefit, xMoved, m);
+        EXPECT_EQ(bh.refitSteps, 3);
+        EXPECT_LT((aRefit - aMovedDirect).norm()/aMovedDirect.norm(), 1e-3);
+
+        // Bodies scattered far beyond their cells force a rebuild
+        Eigen::Matrix3Xd xScattered = Eigen::Matrix3Xd::Random(3, n)*10;
+        bh.updateAccelerations(aRefit, xScattered, m);
+        EXPECT_EQ(bh.refitSteps, 0);
+
+        // As does reaching maxRefitSteps
+        bh.maxRefitSteps = 1;
+        bh.updateAccelerations(aRefit, xScattered, m);
+        EXPECT_EQ(bh.refitSteps, 1);
+        bh.updateAccelerations(aRefit, xScattered, m);
+        EXPECT_EQ(bh.refitSteps, 0);
+    }
+}
+
+TEST_F(DynamicsEngineTest, TreePotentialEnergyTest) {
+    Gravitational_Direct direct(0.1);
+    Eigen::RowVectorXd uDirect(n);
+    direct.updatePotentialEnergies(uDirect, x, m);
+    double serialTotal = 0;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            if (i != j) serialTotal += direct.pairPotentialEnergy(x.col(i), x.col(j), m(i), m(j));
+        }
+    }
+    EXPECT_NEAR(direct.totalPotentialEnergy(x, m), serialTotal, 1e-12*std::abs(serialTotal));
+
+    for (int linear = 0; linear < 2; ++linear) {
+        double prevError = 1;
+        for (int order : {0, 2}) {
+            Gravitational_BarnesHut bh(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+            bh.useLinearOctree = linear;
+            bh.expansionOrder = order;
+            Eigen::RowVectorXd u(n);
+            bh.updatePotentialEnergies(u, x, m);
+            double error = (u - uDirect).norm()/uDirect.norm();
+            EXPECT_LT(error, prevError);
+            EXPECT_LT(error, 1e-3);
+            EXPECT_LT(std::abs(u.sum() - serialTotal)/std::abs(serialTotal), 1e-4);
+            prevError = error;
+
+            // The force pass computes the same potentials in its walk
+            Eigen::RowVectorXd phi = 2*u.cwiseQuotient(m);
+            Eigen::Matrix3Xd a(3, n);
+            bh.computePotentials = true;
+            bh.updateAccelerations(a, x, m);
+            EXPECT_LT((bh.potentials - phi).norm()/phi.norm(), 1e-12);
+
+            // The group walk's lists pass the same opening test for each of their bodies
+            if (linear) {
+                bh.useGroupWalk = true;
+                bh.updateAccelerations(a, x, m);
+                Eigen::RowVectorXd phiDirect = 2*uDirect.cwiseQuotient(m);
+                EXPECT_LT((bh.potentials - phiDirect).norm()/phiDirect.norm(), 1e-3);
+            }
+        }
+    }
+
+    // The FMM takes the energies from the potentials of a force pass, leaving its last outputs alone
+    Gravitational_FMM fmm(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    Eigen::RowVectorXd u(n);
+    fmm.updatePotentialEnergies(u, x, m);
+    EXPECT_LT((u - uDirect).norm()/uDirect.norm(), 1e-3);
+    EXPECT_LT(std::abs(fmm.totalPotentialEnergy(x, m) - serialTotal)/std::abs(serialTotal), 1e-4);
+    EXPECT_FALSE(fmm.computePotentials);
+    EXPECT_EQ(fmm.potentials.size(), 0);
+}
+
+TEST_F(DynamicsEngineTest, TidalTensorTest) {
+    // The closed form Newtonian tensor matches differentiating the acceleration
+    NewtonianGravity law(0.1);
+    Eigen::Vector3d x_i(0.3, -0.2, 0.5), x_j(-0.4, 0.1, 0.2);
+    Eigen::Matrix3d T = Eigen::Matrix3d::Zero(), TNumeric = Eigen::Matrix3d::Zero();
+    law.pairTidalTensor(T, x_i, x_j, 1.0, 2.0);
+    law.ForceLaw<NewtonianGravity>::pairTidalTensor(TNumeric, x_i, x_j, 1.0, 2.0);
+    EXPECT_LT((T - TNumeric).norm()/T.norm(), 1e-6);
+    EXPECT_LT((T - T.transpose()).norm(), 1e-12*T.norm());
+}
+
+TEST_F(DynamicsEngineTest, ForceOutputsTest) {
+    // Reference potentials and tidal tensors from plain pair sums
+    Gravitational_Direct reference(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    Eigen::RowVectorXd uDirect(n);
+    reference.updatePotentialEnergies(uDirect, x, m);
+    Eigen::RowVectorXd phiDirect = 2*uDirect.cwiseQuotient(m);
+    Eigen::Matrix<double, 9, Eigen::Dynamic> TDirect(9, n);
+    for (int i = 0; i < n; ++i) {
+        Eigen::Matrix3d T_i = Eigen::Matrix3d::Zero();
+        for (int j = 0; j < n; ++j) {
+            if (i != j) reference.law.pairTidalTensor(T_i, x.col(i), x.col(j), m(i), m(j));
+        }
+        TDirect.col(i) = Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data());
+    }
+
+    // Second derivatives commute, so each tensor is symmetric
+    for (int i = 0; i < n; i += 97) {
+        Eigen::Map<const Eigen::Matrix3d> T_i(TDirect.col(i).data());
+        EXPECT_LT((T_i - T_i.transpose()).norm(), 1e-9*T_i.norm());
+    }
+
+    // The direct sweeps add outputs in the same pass as the accelerations, which stay as without them
+    Eigen::Matrix3Xd a(3, n), jerk(3, n);
+    for (int symmetric = 0; symmetric < 2; ++symmetric) {
+        Gravitational_Direct direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        direct.tileSize = 64;
+        direct.useSymmetry = symmetric;
+        direct.computePotentials = true;
+        direct.computeTidalTensors = true;
+        direct.updateAccelerations(a, x, m);
+        EXPECT_LT((direct.potentials - phiDirect).norm()/phiDirect.norm(), 1e-12);
+        EXPECT_LT((direct.tidalTensors - TDirect).norm()/TDirect.norm(), 1e-12);
+        EXPECT_LT(maxRelativeError(a), 1e-12);
+    }
+
+    Gravitational_Direct hermite(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    hermite.tileSize = 64;
+    hermite.computePotentials = true;
+    hermite.computeTidalTensors = true;
+    hermite.updateAccelerationsAndJerks(a, jerk, x, Eigen::Matrix3Xd::Zero(3, n), m);
+    EXPECT_LT((hermite.potentials - phiDirect).norm()/phiDirect.norm(), 1e-12);
+    EXPECT_LT((hermite.tidalTensors - TDirect).norm()/TDirect.norm(), 1e-12);
+
+    // Only the outputs of active bodies are computed
+    std::vector<int> active;
+    for (int i = 0; i < n; i += 5) {
+        active.push_back(i);
+    }
+    hermite.updateActiveAccelerations(a, x, m, active);
+    for (int i : active) {
+        EXPECT_NEAR(hermite.potentials(i), phiDirect(i), 1e-12*std::abs(phiDirect(i)));
+        EXPECT_LT((hermite.tidalTensors.col(i) - TDirect.col(i)).norm(), 1e-12*TDirect.col(i).norm());
+    }
+
+    // Laws without a fused kernel go through the generic one built from the pair functions
+    Direct<SplineGravity> spline(SplineGravity(0.1), 4);
+    spline.tileSize = 64;
+    spline.computePotentials = true;
+    spline.computeTidalTensors = true;
+    spline.updateAccelerations(a, x, m);
+    Eigen::RowVectorXd uSpline(n);
+    spline.updatePotentialEnergies(uSpline, x, m);
+    EXPECT_LT((spline.potentials - 2*uSpline.cwiseQuotient(m)).norm()/spline.potentials.norm(), 1e-12);
+    for (int i = 0; i < n; i += 97) {
+        Eigen::Matrix3d T_i = Eigen::Matrix3d::Zero();
+        for (int j = 0; j < n; ++j) {
+            if (i != j) spline.law.pairTidalTensor(T_i, x.col(i), x.col(j), m(i), m(j));
+        }
+        EXPECT_LT((spline.tidalTensors.col(i) - Eigen::Map<const Eigen::Matrix<double, 9, 1>>(T_i.data())).norm(), 1e-12*T_i.norm());
+    }
+
+    for (int walk = 0; walk < 3; ++walk) {
+        // Per-body walk of either tree layout, then the group walk
+        Gravitational_BarnesHut bh(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        bh.useLinearOctree = walk > 0;
+        bh.useGroupWalk = walk == 2;
+        bh.computePotentials = true;
+        bh.computeTidalTensors = true;
+        bh.updateAccelerations(a, x, m);
+        EXPECT_LT((bh.potentials - phiDirect).norm()/phiDirect.norm(), 1e-3);
+        EXPECT_LT((bh.tidalTensors - TDirect).norm()/TDirect.norm(), 1e-2);
+
+        // Switching the outputs off leaves the accelerations unchanged
+        Eigen::Matrix3Xd aPlain(3, n);
+        bh.computePotentials = false;
+        bh.computeTidalTensors = false;
+        bh.updateAccelerations(aPlain, x, m);
+        EXPECT_EQ(aPlain, a);
+    }
+
+    Gravitational_FMM fmm(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    fmm.computePotentials = true;
+    fmm.computeTidalTensors = true;
+    fmm.updateAccelerations(a, x, m);
+    EXPECT_LT((fmm.potentials - phiDirect).norm()/phiDirect.norm(), 1e-3);
+    EXPECT_LT((fmm.tidalTensors - TDirect).norm()/TDirect.norm(), 1e-3);
+
+    // Laws without their own multipole kernels expand the monopole through the pair functions
+    FMM<SplineGravity> fmmSpline(0.5, SplineGravity(0.1), 4);
+    fmmSpline.computePotentials = true;
+    fmmSpline.computeTidalTensors = true;
+    fmmSpline.updateAccelerations(a, x, m);
+    EXPECT_LT((fmmSpline.potentials - spline.potentials).norm()/spline.potentials.norm(), 1e-3);
+    EXPECT_LT((fmmSpline.tidalTensors - spline.tidalTensors).norm()/spline.tidalTensors.norm(), 1e-3);
+}
+
+TEST_F(DynamicsEngineTest, ActiveAccelerationsTest) {
+    // Every third body is active. Inactive columns keep their old values.
+    std::vector<int> active;
+    for (int i = 0; i < n; i += 3) {
+        active.push_back(i);
+    }
+    std::vector<std::unique_ptr<DynamicsEngine>> engines;
+    engines.emplace_back(new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4));
+    engines.emplace_back(new Gravitational_FMM(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4));
+    for (int linear = 0; linear < 2; ++linear) {
+        Gravitational_BarnesHut* bh = new Gravitational_BarnesHut(0.3, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        bh->useLinearOctree = linear;
+        engines.emplace_back(bh);
+    }
+
+    for (int e = 0; e < engines.size(); ++e) {
+        Eigen::Matrix3Xd a = Eigen::Matrix3Xd::Constant(3, n, 7);
+        engines[e]->updateActiveAccelerations(a, x, m, active);
+        Eigen::Matrix3Xd aFull(3, n);
+        engines[e]->updateAccelerations(aFull, x, m);
+        for (int i = 0; i < n; ++i) {
+            if (i % 3 != 0) {
+                EXPECT_EQ(a.col(i), Eigen::Vector3d::Constant(7));
+            } else if (e == 1) {
+                // The FMM falls back to direct sums for active bodies
+                EXPECT_LT((a.col(i) - aDirect.col(i)).norm(), 1e-9*aDirect.col(i).norm());
+            } else {
+                // The same walk or tile sweep as the full update
+                EXPECT_LT((a.col(i) - aFull.col(i)).norm(), 1e-12*aFull.col(i).norm());
+            }
+        }
+    }
+}
+
+TEST_F(DynamicsEngineTest, PipelinedAccelerationsTest) {
+    // Every body is reported once, with its final acceleration
+    std::vector<std::unique_ptr<DynamicsEngine>> engines;
+    for (int symmetric = 0; symmetric < 2; ++symmetric) {
+        Gravitational_Direct* direct = new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        direct->tileSize = 64;
+        direct->useSymmetry = symmetric;
+        engines.emplace_back(direct);
+    }
+    engines.emplace_back(new Gravitational_FMM(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4));
+    for (int walk = 0; walk < 3; ++walk) {
+        Gravitational_BarnesHut* bh = new Gravitational_BarnesHut(0.3, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        bh->useLinearOctree = walk > 0;
+        bh->useGroupWalk = walk == 2;
+        engines.emplace_back(bh);
+    }
+
+    for (int e = 0; e < engines.size(); ++e) {
+        Eigen::Matrix3Xd a(3, n), aReady = Eigen::Matrix3Xd::Zero(3, n);
+        std::vector<std::atomic<int>> nReady(n);
+        engines[e]->updateAccelerationsPipelined(a, x, m, [&](const int* indices, int begin, int end) {
+            for (int k = begin; k < end; ++k) {
+                int i = indices ? indices[k] : k;
+                aReady.col(i) = a.col(i);
+                nReady[i]++;
+            }
+        });
+        for (int i = 0; i < n; ++i) {
+            EXPECT_EQ(nReady[i], 1);
+            EXPECT_EQ(aReady.col(i), a.col(i));
+        }
+    }
+}
+
+TEST_F(DynamicsEngineTest, JerkTest) {
+    Eigen::Matrix3Xd v = Eigen::Matrix3Xd::Random(3, n);
+    Gravitational_Direct direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    direct.tileSize = 64;
+    Eigen::Matrix3Xd a(3, n), jerk(3, n);
+    direct.updateAccelerationsAndJerks(a, jerk, x, v, m);
+    EXPECT_LT((a - aDirect).norm()/aDirect.norm(), 1e-12);
+
+    // Jerk is the rate of change of the acceleration as every body moves with its velocity
+    double h = 1e-4;
+    Eigen::Matrix3Xd aPlus(3, n), aMinus(3, n);
+    direct.updateAccelerations(aPlus, x + v*h, m);
+    direct.updateAccelerations(aMinus, x - v*h, m);
+    Eigen::Matrix3Xd jerkNumeric = (aPlus - aMinus)/(2*h);
+    EXPECT_LT((jerk - jerkNumeric).norm()/jerk.norm(), 1e-5);
+
+    // Engines without a tiled jerk pass fall back to the pair loop
+    Gravitational_BarnesHut bh(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    Eigen::Matrix3Xd aPairs(3, n), jerkPairs(3, n);
+    bh.updateAccelerationsAndJerks(aPairs, jerkPairs, x, v, m);
+    EXPECT_LT((aPairs - a).norm()/a.norm(), 1e-12);
+    EXPECT_LT((jerkPairs - jerk).norm()/jerk.norm(), 1e-12);
+}
+
+TEST_F(DynamicsEngineTest, FMMAccuracyTest) {
+    // Higher expansion orders reduce the force error at the same theta
+    double prevError = 1;
+    for (int order = 0; order <= 2; ++order) {
+        Gravitational_FMM fmm(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+        fmm.expansionOrder = order;
+        Eigen::Matrix3Xd a(3, n);
+        fmm.updateAccelerations(a, x, m);
+
+        double error = (a - aDirect).norm()/aDirect.norm();
+        EXPECT_LT(error, prevError);
+        prevError = error;
+    }
+    EXPECT_LT(prevError, 1e-3);
+
+    // Massless bodies fill whole cells of one half of the box and a distant test particle
+    Eigen::RowVectorXd mMassless = (x.row(0).array() < 0).select(0.0, m);
+    Eigen::Matrix3Xd xMassless = x;
+    xMassless.col(0) = Eigen::Vector3d(1e3, 0, 0);
+    mMassless(0) = 0;
+    Gravitational_Direct direct(0.1);
+    Eigen::Matrix3Xd aMassless(3, n);
+    direct.updateAccelerations(aMassless, xMassless, mMassless);
+    Gravitational_FMM fmm(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    Eigen::Matrix3Xd a(3, n);
+    fmm.updateAccelerations(a, xMassless, mMassless);
+    EXPECT_TRUE(a.allFinite());
+    EXPECT_LT((a - aMassless).norm()/aMassless.norm(), 1e-3);
+    double energy = direct.totalPotentialEnergy(xMassless, mMassless);
+    EXPECT_LT(std::abs(fmm.totalPotentialEnergy(xMassless, mMassless) - energy)/std::abs(energy), 1e-4);
+}
+
+TEST_F(DynamicsEngineTest, CoincidentBodiesTest) {
+    // Many bodies at one point no longer recurse until floating point precision runs out
+    x.leftCols(100).colwise() = Eigen::Vector3d(1, 2, 3);
+    Gravitational_Direct direct(0.1);
+    direct.updateAccelerations(aDirect, x, m);
+
+    for (int linear = 0; linear < 2; ++linear) {
+        Gravitational_BarnesHut bh(0.3, 0.1);
+        bh.useLinearOctree = linear;
+        bh.leafCapacity = 16;
+        Eigen::Matrix3Xd a(3, n);
+
+        bh.updateAccelerations(a, x, m);
+        EXPECT_LE(bh.treeDepth, bh.maxTreeDepth);
+        EXPECT_LT(maxRelativeError(a), 1e-2);
+    }
+
+    // Without softening, buckets that overflowed at the maximum depth are still summed directly,
+    // so coincident bodies skip each other instead of dividing by zero
+    Gravitational_Direct unsoftened(0);
+    unsoftened.updateAccelerations(aDirect, x, m);
+    ASSERT_TRUE(aDirect.allFinite());
+    for (int linear = 0; linear < 2; ++linear) {
+        Gravitational_BarnesHut bh(0.3, 0);
+        bh.useLinearOctree = linear;
+        Eigen::Matrix3Xd a(3, n);
+
+        bh.updateAccelerations(a, x, m);
+        EXPECT_TRUE(a.allFinite());
+        EXPECT_LT(maxRelativeError(a), 1e-2);
+    }
+}
+
+TEST_F(DynamicsEngineTest, BarnesHutThreadCountTest) {
+    Gravitational_BarnesHut bh1(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    Gravitational_BarnesHut bh4(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+    Eigen::Matrix3Xd a1(3, n), a4(3, n);
+
+    for (int step = 0; step < 2; ++step) {
+        bh1.updateAccelerations(a1, x, m);
+        bh4.updateAccelerations(a4, x, m);
+        EXPECT_EQ(a1, a4);
+    }
+}
+
+TEST_F(DynamicsEngineTest, ParallelOctreeBuildTest) {
+    // Building the pointer octree on several threads gives the serial tree, bit for bit
+    for (int maxTreeDepth : {2, 32}) {
+        for (int leafCapacity : {1, 8}) {
+            Gravitational_BarnesHut bh1(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+            Gravitational_BarnesHut bh4(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 4);
+            Eigen::Matrix3Xd a1(3, n), a4(3, n);
+            for (Gravitational_BarnesHut* bh : {&bh1, &bh4}) {
+                bh->expansionOrder = 2;
+                bh->leafCapacity = leafCapacity;
+                bh->maxTreeDepth = maxTreeDepth;
+            }
+            bh1.updateAccelerations(a1, x, m);
+            bh4.updateAccelerations(a4, x, m);
+            EXPECT_EQ(a1, a4);
+            EXPECT_EQ(bh1.treeDepth, bh4.treeDepth);
+
+            std::vector<std::pair<const OctreeNode*, const OctreeNode*>> stack {{bh1.root, bh4.root}};
+            while (!stack.empty()) {
+                const OctreeNode* node1 = stack.back().first;
+                const OctreeNode* node4 = stack.back().second;
+                stack.pop_back();
+
+                ASSERT_EQ(node1->isEmpty, node4->isEmpty);
+                ASSERT_EQ(node1->isExternal, node4->isExternal);
+                if (node1->isEmpty) continue;
+                EXPECT_EQ(node1->totalMass, node4->totalMass);
+                EXPECT_EQ(node1->centerOfMass, node4->centerOfMass);
+                EXPECT_EQ(node1->quadrupole, node4->quadrupole);
+                ASSERT_EQ(node1->nBodies, node4->nBodies);
+                std::vector<int> bodies1, bodies4;
+                node1->forEachBody([&](int idx) { bodies1.push_back(idx); });
+                node4->forEachBody([&](int idx) { bodies4.push_back(idx); });
+                EXPECT_EQ(bodies1, bodies4);
+                if (!node1->isExternal) {
+                    for (int k = 0; k < 8; ++k) {
+                        stack.push_back({node1->children[k >> 2][(k >> 1) & 1][k & 1], node4->children[k >> 2][(k >> 1) & 1][k & 1]});
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(DynamicsEngine, GravitationalMembersTest) {
+    // G and softening stay readable on the named gravitational engines
+    Gravitational_Direct direct(0.1, Unit::LightYear, Unit::SolarMass, Unit::JulianMillenium, 1);
+    Gravitational_BarnesHut bh(0.5, 0.2, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    Gravitational_FMM fmm(0.5, 0.3, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    EXPECT_EQ(direct.G, direct.law.G);
+    EXPECT_EQ(direct.softening, 0.1);
+    EXPECT_EQ(bh.G, 6.67430e-11);
+    EXPECT_EQ(bh.softening, 0.2);
+    EXPECT_EQ(fmm.G, 6.67430e-11);
+    EXPECT_EQ(fmm.softening, 0.3);
+}
@@ -0,0 +1,114 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <stdexcept>
+#include <Eigen>
+#include "force_kernel.hpp"
+
+TEST(ForceKernel, GravitationalBatchTest) {
+    // Odd block size exercises both the SIMD lanes and the remainder loop
+    const int n = 37;
+    srand(0);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+    SourceArrays sources;
+    sources.resize(n);
+    for (int j = 0; j < n; ++j) {
+        sources.set(j, j, x, m);
+    }
+
+    double G = 2.0, softening2 = 0.01;
+    Eigen::Vector3d x_i(0.1, -0.2, 0.3);
+    Eigen::Vector3d expected = Eigen::Vector3d::Zero();
+    for (int j = 0; j < n; ++j) {
+        Eigen::Vector3d dx = x.col(j) - x_i;
+        expected += G*m(j)*dx/std::pow(dx.squaredNorm() + softening2, 1.5);
+    }
+
+    Eigen::Vector3d a = Eigen::Vector3d::Zero();
+    gravitationalBatch(a, x_i, sources.block(0, n), G, softening2);
+    EXPECT_LT((a - expected).norm(), 1e-12*expected.norm());
+}
+
+TEST(ForceKernel, CoincidentSourceTest) {
+    // A source at the target contributes nothing, even without softening
+    Eigen::RowVectorXd m {{1, 1, 1, 1, 1, 1, 1, 1, 1}};
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Zero(3, 9);
+    x(0, 8) = 2;
+    SourceArrays sources;
+    sources.resize(9);
+    for (int j = 0; j < 9; ++j) {
+        sources.set(j, j, x, m);
+    }
+
+    Eigen::Vector3d a = Eigen::Vector3d::Zero();
+    gravitationalBatch(a, Eigen::Vector3d::Zero(), sources.block(0, 9), 1.0, 0.0);
+    EXPECT_NEAR(a(0), 0.25, 1e-12);
+    EXPECT_NEAR(a(1), 0.0, 1e-12);
+    EXPECT_NEAR(a(2), 0.0, 1e-12);
+}
+
+TEST(ForceKernel, SimdLevelTest) {
+    // Every level the CPU supports agrees with the scalar kernel, including the remainder lanes
+    const int n = 37;
+    srand(1);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+    SourceArrays sources;
+    sources.resize(n);
+    for (int j = 0; j < n; ++j) {
+        sources.set(j, j, x, m);
+    }
+
+    SimdLevel initial = getSimdLevel();
+    Eigen::Vector3d x_i = x.col(3);
+    Eigen::Vector3d expected = Eigen::Vector3d::Zero();
+    setSimdLevel(SimdLevel::Scalar);
+    gravitationalBatch(expected, x_i, sources.block(0, n), 1.0, 0.0);
+
+    for (SimdLevel level : {SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level > detectSimdLevel()) {
+            EXPECT_THROW(setSimdLevel(level), std::invalid_argument);
+            continue;
+        }
+        setSimdLevel(level);
+        EXPECT_EQ(getSimdLevel(), level);
+        Eigen::Vector3d a = Eigen::Vector3d::Zero();
+        gravitationalBatch(a, x_i, sources.block(0, n), 1.0, 0.0);
+        EXPECT_LT((a - expected).norm(), 1e-12*expected.norm()) << simdLevelName(level);
+    }
+    setSimdLevel(initial);
+}
+
+TEST(ForceKernel, MixedBatchTest) {
+    // Single precision lanes with double accumulation agree with the double kernel to single precision
+    const int n = 101;
+    srand(2);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+    SourceArrays sources;
+    FloatSourceArrays floatSources;
+    sources.resize(n);
+    floatSources.resize(n);
+    for (int j = 0; j < n; ++j) {
+        sources.set(j, j, x, m);
+        floatSources.x[j] = x(0, j);
+        floatSources.y[j] = x(1, j);
+        floatSources.z[j] = x(2, j);
+        floatSources.m[j] = m(j);
+    }
+
+    SimdLevel initial = getSimdLevel();
+    Eigen::Vector3d x_i = x.col(5);
+    Eigen::Vector3d expected = Eigen::Vector3d::Zero();
+    gravitationalBatch(expected, x_i, sources.block(0, n), 1.0, 0.01);
+
+    for (SimdLevel level : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (level > detectSimdLevel()) continue;
+        setSimdLevel(level);
+        Eigen::Vector3d a = Eigen::Vector3d::Zero();
+        gravitationalBatchMixed(a, x_i, floatSources.block(0, n), 1.0, 0.01);
+        EXPECT_LT((a - expected).norm(), 1e-5*expected.norm()) << simdLevelName(level);
+    }
+    setSimdLevel(initial);
+}
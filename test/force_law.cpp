@@ -0,0 +1,153 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <Eigen>
+#include "force_law.hpp"
+#include "dynamics_engine.hpp"
+
+// Softened inverse square attraction defined only through the pair functions,
+// so engines fall back on the ForceLaw kernels built from them
+struct UserLaw: ForceLaw<UserLaw> {
+    void pairAcceleration(Eigen::Ref<Eigen::Vector3d> a_i,
+                          const Eigen::Vector3d& x_i,
+                          const Eigen::Vector3d& x_j,
+                          double m_i,
+                          double m_j) const {
+        Eigen::Vector3d dx = x_j - x_i;
+        a_i += m_j*dx/std::pow(dx.squaredNorm() + 0.01, 1.5);
+    }
+
+    double pairPotentialEnergy(const Eigen::Vector3d& x_i,
+                               const Eigen::Vector3d& x_j,
+                               double m_i,
+                               double m_j) const {
+        return -m_i*m_j/2.0/std::sqrt((x_j - x_i).squaredNorm() + 0.01);
+    }
+};
+
+TEST(ForceLaw, LennardJonesMinimumTest) {
+    LennardJones lj(2.0, 0.5);
+    Eigen::Vector3d x_j = Eigen::Vector3d::Zero();
+    double rMin = std::pow(2.0, 1.0/6.0)*0.5;
+
+    // No force at the bottom of the well, repulsion inside it and attraction outside
+    Eigen::Vector3d a = Eigen::Vector3d::Zero();
+    lj.pairAcceleration(a, Eigen::Vector3d(rMin, 0, 0), x_j, 1, 1);
+    EXPECT_NEAR(a.norm(), 0, 1e-12);
+
+    a.setZero();
+    lj.pairAcceleration(a, Eigen::Vector3d(0.9*rMin, 0, 0), x_j, 1, 1);
+    EXPECT_GT(a(0), 0);
+
+    a.setZero();
+    lj.pairAcceleration(a, Eigen::Vector3d(1.1*rMin, 0, 0), x_j, 1, 1);
+    EXPECT_LT(a(0), 0);
+
+    // Twice the well depth, since each ordered pair holds half of it
+    EXPECT_NEAR(2*lj.pairPotentialEnergy(Eigen::Vector3d(rMin, 0, 0), x_j, 1, 1), -2.0, 1e-12);
+}
+
+TEST(ForceLaw, SplineGravityTest) {
+    double h = 0.4;
+    SplineGravity spline(h);
+    NewtonianGravity newton(0);
+    Eigen::Vector3d x_j(0.1, 0.2, 0.3);
+
+    // Newtonian beyond the support
+    for (double r : {h, 1.5*h, 10*h}) {
+        Eigen::Vector3d x_i = x_j + Eigen::Vector3d(r, 0, 0);
+        Eigen::Vector3d aSpline = Eigen::Vector3d::Zero(), aNewton = Eigen::Vector3d::Zero();
+        spline.pairAcceleration(aSpline, x_i, x_j, 1, 3);
+        newton.pairAcceleration(aNewton, x_i, x_j, 1, 3);
+        EXPECT_NEAR((aSpline - aNewton).norm(), 0, 1e-9*aNewton.norm());
+        EXPECT_NEAR(spline.pairPotentialEnergy(x_i, x_j, 1, 3), newton.pairPotentialEnergy(x_i, x_j, 1, 3), 1e-9);
+    }
+
+    // Continuous where the kernel changes branch, and finite at r = 0
+    for (double r : {0.5*h, h}) {
+        Eigen::Vector3d aIn = Eigen::Vector3d::Zero(), aOut = Eigen::Vector3d::Zero();
+        spline.pairAcceleration(aIn, x_j + Eigen::Vector3d(r*(1 - 1e-9), 0, 0), x_j, 1, 3);
+        spline.pairAcceleration(aOut, x_j + Eigen::Vector3d(r*(1 + 1e-9), 0, 0), x_j, 1, 3);
+        EXPECT_NEAR((aIn - aOut).norm(), 0, 1e-6*aOut.norm());
+    }
+    Eigen::Vector3d a = Eigen::Vector3d::Zero();
+    spline.pairAcceleration(a, x_j, x_j, 1, 3);
+    EXPECT_TRUE(a.allFinite());
+}
+
+TEST(ForceLaw, CoulombRepulsionTest) {
+    Coulomb coulomb(1e-6, 0);
+    Eigen::Vector3d x_i(1, 0, 0), x_j = Eigen::Vector3d::Zero();
+
+    // Like charges push i away from j, and the batch kernel agrees with the pair kernel
+    Eigen::Vector3d aPair = Eigen::Vector3d::Zero();
+    coulomb.pairAcceleration(aPair, x_i, x_j, 2, 3);
+    EXPECT_GT(aPair(0), 0);
+
+    SourceArrays sources;
+    sources.resize(1);
+    sources.set(0, 0, x_j, Eigen::RowVectorXd::Constant(1, 3));
+    Eigen::Vector3d aBatch = Eigen::Vector3d::Zero();
+    coulomb.batchAcceleration(aBatch, x_i, 2, sources.block(0, 1));
+    EXPECT_NEAR((aBatch - aPair).norm(), 0, 1e-12*aPair.norm());
+    EXPECT_GT(coulomb.pairPotentialEnergy(x_i, x_j, 2, 3), 0);
+}
+
+TEST(ForceLaw, UserDefinedLawTest) {
+    const int n = 500;
+    srand(0);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+
+    Eigen::Matrix3Xd expected = Eigen::Matrix3Xd::Zero(3, n);
+    UserLaw law;
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < n; ++j) {
+            if (i != j) law.pairAcceleration(expected.col(i), x.col(i), x.col(j), m(i), m(j));
+        }
+    }
+
+    Eigen::Matrix3Xd a(3, n);
+    Direct<UserLaw> direct(law, 2);
+    direct.updateAccelerations(a, x, m);
+    EXPECT_LT((a - expected).norm(), 1e-12*expected.norm());
+
+    direct.useSymmetry = true;
+    direct.updateAccelerations(a, x, m);
+    EXPECT_LT((a - expected).norm(), 1e-12*expected.norm());
+
+    BarnesHut<UserLaw> bh(0.3, law, 2);
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT((a - expected).norm(), 1e-2*expected.norm());
+
+    bh.useLinearOctree = true;
+    bh.useGroupWalk = true;
+    bh.updateAccelerations(a, x, m);
+    EXPECT_LT((a - expected).norm(), 1e-2*expected.norm());
+
+    FMM<UserLaw> fmm(0.3, law, 2);
+    fmm.updateAccelerations(a, x, m);
+    EXPECT_LT((a - expected).norm(), 1e-2*expected.norm());
+}
+
+TEST(ForceLaw, MasslessBodyTest) {
+    // Massless bodies feel forces but exert none, with or without the symmetric sum
+    const int n = 200;
+    srand(0);
+    Eigen::Matrix3Xd x = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::RowVectorXd m = Eigen::RowVectorXd::Ones(n);
+    for (int i = 0; i < n; i += 7) {
+        m(i) = 0;
+    }
+
+    Direct<SplineGravity> direct(SplineGravity(0.1), 2);
+    direct.tileSize = 64;
+    Eigen::Matrix3Xd expected(3, n), a(3, n);
+    direct.updateAccelerations(expected, x, m);
+    ASSERT_TRUE(expected.allFinite());
+
+    direct.useSymmetry = true;
+    direct.updateAccelerations(a, x, m);
+    EXPECT_TRUE(a.allFinite());
+    EXPECT_LT((a - expected).norm(), 1e-12*expected.norm());
+}
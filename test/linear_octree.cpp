@@ -0,0 +1,133 @@
+#include <gtest/gtest.h>
+
+#include <cstdlib>
+#include <Eigen>
+#include "linear_octree.hpp"
+
+TEST(LinearOctree, BuildTest) {
+    Eigen::RowVectorXd m {{1, 2, 1}};
+    Eigen::Matrix3Xd pos {
+        {0.1, 0.4, 0.1},
+        {0.4, 0.4, 0.1},
+        {0.0, 0.0, 0.0}
+    };
+    ThreadPool pool(1);
+    LinearOctree tree;
+    tree.build(pos, m, pool);
+
+    const LinearOctreeNode& root = tree.nodes[0];
+    EXPECT_EQ(root.isExternal, false);
+    EXPECT_EQ(root.nBodies, 3);
+    EXPECT_NEAR(root.totalMass, 4, 1e-6);
+    EXPECT_NEAR(root.centerOfMass(0), 0.25, 1e-6);
+    EXPECT_NEAR(root.centerOfMass(1), 0.325, 1e-6);
+    EXPECT_NEAR(root.centerOfMass(2), 0.0, 1e-6);
+
+    // Root spans [0.1, 0.4] in x and y. Bodies fall into three different octants.
+    EXPECT_EQ(root.nChildren, 3);
+    const LinearOctreeNode* children = &root + root.childOffset;
+    for (int k = 0; k < root.nChildren; ++k) {
+        EXPECT_EQ(children[k].isExternal, true);
+        EXPECT_EQ(children[k].nBodies, 1);
+        EXPECT_NEAR(children[k].totalMass, m(tree.order[children[k].bodyBegin]), 1e-6);
+    }
+    EXPECT_EQ(tree.nodes.size(), 4);
+    EXPECT_EQ(tree.depth, 1);
+}
+
+TEST(LinearOctree, CoincidentBodiesTest) {
+    // Identical positions end up in one leaf at the maximum depth
+    Eigen::RowVectorXd m {{1, 1, 2}};
+    Eigen::Matrix3Xd pos {
+        {0.5, 0.5, 1.0},
+        {0.5, 0.5, 1.0},
+        {0.5, 0.5, 1.0}
+    };
+    ThreadPool pool(1);
+    LinearOctree tree;
+    tree.build(pos, m, pool);
+
+    EXPECT_EQ(tree.depth, LINEAR_OCTREE_MAX_DEPTH);
+    const LinearOctreeNode& leaf = tree.nodes.back();
+    EXPECT_EQ(leaf.isExternal, true);
+    EXPECT_EQ(leaf.nBodies, 2);
+    EXPECT_NEAR(leaf.totalMass, 2, 1e-6);
+}
+
+TEST(LinearOctree, ParallelBuildTest) {
+    srand(0);
+    int n = 20000;
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+    Eigen::Matrix3Xd pos = Eigen::Matrix3Xd::Random(3, n);
+    pos.leftCols(n/2) *= 0.01;
+
+    ThreadPool pool1(1), pool4(4);
+    LinearOctree tree1, tree4;
+    tree1.build(pos, m, pool1);
+    tree4.build(pos, m, pool4);
+
+    // Parallel build produces the same tree as the serial one
+    EXPECT_EQ(tree1.order, tree4.order);
+    EXPECT_EQ(tree1.depth, tree4.depth);
+    ASSERT_EQ(tree1.nodes.size(), tree4.nodes.size());
+    EXPECT_NEAR(tree4.nodes[0].totalMass, m.sum(), 1e-6);
+
+    // Walk both trees in the same order and compare nodes
+    std::vector<std::pair<const LinearOctreeNode*, const LinearOctreeNode*>> stack {{&tree1.nodes[0], &tree4.nodes[0]}};
+    while (!stack.empty()) {
+        const LinearOctreeNode* node1 = stack.back().first;
+        const LinearOctreeNode* node4 = stack.back().second;
+        stack.pop_back();
+
+        ASSERT_EQ(node1->nChildren, node4->nChildren);
+        EXPECT_EQ(node1->bodyBegin, node4->bodyBegin);
+        EXPECT_EQ(node1->nBodies, node4->nBodies);
+        EXPECT_NEAR(node1->totalMass, node4->totalMass, 1e-9);
+        EXPECT_NEAR((node1->centerOfMass - node4->centerOfMass).norm(), 0, 1e-9);
+        for (int k = 0; k < node1->nChildren; ++k) {
+            stack.push_back({node1 + node1->childOffset + k, node4 + node4->childOffset + k});
+        }
+    }
+}
+
+TEST(LinearOctree, RefitTest) {
+    srand(0);
+    int n = 20000;
+    Eigen::RowVectorXd m = (Eigen::RowVectorXd::Random(n).array() + 1.5).matrix();
+    Eigen::Matrix3Xd pos = Eigen::Matrix3Xd::Random(3, n);
+    Eigen::Matrix3Xd moved = pos + 0.001*Eigen::Matrix3Xd::Random(3, n);
+
+    for (int nThreads : {1, 4}) {
+        ThreadPool pool(nThreads);
+        LinearOctree tree;
+        tree.expansionOrder = 2;
+        tree.build(pos, m, pool);
+        size_t nNodes = tree.nodes.size();
+        double growth = tree.refit(moved, m, pool);
+        EXPECT_GE(growth, 1);
+        EXPECT_LT(growth, 2);
+        ASSERT_EQ(tree.nodes.size(), nNodes);
+
+        // Every node's moments and bounds match its bodies at their new positions
+        for (const LinearOctreeNode& node : tree.nodes) {
+            double mass = 0;
+            Eigen::Vector3d com = Eigen::Vector3d::Zero();
+            Eigen::Vector3d boxMin = moved.col(tree.order[node.bodyBegin]);
+            Eigen::Vector3d boxMax = boxMin;
+            for (int k = node.bodyBegin; k < node.bodyBegin + node.nBodies; ++k) {
+                int i = tree.order[k];
+                mass += m(i);
+                com += m(i)*moved.col(i);
+                boxMin = boxMin.cwiseMin(moved.col(i));
+                boxMax = boxMax.cwiseMax(moved.col(i));
+                EXPECT_EQ(tree.bodies.x[k], moved(0, i));
+            }
+            EXPECT_NEAR(node.totalMass, mass, 1e-9);
+            EXPECT_NEAR((node.centerOfMass - com/mass).norm(), 0, 1e-9);
+            EXPECT_EQ(node.xMin, boxMin(0));
+            EXPECT_EQ(node.zMax, boxMax(2));
+            EXPECT_GE(node.size, (boxMax - boxMin).maxCoeff());
+            EXPECT_GE(node.size, node.cellWidth);
+        }
+    }
+}
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <vector>
 #include <Eigen>
 #include "octree.hpp"
 
@@ -75,6 +77,78 @@ TEST_F(OctreeTest, AddObjectTest) {
     EXPECT_EQ(empty->isExternal, true);
 }
 
+TEST_F(OctreeTest, AddObjectDepthTest) {
+    // First object stays in the root, second splits it twice, third lands one level below the root
+    EXPECT_EQ(root2->addObject(1, Eigen::Vector3d(0.1, 0.1, 0.1)), 0);
+    EXPECT_EQ(root2->addObject(1, Eigen::Vector3d(0.9, 0.9, 0.9)), 2);
+    EXPECT_EQ(root2->addObject(1, Eigen::Vector3d(-0.5, -0.5, -0.5)), 1);
+}
+
+TEST_F(OctreeTest, AddObjectBucketTest) {
+    Eigen::RowVectorXd m {{1, 2, 1, 4}};
+    Eigen::Matrix3Xd pos {
+        {0.1, 0.4, 0.1, 0.9},
+        {0.4, 0.4, 0.1, 0.9},
+        {0.0, 0.0, 0.0, 0.9}
+    };
+
+    // First three bodies fit in the root's bucket
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_EQ(root1->addObject(i, pos, m, 3, 32), 0);
+    }
+    EXPECT_EQ(root1->isExternal, true);
+    EXPECT_EQ(root1->nBodies, 3);
+    EXPECT_NEAR(root1->totalMass, 4, 1e-6);
+
+    // Fourth body splits the root. The first three share an octant's bucket.
+    EXPECT_EQ(root1->addObject(3, pos, m, 3, 32), 1);
+    EXPECT_EQ(root1->isExternal, false);
+    EXPECT_EQ(root1->nBodies, 0);
+    EXPECT_NEAR(root1->totalMass, 8, 1e-6);
+    EXPECT_NEAR(root1->centerOfMass(0), 0.575, 1e-6);
+
+    OctreeNode* low = root1->children[0][0][0];
+    EXPECT_EQ(low->isExternal, true);
+    EXPECT_EQ(low->depth, 1);
+    EXPECT_EQ(low->nBodies, 3);
+    EXPECT_EQ(low->bodies[0], 0);
+    EXPECT_EQ(low->bodies[2], 2);
+
+    OctreeNode* high = root1->children[1][1][1];
+    EXPECT_EQ(high->nBodies, 1);
+    EXPECT_EQ(high->bodies[0], 3);
+}
+
+TEST_F(OctreeTest, AddObjectMaxDepthTest) {
+    // Coincident bodies stop splitting at the maximum depth
+    int n = 2*OCTREE_MAX_LEAF_CAPACITY;
+    Eigen::RowVectorXd m = Eigen::RowVectorXd::Ones(n);
+    Eigen::Matrix3Xd pos = Eigen::Matrix3Xd::Constant(3, n, 0.3);
+
+    int depth = 0;
+    for (int i = 0; i < n; ++i) {
+        depth = std::max(depth, root1->addObject(i, pos, m, 1, 5));
+    }
+    EXPECT_EQ(depth, 5);
+    EXPECT_NEAR(root1->totalMass, n, 1e-6);
+
+    // Bucket keeps the bodies past its storage in overflow buckets
+    OctreeNode* node = root1;
+    while (!node->isExternal) {
+        int idx = node->centerOfMass(0) < (node->xMin + node->xMax)/2 ? 0 : 1;
+        node = node->children[idx][idx][idx];
+    }
+    EXPECT_EQ(node->depth, 5);
+    EXPECT_EQ(node->nBodies, n);
+    EXPECT_NE(node->overflow, nullptr);
+    std::vector<int> bodies;
+    node->forEachBody([&](int idx) { bodies.push_back(idx); });
+    ASSERT_EQ(bodies.size(), n);
+    for (int i = 0; i < n; ++i) {
+        EXPECT_EQ(bodies[i], i);
+    }
+}
+
 TEST_F(OctreeTest, PruneTest) {
     Eigen::RowVectorXd m1 {{1, 2, 1}};
     Eigen::Matrix3Xd pos1 {
@@ -97,3 +171,38 @@ TEST_F(OctreeTest, PruneTest) {
         }
     }
 }
+
+TEST(OctreeArena, AllocateResetTest) {
+    OctreeArena arena;
+    Eigen::Matrix3Xd pos = Eigen::Matrix3Xd::Random(3, 10000);
+
+    // Build the same tree twice. The second build reuses the first build's memory.
+    OctreeNode* firstRoot = nullptr;
+    size_t firstSize = 0;
+    for (int build = 0; build < 2; ++build) {
+        arena.reset();
+        EXPECT_EQ(arena.size(), 0);
+
+        OctreeNode* root = arena.allocate(-1, 1, -1, 1, -1, 1);
+        for (int i = 0; i < pos.cols(); ++i) {
+            root->addObject(1, pos.col(i));
+        }
+        EXPECT_NEAR(root->totalMass, pos.cols(), 1e-6);
+        EXPECT_EQ(root->children[0][0][0]->arena, &arena);
+
+        if (build == 0) {
+            firstRoot = root;
+            firstSize = arena.size();
+        } else {
+            EXPECT_EQ(root, firstRoot);
+            EXPECT_EQ(arena.size(), firstSize);
+        }
+    }
+
+    // Pruning an arena tree only detaches the children
+    OctreeNode* root = arena.allocate(-1, 1, -1, 1, -1, 1);
+    root->addObject(1, pos.col(0));
+    root->addObject(1, pos.col(1));
+    root->prune();
+    EXPECT_EQ(root->children[0][0][0], nullptr);
+}
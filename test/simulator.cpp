@@ -1,5 +1,8 @@
 #include <gtest/gtest.h>
 
+#include <cmath>
+#include <vector>
+
 #include "nbodytool.hpp"
 
 
@@ -49,3 +52,338 @@ TEST(Simulator, AddDelGetMethodTest) {
     EXPECT_EQ(sim.rb_a(rb3)(0), 0);
     EXPECT_EQ(sim.rb_a(rb3)(1), 0);
 }
+
+TEST(Simulator, OutputsTest) {
+    Gravitational_Direct* engine = new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    Simulator sim(0.01, 10, new EulerIntegrator(), engine);
+    sim.addObject(2, 1, Eigen::Vector3d(0, 0, 0), Eigen::Vector3d(0, 0, 0));
+    sim.addObject(1, 1, Eigen::Vector3d(2, 0, 0), Eigen::Vector3d(0, 0, 0));
+    sim.setOutputs(true, true);
+    sim.step();
+
+    // Potential of the second object is -G*m_1/r, and its tidal tensor G*m_1/r^3*(I - 3*rhat*rhat^T)
+    double G = engine->law.G;
+    ASSERT_EQ(sim.activePotentials().size(), 2);
+    EXPECT_NEAR(sim.activePotentials()(1), -G*2/2.0, 1e-6*G);
+    EXPECT_NEAR(sim.activePotentials()(0), -G*1/2.0, 1e-6*G);
+    Eigen::Map<const Eigen::Matrix3d> T(sim.activeTidalTensors().col(1).data());
+    EXPECT_NEAR(T(0, 0), -2*G*2/8.0, 1e-6*G);
+    EXPECT_NEAR(T(1, 1), G*2/8.0, 1e-6*G);
+    EXPECT_NEAR(T(0, 1), 0, 1e-6*G);
+}
+
+TEST(Simulator, BlockTimestepTest) {
+    // Tight binary in a halo of light, distant objects
+    Gravitational_Direct* engine = new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+    Simulator sim(0.2, 10, new VerletIntegrator(), engine);
+    double G = engine->law.G;
+    double M = 1e10, d = 0.2;
+    double vOrbit = 0.5*std::sqrt(G*2*M/d);
+    sim.addObject(M, 1, Eigen::Vector3d(-d/2, 0, 0), Eigen::Vector3d(0, -vOrbit, 0));
+    sim.addObject(M, 1, Eigen::Vector3d(d/2, 0, 0), Eigen::Vector3d(0, vOrbit, 0));
+    for (int k = 0; k < 4; ++k) {
+        double angle = k*M_PI/2;
+        sim.addObject(1e6, 1, Eigen::Vector3d(10*std::cos(angle), 10*std::sin(angle), 1), Eigen::Vector3d(0, 0, 0.01));
+    }
+
+    const int maxBin = 6;
+    sim.setBlockTimesteps(new AccelerationCriterion(0.025, 0.01), maxBin);
+    double energy = sim.totalEnergy();
+    const int nSteps = 10;
+    for (int step = 0; step < nSteps; ++step) {
+        sim.step();
+    }
+
+    // The binary takes the shortest steps and the halo much longer ones
+    EXPECT_EQ(sim.activeTimestepBins()(0), maxBin);
+    EXPECT_EQ(sim.activeTimestepBins()(1), maxBin);
+    for (int i = 2; i < 6; ++i) {
+        EXPECT_LT(sim.activeTimestepBins()(i), 3);
+    }
+
+    // Energy is conserved as with the shortest timestep everywhere, at a fraction of the force evaluations
+    EXPECT_LT(std::abs(sim.totalEnergy() - energy)/std::abs(energy), 1e-3);
+    EXPECT_LT(sim.nForceEvaluations(), 6*nSteps*(1 << maxBin)/2);
+
+    // Deleting the first halo object recomputes the accelerations of the others, as a new simulator would
+    sim.delObject(2);
+    Simulator fresh(0.2, 10, new VerletIntegrator(), new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1));
+    fresh.setBlockTimesteps(new AccelerationCriterion(0.025, 0.01), maxBin);
+    for (int i = 0; i < sim.nObjects(); ++i) {
+        fresh.addObject(sim.activeM()(i), 1, sim.activePos().col(i), sim.activeV().col(i));
+    }
+    sim.step();
+    fresh.step();
+    Eigen::Matrix3Xd x = sim.activePos(), xFresh = fresh.activePos();
+    EXPECT_EQ(x, xFresh);
+}
+
+TEST(Simulator, HermiteIntegratorTest) {
+    // Eccentric binary over a few orbits, with the same time step for both integrators
+    double energyError[2];
+    for (int hermite = 0; hermite < 2; ++hermite) {
+        Integrator* integrator = hermite ? (Integrator*)new HermiteIntegrator() : (Integrator*)new VerletIntegrator();
+        Gravitational_Direct* engine = new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+        Simulator sim(0.00125, 2, integrator, engine);
+        double G = engine->law.G;
+        double M = 1e10, d = 0.2;
+        double vOrbit = 0.7*0.5*std::sqrt(G*2*M/d);
+        sim.addObject(M, 1, Eigen::Vector3d(-d/2, 0, 0), Eigen::Vector3d(0, -vOrbit, 0));
+        sim.addObject(M, 1, Eigen::Vector3d(d/2, 0, 0), Eigen::Vector3d(0, vOrbit, 0));
+
+        double energy = sim.totalEnergy();
+        for (int step = 0; step < 800; ++step) {
+            sim.step();
+        }
+        energyError[hermite] = std::abs(sim.totalEnergy() - energy)/std::abs(energy);
+    }
+    EXPECT_LT(energyError[1], 1e-4);
+    EXPECT_LT(energyError[1], energyError[0]/100);
+}
+
+TEST(Simulator, LeapfrogIntegratorTest) {
+    // Kick-drift-kick leapfrog follows the same trajectory as velocity Verlet
+    Eigen::Matrix3Xd x[3], v[3];
+    for (int k = 0; k < 3; ++k) {
+        Integrator* integrator;
+        if (k == 0) {
+            integrator = new VerletIntegrator();
+        } else {
+            LeapfrogIntegrator* leapfrog = new LeapfrogIntegrator();
+            leapfrog->synchronizeVelocities = k == 1;
+            integrator = leapfrog;
+        }
+        Simulator sim(0.01, 3, integrator, new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 2));
+        sim.addObject(1e10, 1, Eigen::Vector3d(-0.5, 0, 0), Eigen::Vector3d(0, -0.1, 0));
+        sim.addObject(1e10, 1, Eigen::Vector3d(0.5, 0, 0), Eigen::Vector3d(0, 0.1, 0));
+        sim.addObject(1e9, 1, Eigen::Vector3d(0, 2, 0), Eigen::Vector3d(0.1, 0, 0));
+        for (int step = 0; step < 100; ++step) {
+            sim.step();
+        }
+        x[k] = sim.activePos();
+        v[k] = sim.activeV();
+    }
+    EXPECT_LT((x[1] - x[0]).norm(), 1e-12*x[0].norm());
+    EXPECT_LT((x[2] - x[0]).norm(), 1e-12*x[0].norm());
+
+    // Deferred closing kicks leave velocities half a step behind the synchronized ones
+    Gravitational_Direct direct(0.1);
+    Eigen::RowVectorXd m(3);
+    m << 1e10, 1e10, 1e9;
+    Eigen::Matrix3Xd a(3, 3);
+    direct.updateAccelerations(a, x[1], m);
+    EXPECT_LT((v[2] + 0.005*a - v[1]).norm(), 1e-12*v[1].norm());
+}
+
+TEST(Simulator, PipelinedStepTest) {
+    // Pipelined steps follow the leapfrog with deferred closing kicks
+    std::vector<DynamicsEngine*> engines[2];
+    for (int k = 0; k < 2; ++k) {
+        engines[k].push_back(new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 2));
+        Gravitational_BarnesHut* bh = new Gravitational_BarnesHut(0.5, 0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 2);
+        bh->useLinearOctree = true;
+        bh->useGroupWalk = true;
+        engines[k].push_back(bh);
+    }
+
+    Eigen::Matrix3Xd x0 = Eigen::Matrix3Xd::Random(3, 200);
+    Eigen::Matrix3Xd v0 = 0.1*Eigen::Matrix3Xd::Random(3, 200);
+    for (int e = 0; e < engines[0].size(); ++e) {
+        Eigen::Matrix3Xd x[2], v[2];
+        for (int k = 0; k < 2; ++k) {
+            LeapfrogIntegrator* leapfrog = new LeapfrogIntegrator();
+            leapfrog->synchronizeVelocities = false;
+            Simulator sim(0.01, 200, leapfrog, engines[k][e]);
+            sim.setPipelinedStep(k == 1);
+            for (int i = 0; i < 200; ++i) {
+                sim.addObject(1e8, 1, x0.col(i), v0.col(i));
+            }
+            for (int step = 0; step < 20; ++step) {
+                sim.step();
+            }
+            x[k] = sim.activePos();
+            v[k] = sim.activeV();
+        }
+        EXPECT_LT((x[1] - x[0]).norm(), 1e-12*x[0].norm());
+        EXPECT_LT((v[1] - v[0]).norm(), 1e-12*v[0].norm());
+    }
+
+    // Switching back from pipelined steps, or on to block steps with one bin, applies the deferred closing kick,
+    // so synchronized leapfrog steps carry on
+    Eigen::Matrix3Xd x[3], v[3];
+    for (int k = 0; k < 3; ++k) {
+        Simulator sim(0.01, 200, new LeapfrogIntegrator(), new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 2));
+        for (int i = 0; i < 200; ++i) {
+            sim.addObject(1e8, 1, x0.col(i), v0.col(i));
+        }
+        sim.setPipelinedStep(k > 0);
+        for (int step = 0; step < 20; ++step) {
+            if (k == 1 && step == 10) sim.setPipelinedStep(false);
+            if (k == 2 && step == 10) sim.setBlockTimesteps(new AccelerationCriterion(0.025, 0.01), 0);
+            sim.step();
+        }
+        x[k] = sim.activePos();
+        v[k] = sim.activeV();
+    }
+    for (int k = 1; k < 3; ++k) {
+        EXPECT_LT((x[k] - x[0]).norm(), 1e-12*x[0].norm());
+        EXPECT_LT((v[k] - v[0]).norm(), 1e-12*v[0].norm());
+    }
+}
+
+TEST(Simulator, IntegratorLayoutTest) {
+    // Contiguous matrices and matrices with padding between columns take different paths to the same result
+    Eigen::Matrix3Xd a = Eigen::Matrix3Xd::Random(3, 100), v = Eigen::Matrix3Xd::Random(3, 100), x = Eigen::Matrix3Xd::Random(3, 100);
+    Eigen::Matrix4Xd aPadded(4, 100), vPadded(4, 100), xPadded(4, 100);
+    aPadded.topRows(3) = a;
+    vPadded.topRows(3) = v;
+    xPadded.topRows(3) = x;
+
+    EulerIntegrator euler[2];
+    VerletIntegrator verlet[2];
+    for (int step = 0; step < 3; ++step) {
+        euler[0].integrate(0.01, a, v, x);
+        euler[1].integrate(0.01, aPadded.topRows(3), vPadded.topRows(3), xPadded.topRows(3));
+        verlet[0].integrate(0.01, a, v, x);
+        verlet[1].integrate(0.01, aPadded.topRows(3), vPadded.topRows(3), xPadded.topRows(3));
+    }
+    EXPECT_LT((x - xPadded.topRows(3)).norm(), 1e-14*x.norm());
+    EXPECT_LT((v - vPadded.topRows(3)).norm(), 1e-14*v.norm());
+}
+
+TEST(Simulator, HighOrderIntegratorTest) {
+    // Halving the time step divides the error of an order p integrator by about 2^p
+    auto finalPositions = [](Integrator* integrator, double dt) {
+        Gravitational_Direct* engine = new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+        Simulator sim(dt, 2, integrator, engine);
+        double G = engine->law.G;
+        double M = 1e10, d = 0.2;
+        double vOrbit = 0.9*0.5*std::sqrt(G*2*M/d);
+        sim.addObject(M, 1, Eigen::Vector3d(-d/2, 0, 0), Eigen::Vector3d(0, -vOrbit, 0));
+        sim.addObject(M, 1, Eigen::Vector3d(d/2, 0, 0), Eigen::Vector3d(0, vOrbit, 0));
+        for (int step = 0; step < std::lround(0.5/dt); ++step) {
+            sim.step();
+        }
+        return Eigen::Matrix3Xd(sim.activePos());
+    };
+    Eigen::Matrix3Xd reference = finalPositions(new YoshidaIntegrator(6), 0.01/16);
+
+    double minRatio[3] = {12, 12, 40};
+    for (int k = 0; k < 3; ++k) {
+        double error[2];
+        for (int halve = 0; halve < 2; ++halve) {
+            Integrator* integrator = k == 0 ? (Integrator*)new RungeKuttaIntegrator() : (Integrator*)new YoshidaIntegrator(k == 1 ? 4 : 6);
+            error[halve] = (finalPositions(integrator, 0.01/(1 + halve)) - reference).norm();
+        }
+        EXPECT_GT(error[0]/error[1], minRatio[k]);
+    }
+    EXPECT_THROW(YoshidaIntegrator(5), std::invalid_argument);
+}
+
+TEST(Simulator, MultistepIntegratorTest) {
+    // Binary orbit as in HighOrderIntegratorTest, plus a massless body that is deleted halfway
+    auto finalPositions = [](Integrator* integrator, double dt, bool withTestBody) {
+        Gravitational_Direct* engine = new Gravitational_Direct(0, Unit::Meter, Unit::Kilogram, Unit::Second, 1);
+        Simulator sim(dt, 3, integrator, engine);
+        double G = engine->law.G;
+        double M = 1e10, d = 0.2;
+        double vOrbit = 0.9*0.5*std::sqrt(G*2*M/d);
+        Rigidbody testBody = withTestBody ? sim.addObject(0, 1, Eigen::Vector3d(0, 0.5, 0), Eigen::Vector3d(0.5, 0, 0)) : 0;
+        Rigidbody body1 = sim.addObject(M, 1, Eigen::Vector3d(-d/2, 0, 0), Eigen::Vector3d(0, -vOrbit, 0));
+        Rigidbody body2 = sim.addObject(M, 1, Eigen::Vector3d(d/2, 0, 0), Eigen::Vector3d(0, vOrbit, 0));
+        int nSteps = std::lround(0.5/dt);
+        for (int step = 0; step < nSteps; ++step) {
+            if (withTestBody && step == nSteps/2) sim.delObject(testBody);
+            sim.step();
+        }
+        Eigen::Matrix3Xd x(3, 2);
+        x << sim.rb_pos(body1), sim.rb_pos(body2);
+        return x;
+    };
+    Eigen::Matrix3Xd reference = finalPositions(new YoshidaIntegrator(6), 0.01/16, false);
+
+    // Halving the time step divides the error of an order p integrator by about 2^p
+    int orders[2] = {4, 6};
+    double minRatio[2] = {12, 40};
+    for (int k = 0; k < 2; ++k) {
+        double error[2];
+        for (int halve = 0; halve < 2; ++halve) {
+            error[halve] = (finalPositions(new AdamsBashforthMoultonIntegrator(orders[k]), 0.005/(1 + halve), false) - reference).norm();
+        }
+        EXPECT_GT(error[0]/error[1], minRatio[k]);
+    }
+
+    // Deleting the massless body moves the history of the last body instead of restarting it
+    Eigen::Matrix3Xd x = finalPositions(new AdamsBashforthMoultonIntegrator(6), 0.005, false);
+    Eigen::Matrix3Xd xDeleted = finalPositions(new AdamsBashforthMoultonIntegrator(6), 0.005, true);
+    EXPECT_LT((xDeleted - x).norm(), 1e-12*x.norm());
+
+    // Block steps move the bodies without the integrator, so its history starts over afterwards
+    Simulator sim(0.005, 3, new AdamsBashforthMoultonIntegrator(4), new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1));
+    sim.addObject(1e10, 1, Eigen::Vector3d(-0.1, 0, 0), Eigen::Vector3d(0, -0.5, 0));
+    sim.addObject(1e10, 1, Eigen::Vector3d(0.1, 0, 0), Eigen::Vector3d(0, 0.5, 0));
+    for (int step = 0; step < 10; ++step) {
+        sim.step();
+    }
+    sim.setBlockTimesteps(new AccelerationCriterion(0.025, 0.01), 0);
+    for (int step = 0; step < 5; ++step) {
+        sim.step();
+    }
+    sim.setBlockTimesteps(nullptr, 0);
+    Simulator fresh(0.005, 3, new AdamsBashforthMoultonIntegrator(4), new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1));
+    for (int i = 0; i < sim.nObjects(); ++i) {
+        fresh.addObject(sim.activeM()(i), 1, sim.activePos().col(i), sim.activeV().col(i));
+    }
+    for (int step = 0; step < 10; ++step) {
+        sim.step();
+        fresh.step();
+    }
+    Eigen::Matrix3Xd xBlock = sim.activePos(), xFresh = fresh.activePos();
+    EXPECT_LT((xBlock - xFresh).norm(), 1e-12*xFresh.norm());
+
+    EXPECT_THROW(AdamsBashforthMoultonIntegrator(9), std::invalid_argument);
+}
+
+TEST(Simulator, ReplacedBodyTest) {
+    // Deleting a body changes the forces on the others, and adding another before or after it keeps the count.
+    // Either way accelerations are computed afresh before the next step.
+    auto makeIntegrator = [](int k) -> Integrator* {
+        switch (k) {
+            case 0:  return new LeapfrogIntegrator();
+            case 1:  return new RungeKuttaIntegrator();
+            case 2:  return new YoshidaIntegrator(4);
+            case 3:  return new HermiteIntegrator();
+            default: return new AdamsBashforthMoultonIntegrator(4);
+        }
+    };
+    for (int k = 0; k < 5; ++k) {
+        for (int replace = 0; replace < 3; ++replace) {
+            // Deleting alone keeps the multistep history
+            if (k == 4 && replace == 0) continue;
+            Simulator sim(0.01, 4, makeIntegrator(k), new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1));
+            Rigidbody first = sim.addObject(1e9, 1, Eigen::Vector3d(0, 2, 0), Eigen::Vector3d(0.1, 0, 0));
+            sim.addObject(1e10, 1, Eigen::Vector3d(-0.5, 0, 0), Eigen::Vector3d(0, -0.1, 0));
+            sim.addObject(1e10, 1, Eigen::Vector3d(0.5, 0, 0), Eigen::Vector3d(0, 0.1, 0));
+            for (int step = 0; step < 10; ++step) {
+                sim.step();
+            }
+
+            // The last body moves to the first column
+            if (replace == 2) sim.addObject(1e9, 1, Eigen::Vector3d(0, -2, 0), Eigen::Vector3d(-0.1, 0, 0));
+            sim.delObject(first);
+            if (replace == 1) sim.addObject(1e9, 1, Eigen::Vector3d(0, -2, 0), Eigen::Vector3d(-0.1, 0, 0));
+
+            // A new simulator starts from the same state with accelerations computed from scratch
+            Simulator fresh(0.01, 3, makeIntegrator(k), new Gravitational_Direct(0.1, Unit::Meter, Unit::Kilogram, Unit::Second, 1));
+            for (int i = 0; i < sim.nObjects(); ++i) {
+                fresh.addObject(sim.activeM()(i), 1, sim.activePos().col(i), sim.activeV().col(i));
+            }
+            for (int step = 0; step < 10; ++step) {
+                sim.step();
+                fresh.step();
+            }
+            Eigen::Matrix3Xd x = sim.activePos(), xFresh = fresh.activePos();
+            EXPECT_LT((x - xFresh).norm(), 1e-12*xFresh.norm()) << "integrator " << k << ", replace " << replace;
+        }
+    }
+}
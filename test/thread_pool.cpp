@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <vector>
+#include "thread_pool.hpp"
+
+TEST(ThreadPool, RunTest) {
+    ThreadPool pool(4);
+    EXPECT_EQ(pool.nThreads, 4);
+
+    // Every thread index runs exactly once per job, over many jobs
+    std::vector<int> counts(pool.nThreads, 0);
+    for (int job = 0; job < 1000; ++job) {
+        pool.run([&](unsigned threadIdx) {
+            counts[threadIdx]++;
+        });
+    }
+
+    for (int i = 0; i < counts.size(); ++i) {
+        EXPECT_EQ(counts[i], 1000);
+    }
+}
+
+TEST(ThreadPool, SingleThreadTest) {
+    ThreadPool pool(1);
+    std::atomic<int> sum(0);
+    pool.run([&](unsigned threadIdx) {
+        sum += threadIdx + 1;
+    });
+    EXPECT_EQ(sum, 1);
+}
+
+TEST(ThreadPool, ParallelForTest) {
+    ThreadPool pool(3);
+
+    // Every unit is visited exactly once
+    std::vector<std::atomic<int>> visits(257);
+    pool.parallelFor(visits.size(), [&](int unitIdx, unsigned threadIdx) {
+        EXPECT_LT(threadIdx, pool.nThreads);
+        visits[unitIdx]++;
+    });
+
+    for (int i = 0; i < visits.size(); ++i) {
+        EXPECT_EQ(visits[i], 1);
+    }
+}